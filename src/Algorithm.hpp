@@ -33,6 +33,9 @@ namespace PA
 
 	template <typename TContainer, typename TComp>
 	inline auto Sort(TContainer& c, TComp comp) -> V;
+
+	template <typename TForwardIt, typename T>
+	inline auto LowerBound(TForwardIt first, TForwardIt last, const T& v) -> TForwardIt;
 }
 
 
@@ -72,4 +75,10 @@ namespace PA
 		std::sort(c.begin(), c.end(), comp);
 	}
 
+
+	template<typename TForwardIt, typename T>
+	auto LowerBound(TForwardIt first, TForwardIt last, const T& v) -> TForwardIt
+	{
+		return std::lower_bound(first, last, v);
+	}
 }
\ No newline at end of file
@@ -24,8 +24,15 @@
 #include "Random.hpp"
 #include "Serialization.hpp"
 #include "ThreadPool.hpp"
+#include "Parallel.hpp"
+#include "Checkpoint.hpp"
 #include "Convolution.hpp"
 #include "SDF.hpp"
+#include "Time.hpp"
+#include "TripleBuffer.hpp"
+#include "StrokeStore.hpp"
+#include "Pyramid.hpp"
+#include "SumTree.hpp"
 
 namespace PA
 {
@@ -52,48 +59,196 @@ namespace PA
 			B serializeToVideo = true;
 			B darkOnLight = true;
 			B nonRandomStrokeSelection = false;
+			U32 proposalsPerStep = 1;
+			B tiledAnnealing = false;
+			U32 stepsPerTile = 1024;
+			// Zero picks a random seed.
+			U32 seed = 0;
+			// Zero disables the respective checkpoint trigger.
+			U32 checkpointEverySteps = 0;
+			F32 checkpointEverySeconds = 600.f;
+			// Zero uses every logical core.
+			U32 threadCount = 0;
+			// Keeps the fragments of every stroke in half the memory, with
+			// their values quantized to 16 bits.
+			B compactFragments = false;
+			// Keeps only the fragments of the most recently changed strokes,
+			// the others are rasterized again whenever they are needed.
+			// Checkpoints are then written without fragments. Zero keeps all.
+			U32 fragmentCacheMB = 0;
+			// Accumulates strokes on an A16Fixed surface, half the size of the
+			// float one, on which adding and removing strokes is exact.
+			// Energies are computed from it directly and the A8 surface is
+			// only converted for the preview. Moves that would pile more
+			// strokes on a pixel than the format holds are never taken.
+			B fixedPointSurface = false;
+			// Anneals against the reference reduced this many times first and
+			// refines one level at a time, reusing the strokes. Level l lasts
+			// until step maxSteps >> l, so the full resolution gets the second
+			// half of the steps. Zero anneals at full resolution throughout.
+			U32 pyramidLevels = 0;
+			// Draws the anchors of proposals from lebesgue blocks in proportion
+			// to the squared error left in them instead of uniformly. Not used
+			// with tiledAnnealing.
+			B residualSampling = false;
+			// Proposals move a stroke whose bounds overlap the new curve,
+			// picked uniformly among those, instead of any stroke. Not used
+			// with tiledAnnealing.
+			B localStrokeSelection = false;
+			Str svgPath = "out.svg";
+			Str webpPath = "out.webp";
+			Str videoPath = "out.ogv";
+			Str checkpointPath = "save.pa";
 		};
 
 		Annealer(const RawCPUImage* referance, const Config& cfg = Config());
 		~Annealer();
-		auto CopyCurrentApproximationToColor(ColorU32* data, U32 stride) -> V;
+		// Converts the tiles that changed in the latest published snapshot into
+		// the linear preview. Returns the region that changed, empty if no new
+		// snapshot was published. Never blocks the annealing thread.
+		auto UpdatePreview() -> Extent;
+		auto GetPreview() -> LockedTexture;
 		auto AnnealBezier() -> B;
 		auto ShutDownThreadPool() -> V;
 
 	private:
         static constexpr U32 logAfterSteps = 1u << 16;
 		static constexpr U32 updateScreenAfterSteps = 1024;
-		static constexpr StrView CSaveFile = "save.pa"sv;
+		// Changes are tracked in lebesgue ordered tiles of 64x64 pixels.
+		static constexpr U32 dirtyTileShift = 12;
+		// Strokes rasterized at once when all of them need their fragments.
+		static constexpr U32 rasterizeStrokesChunk = 4096;
+		// Coarser levels leave too few pixels to place strokes on.
+		static constexpr U32 maxPyramidLevels = 8;
+		static constexpr U32 minPyramidSide = 16;
+		// Residuals are tracked per lebesgue block of 8x8 pixels.
+		static constexpr U32 residualTileShift = 6;
+
+		struct Proposal
+		{
+			U32 strokeIdx;
+			QuadraticBezier curve;
+			Scalar width;
+			Scalar pigment;
+			Scalar temperature;
+			Array<Fragment> fragments;
+			// Fragments of the stroke before the proposal, set by EvaluateProposal.
+			Span<const Fragment> oldFragments;
+			Array<Fragment> oldFragmentsScratch;
+
+			Scalar localEnergy;
+			Scalar removeEnergy;
+			Scalar updateEnergy;
+			Scalar addEnergy;
+		};
 
-		auto GetEnergy(const RawCPUImage& img0) -> TF;
+		enum class EOperation
+		{
+			Reject,
+			Remove,
+			Update,
+			Add
+		};
+
+		struct Tile
+		{
+			Array<U32> strokes;
+			Span<const U32> edgeSupport;
+			RandomEngine randomEngine;
+			Proposal proposal;
+			Array<Proposal> addedStrokes;
+			Array<Proposal> updatedStrokes;
+			Array<U32> removedStrokes;
+			U32 addBudget = 0;
+			U32 steps = 0;
+			Scalar energyImprovement = 0;
+			B modified = false;
+		};
 
-		auto GetLocalEnergy(const RawCPUImage& img0, const Array<Fragment>& f0, const Array<Fragment>& f1) -> TF;
+		auto SelectStroke() -> U32;
+		// One of the strokes around curve, fallbackIdx if there are none. With
+		// excludeSelected strokes already in the batch are skipped.
+		auto SelectNearbyStroke(const QuadraticBezier& curve, U32 fallbackIdx, B excludeSelected) -> U32;
+		auto GenerateProposal(Proposal& proposal, Span<const U32> anchors, Scalar temperature, RandomEngine& engine) -> V;
+		auto EvaluateProposal(Proposal& proposal) -> V;
+		auto SelectOperation(const Proposal& proposal, B canAdd, RandomEngine& engine) -> Pair<EOperation, Scalar>;
+		auto ApplyToSurfaces(EOperation operation, Span<const Fragment> oldFragments, Span<const Fragment> newFragments, B markDirtyTiles = true) -> V;
+		auto MarkDirtyTiles(U32 lebesgueBegin, U32 lebesgueEnd) -> V;
+		auto PublishSnapshot() -> V;
+		auto AnnealBezierBatch() -> U32;
+		auto AnnealBezierTiled() -> U32;
+		auto AnnealTile(Tile& tile, U32 tileIdx, Scalar coolingFactor) -> V;
+		auto FinishSteps(U32 stepsTaken, F64 startTime) -> V;
+
+		auto GetEnergy(const RawCPUImage& img0) -> TF;
 
 		auto InitBezier() -> V;
 		auto FindEdgeSupport() -> V;
-
-		auto RemoveCurve(U32 curveIdx) -> V;
-		auto AddCurve(QuadraticBezier&& newCurve, Array<Fragment>&& newFragments, Scalar width, Scalar pigment) -> V;
+		auto SetUpTiles() -> V;
+		auto ClearHDRSurface(RawCPUImage& surface) const -> V;
+
+		auto GetPyramidLevel(U32 step) const -> U32;
+		// Anneals against the reference at the pyramid level from now on. The
+		// surfaces are resized and cleared, and the strokes rasterized again
+		// unless the store holds fragments for this level.
+		auto SetPyramidLevel(U32 level) -> V;
+
+		auto SetUpResidualSampling() -> V;
+		// Squared error left in the residual tile, zero for tiles without
+		// anchors so they are never drawn.
+		auto GetTileWeight(U32 tile) const -> TF;
+		auto UpdateTileWeights(Span<const Fragment> fragments) -> V;
+		// Anchors of a tile drawn by weight, all of edgeSupport without
+		// residual sampling.
+		auto SampleAnchors(RandomEngine& engine) -> Span<const U32>;
+
+		// Rasterizes every stroke and puts it on the HDR surface.
+		auto RasterizeStrokes() -> V;
+		// Rasterizes the stroke again into scratch if the store dropped its
+		// fragments. Safe to call concurrently for different strokes.
+		auto GetStrokeFragments(U32 idx, Array<Fragment>& scratch) -> Span<const Fragment>;
+		// Gives fragments rasterized again by GetStrokeFragments back to the
+		// store, so the stroke is not rasterized on every proposal for it.
+		auto CacheStrokeFragments(U32 idx, Span<const Fragment> fragments) -> V;
 		auto PruneCurves() -> V;
 
 		auto SaveProgress() -> V;
-		auto LoadProgress() -> V;
+		auto LoadProgress() -> B;
+		auto TakeCheckpoint() -> B;
 
 		auto InsideInterestRegion(U32 i, U32 j) const -> B;
 		auto InsideInterestRegion(U32 i) const -> B;
 
 		RawCPUImage grayscaleReference;
+		// At the current pyramid level, the surfaces match its size.
 		RawCPUImage grayscaleReferenceFiltered;
-		RawCPUImage currentApproximation;
+		// The finer levels still to be annealed, full resolution first.
+		Array<RawCPUImage> referencePyramid;
+		// Stroke widths are kept in pixels of the full resolution.
+		Scalar strokeWidthScale = 1;
 		RawCPUImage workingApproximation;
 		RawCPUImage workingApproximationHDR;
 
-		Array<QuadraticBezier> strokes;
-		Array<Scalar> widths;
-		Array<Scalar> pigments;
-		Array<Array<Fragment>> fragmentsMap;
+		StrokeStore<TF> strokes;
 
 		Array<U32> edgeSupport;
+		// The part of edgeSupport GenerateProposal accepts, by residual tile,
+		// with the offset of the first anchor of every tile.
+		Array<U32> residualAnchors;
+		Array<U32> residualAnchorOffsets;
+		SumTree<TF> residualTiles;
+
+		Proposal proposal;
+		Array<Proposal> proposals;
+		DynamicBitset selectedStrokes;
+		Array<U32> nearbyStrokes;
+		DynamicBitset claimedPixels;
+		Array<U32> claimedPixelsList;
+		Array<U32> removedStrokes;
+
+		Array<Tile> tiles;
+		Array<U32> borderStrokes;
+		U32 tileShift = 0;
 
 		Config config;
 
@@ -102,14 +257,38 @@ namespace PA
 		Scalar optimalEnergy;
 
 		U32 step = 0;
+		U32 selectionCounter = 0;
+		TF avgStepTime = 0;
 
-		using FragmentsMapDrawFunc = Void(*)(Array<Array<Fragment>>& fragments, RawCPUImage& surface);
-		using FragmentsDrawFunc = Void(*)(Array<Fragment>& fragments, RawCPUImage& surface);
-		FragmentsMapDrawFunc PutFragmentsMapOnHDRSurface = nullptr;
+		RandomEngine randomEngine;
+
+		using FragmentsDrawFunc = Void(*)(Span<const Fragment> fragments, RawCPUImage& surface);
 		FragmentsDrawFunc PutFragmentsOnHDRSurface = nullptr;
-		FragmentsDrawFunc RemoveFragmentsFromHDRSurface = nullptr;
 
-		Mutex currentApproximationLock;
+		U32 lastCheckpointStep = 0;
+		F64 lastCheckpointTime = 0;
+		CheckpointWriter<TF> checkpointWriter;
+
+		// workingApproximation as of some generation. Every tile carries the
+		// generation it last changed in, so a snapshot only copies the tiles
+		// that changed since it was last filled and the preview only converts
+		// the tiles that differ from what it shows.
+		struct Snapshot
+		{
+			Array<Byte> pixels;
+			Array<U32> tileGenerations;
+		};
+
+		// Tiles of workingApproximation changed since the last snapshot.
+		DynamicBitset dirtyTiles;
+		U32 dirtyTilesCount = 0;
+		U32 generation = 0;
+		Array<U32> tileGenerations;
+		TripleBuffer<Snapshot> snapshots;
+
+		// Owned by the presenting thread.
+		Array<U32> previewTileGenerations;
+		Array<ColorU32> preview;
 		ThreadPool<> threadPool;
 	};
 }
@@ -121,76 +300,88 @@ namespace PA
 	inline Annealer<TF>::Annealer(const RawCPUImage* reference, const Config& cfg) :
 		grayscaleReference(reference->width, reference->height, EFormat::A8, true),
 		grayscaleReferenceFiltered(reference->width, reference->height, EFormat::A8, true),
-		currentApproximation(reference->width, reference->height, EFormat::A8, true),
 		workingApproximation(reference->width, reference->height, EFormat::A8, true),
-		workingApproximationHDR(reference->width, reference->height, EFormat::A32Float, true)
+		workingApproximationHDR(reference->width, reference->height, cfg.fixedPointSurface ? EFormat::A16Fixed : EFormat::A32Float, true),
+		strokes(cfg.compactFragments),
+		checkpointWriter(cfg.checkpointPath),
+		dirtyTilesCount(Max(U32(workingApproximation.data.size() >> dirtyTileShift), 1u)),
+		snapshots({ Array<Byte>(workingApproximation.data.size()), Array<U32>(dirtyTilesCount, 0) }),
+		threadPool(cfg.threadCount ? cfg.threadCount : GetLogicalCPUCount())
 	{
+		randomEngine.seed(cfg.seed ? cfg.seed : GRandomSeed());
+		strokes.SetFragmentsBudget(U64(cfg.fragmentCacheMB) << 20);
+
 		if (cfg.darkOnLight)
 		{
 			PutFragmentsOnHDRSurface = SubtractFragmentsFromHDRSurface;
-			RemoveFragmentsFromHDRSurface = AddFragmentsOnHDRSurface;
-			PutFragmentsMapOnHDRSurface = SubtractFragmentsFromHDRSurface;
 		}
 		else
 		{
 			PutFragmentsOnHDRSurface = AddFragmentsOnHDRSurface;
-			RemoveFragmentsFromHDRSurface = SubtractFragmentsFromHDRSurface;
-			PutFragmentsMapOnHDRSurface = AddFragmentsOnHDRSurface;
 		}
 
 		grayscaleReference.Clear(Byte(cfg.bgLightness));
-		currentApproximation.Clear(Byte(cfg.bgLightness));
-		workingApproximation.Clear(Byte(cfg.bgLightness));
-		workingApproximationHDR.Clear(F32(cfg.bgLightness / 255.f));
 
-		for (auto i = 0u; i < reference->height; ++i)
-		{
-			for (auto j = 0u; j < reference->width; ++j)
+		LinearToLebesgue
+		(
+			(const ColorU32*)reference->data.data(),
+			reference->width,
+			grayscaleReference.data.data(),
+			reference->width,
+			reference->height,
+			[](const ColorU32* in, Byte* out, U32 count)
 			{
-				auto idx = LebesgueCurve(j, i);
-				auto inColor = ((ColorU32*)reference->data.data())[i * reference->width + j];
-				auto grayscaleColor = RGBAToGrayscale(inColor);
-				this->grayscaleReference.data[idx] = grayscaleColor;
+				for (auto i = 0u; i < count; ++i)
+				{
+					out[i] = RGBAToGrayscale(in[i]);
+				}
 			}
-		}
+		);
 
 		config = cfg;
 		config.maxStrokes = cfg.maxStrokes ? cfg.maxStrokes : (reference->width * reference->height / 256);
 		config.edgeContribution = Clamp(cfg.edgeContribution, 0.f, 1.f);
+		config.residualSampling = cfg.residualSampling && !cfg.tiledAnnealing;
+		config.localStrokeSelection = cfg.localStrokeSelection && !cfg.tiledAnnealing;
+		strokes.SetIndexed(config.localStrokeSelection);
+		config.pyramidLevels = Min(cfg.pyramidLevels, maxPyramidLevels);
+		while (config.pyramidLevels && (Min(reference->width, reference->height) >> config.pyramidLevels) < minPyramidSide)
+		{
+			config.pyramidLevels--;
+		}
 
 		auto grayscaleReferenceEdges = GradientMagnitude(threadPool, grayscaleReference);
 		grayscaleReferenceFiltered = AdditiveBlendA8(grayscaleReference, grayscaleReferenceEdges, 1.f - config.edgeContribution);
 
-		FindEdgeSupport();
+		if (config.tiledAnnealing)
+		{
+			// Seeds the tiles before the strokes are drawn, their edge support
+			// is set with the pyramid level.
+			SetUpTiles();
+		}
 
 		this->maxTemperature = 255 * 255;
 		temperature = maxTemperature;
 
-		if (FileExists(CSaveFile))
-		{
-			LoadProgress();
-		}
-		else
+		if (!FileExists(config.checkpointPath) || !LoadProgress())
 		{
 			InitBezier();
 		}
 
-		fragmentsMap.resize(strokes.size());
-		RasterizeToFragments
-		(
-			Span<const QuadraticBezier>(strokes),
-			Span<const TF>(widths),
-			Span<const TF>(pigments),
-			fragmentsMap,
-			grayscaleReference.width,
-			grayscaleReference.height,
-			threadPool
-		);
+		SetPyramidLevel(GetPyramidLevel(step));
 
-		PutFragmentsMapOnHDRSurface(fragmentsMap, workingApproximationHDR);
-		CopyHDRSurfaceToGSSurface(workingApproximationHDR, workingApproximation);
-		currentApproximation = workingApproximation;
-		optimalEnergy = GetEnergy(currentApproximation);
+		// Snapshots and the preview are kept at full resolution.
+		dirtyTiles.Expand(dirtyTilesCount);
+		tileGenerations.resize(dirtyTilesCount, 0);
+		previewTileGenerations.resize(dirtyTilesCount, 0);
+		preview.resize(grayscaleReference.width * grayscaleReference.height);
+
+		// The first snapshot carries every tile.
+		MarkDirtyTiles(0, workingApproximation.data.size());
+		PublishSnapshot();
+
+		lastCheckpointStep = step;
+		lastCheckpointTime = GetTimeStampUS();
 	}
 
 	template<typename TF>
@@ -198,26 +389,60 @@ namespace PA
 	{
 		PruneCurves();
 		SaveProgress();
-		SerializeToWebP(workingApproximationHDR);
-		// TODO: Fix SerializeToSVG for dark backgrounds.
-		SerializeToSVG
-		(
-			Span<const QuadraticBezier>(strokes),
-			Span<const TF>(widths),
-			Span<const TF>(pigments),
-			grayscaleReference.width,
-			grayscaleReference.height
-		);
-		SerializeToVideo
-		(
-			Span<const QuadraticBezier>(strokes),
-			Span<const TF>(widths),
-			Span<const TF>(pigments),
-			grayscaleReference.width,
-			grayscaleReference.height,
-			config.darkOnLight,
-			config.bgLightness
-		);
+		if (referencePyramid.empty())
+		{
+			SerializeToWebP(workingApproximationHDR, config.webpPath);
+		}
+		else
+		{
+			// Stopped at a coarse level. The thread pool may be shut down, so
+			// the full resolution is rendered on this thread.
+			RawCPUImage surface(grayscaleReference.width, grayscaleReference.height, workingApproximationHDR.format, true);
+			ClearHDRSurface(surface);
+			Array<Fragment> fragments;
+			for (auto i = 0u; i < strokes.Size(); ++i)
+			{
+				RasterizeToFragments
+				(
+					strokes.GetCurve(i),
+					fragments,
+					surface.width,
+					surface.height,
+					strokes.GetPigments()[i],
+					strokes.GetWidths()[i]
+				);
+				PutFragmentsOnHDRSurface(fragments, surface);
+			}
+			SerializeToWebP(surface, config.webpPath);
+		}
+		if (config.serializeToSVG)
+		{
+			// TODO: Fix SerializeToSVG for dark backgrounds.
+			SerializeToSVG
+			(
+				strokes.GetCurves(),
+				strokes.GetWidths(),
+				strokes.GetPigments(),
+				grayscaleReference.width,
+				grayscaleReference.height,
+				config.svgPath
+			);
+		}
+		if (config.serializeToVideo)
+		{
+			SerializeToVideo
+			(
+				strokes.GetCurves(),
+				strokes.GetWidths(),
+				strokes.GetPigments(),
+				grayscaleReference.width,
+				grayscaleReference.height,
+				config.darkOnLight,
+				config.bgLightness,
+				config.videoPath,
+				config.threadCount ? config.threadCount : GetLogicalCPUCount()
+			);
+		}
 	}
 
 	template<typename TF>
@@ -225,9 +450,96 @@ namespace PA
 	{
 		for (auto i = 0u; i < config.maxStrokes; ++i)
 		{
-			strokes.push_back(GetRandom2DQuadraticBezierInRange(TF(1)));
-			widths.push_back(GetUniformFloat(TF(1), TF(config.maxWidth)));
-			pigments.push_back(GetUniformFloat(TF(0), TF(1)));
+			auto curve = GetRandom2DQuadraticBezierInRange(TF(1), TF(0), TF(1), randomEngine);
+			auto width = GetUniformFloat(TF(1), TF(config.maxWidth), randomEngine);
+			auto pigment = GetUniformFloat(TF(0), TF(1), randomEngine);
+			strokes.Add(curve, width, pigment, {});
+		}
+	}
+
+	template<typename TF>
+	inline auto Annealer<TF>::RasterizeStrokes() -> V
+	{
+		// Chunks bound the fragments held outside the store, which matters
+		// when the store only caches some of them.
+		Array<Array<Fragment>> fragmentsMap;
+		Array<TF> widths;
+		for (auto start = 0u; start < strokes.Size(); start += rasterizeStrokesChunk)
+		{
+			auto count = Min(rasterizeStrokesChunk, strokes.Size() - start);
+			fragmentsMap.resize(count);
+			widths.resize(count);
+			for (auto i = 0u; i < count; ++i)
+			{
+				widths[i] = strokes.GetWidths()[start + i] * strokeWidthScale;
+			}
+			RasterizeToFragments
+			(
+				strokes.GetCurves().subspan(start, count),
+				Span<const TF>(widths),
+				strokes.GetPigments().subspan(start, count),
+				fragmentsMap,
+				workingApproximationHDR.width,
+				workingApproximationHDR.height,
+				threadPool
+			);
+
+			U32 fragmentsCount = 0;
+			for (const auto& fragments : fragmentsMap)
+			{
+				fragmentsCount += U32(fragments.size());
+			}
+
+			strokes.ReserveFragments(fragmentsCount);
+			for (auto i = 0u; i < count; ++i)
+			{
+				auto& fragments = fragmentsMap[i];
+				if (strokes.IsCompact())
+				{
+					QuantizeFragments(fragments);
+				}
+				PutFragmentsOnHDRSurface(fragments, workingApproximationHDR);
+				strokes.SetFragments(start + i, fragments);
+			}
+		}
+	}
+
+
+	template<typename TF>
+	inline auto Annealer<TF>::GetStrokeFragments(U32 idx, Array<Fragment>& scratch) -> Span<const Fragment>
+	{
+		if (strokes.IsResident(idx))
+		{
+			strokes.Touch(idx);
+			return strokes.GetFragments(idx, scratch);
+		}
+
+		// The rasterizer is deterministic, so this matches what was put on
+		// the surfaces when the stroke was last changed.
+		RasterizeToFragments
+		(
+			strokes.GetCurve(idx),
+			scratch,
+			workingApproximationHDR.width,
+			workingApproximationHDR.height,
+			strokes.GetPigments()[idx],
+			strokes.GetWidths()[idx] * strokeWidthScale
+		);
+		if (strokes.IsCompact())
+		{
+			QuantizeFragments(scratch);
+		}
+		return Span<const Fragment>(scratch);
+	}
+
+
+	template<typename TF>
+	inline auto Annealer<TF>::CacheStrokeFragments(U32 idx, Span<const Fragment> fragments) -> V
+	{
+		// Storing may evict other strokes, never more than the budget allows.
+		if (!strokes.IsResident(idx))
+		{
+			strokes.SetFragments(idx, fragments);
 		}
 	}
 
@@ -235,7 +547,7 @@ namespace PA
 	inline auto Annealer<TF>::InsideInterestRegion(U32 i, U32 j) const -> B
 	{
 		auto p = Vec(i, j);
-		auto pNorm = grayscaleReference.ToNormalizedCoordinates(p) - TF(0.5);
+		auto pNorm = grayscaleReferenceFiltered.ToNormalizedCoordinates(p) - TF(0.5);
 		return SDF::Round(SDF::Box2D(pNorm, Vec(TF(config.screenCutoff))), TF(config.screenCutoffRadius)) < TF(0);
 	}
 
@@ -268,400 +580,1320 @@ namespace PA
 				}
 			}
 		}
+
+		Sort(edgeSupport, [](U32 i0, U32 i1) { return i0 < i1; });
 	}
 
 	template<typename TF>
-	inline auto Annealer<TF>::RemoveCurve(U32 curveIdx) -> V
+	inline auto Annealer<TF>::SetUpTiles() -> V
 	{
-		Swap(strokes[curveIdx], strokes.back());
-		strokes.pop_back();
-		Swap(widths[curveIdx], widths.back());
-		widths.pop_back();
-		Swap(pigments[curveIdx], pigments.back());
-		pigments.pop_back();
-		Swap(fragmentsMap[curveIdx], fragmentsMap.back());
-		fragmentsMap.pop_back();
+		auto stride = workingApproximationHDR.lebesgueStride;
+		auto tilesPerSide = 1u;
+		while (tilesPerSide * tilesPerSide < threadPool.GetMaxTasks() && tilesPerSide < stride)
+		{
+			tilesPerSide *= 2;
+		}
+
+		tileShift = 0;
+		for (auto side = stride; side > tilesPerSide; side /= 2)
+		{
+			tileShift += 2;
+		}
+
+		auto seededTiles = U32(tiles.size());
+		tiles.resize(tilesPerSide * tilesPerSide);
+		for (auto t = 0u; t < tiles.size(); ++t)
+		{
+			auto first = LowerBound(edgeSupport.begin(), edgeSupport.end(), t << tileShift);
+			auto last = LowerBound(edgeSupport.begin(), edgeSupport.end(), (t + 1) << tileShift);
+			tiles[t].edgeSupport = Span<const U32>(first, last);
+			if (t >= seededTiles)
+			{
+				tiles[t].randomEngine.seed(randomEngine());
+			}
+		}
 	}
 
 	template<typename TF>
-	inline auto Annealer<TF>::AddCurve(QuadraticBezier&& newCurve, Array<Fragment>&& newFragments, TF width, TF pigment) -> V
+	inline auto Annealer<TF>::ClearHDRSurface(RawCPUImage& surface) const -> V
 	{
-		strokes.emplace_back(newCurve);
-		widths.emplace_back(width);
-		pigments.emplace_back(pigment);
-		fragmentsMap.emplace_back(newFragments);
+		if (surface.format == EFormat::A16Fixed)
+		{
+			surface.Clear(ToFixed(config.bgLightness / 255.f));
+		}
+		else
+		{
+			surface.Clear(F32(config.bgLightness / 255.f));
+		}
 	}
 
 	template<typename TF>
-	inline auto Annealer<TF>::PruneCurves() -> V
+	inline auto Annealer<TF>::GetPyramidLevel(U32 step) const -> U32
 	{
-		for (auto i = 0; i < strokes.size(); ++i)
+		auto level = 0u;
+		while (level < config.pyramidLevels && step < (config.maxSteps >> (level + 1)))
 		{
-			auto& oldCurve = strokes[i];
-			auto& oldFragments = fragmentsMap[i];
+			level++;
+		}
+		return level;
+	}
 
-			if (oldFragments.empty())
-			{
-				RemoveCurve(i);
-				i--;
-				continue;
-			}
+	template<typename TF>
+	inline auto Annealer<TF>::SetPyramidLevel(U32 level) -> V
+	{
+		while (referencePyramid.size() < level)
+		{
+			referencePyramid.push_back(Move(grayscaleReferenceFiltered));
+			grayscaleReferenceFiltered = ReduceA8(referencePyramid.back());
+		}
+		while (referencePyramid.size() > level)
+		{
+			grayscaleReferenceFiltered = Move(referencePyramid.back());
+			referencePyramid.pop_back();
+		}
+		strokeWidthScale = TF(1) / TF(1u << level);
 
-			auto localEnergy = GetLocalEnergy(workingApproximation, oldFragments, Array<Fragment>());
+		auto width = grayscaleReferenceFiltered.width;
+		auto height = grayscaleReferenceFiltered.height;
+		if (workingApproximation.width != width || workingApproximation.height != height)
+		{
+			workingApproximation = RawCPUImage(width, height, EFormat::A8, true);
+			workingApproximationHDR = RawCPUImage(width, height, workingApproximationHDR.format, true);
+		}
+		workingApproximation.Clear(Byte(config.bgLightness));
+		ClearHDRSurface(workingApproximationHDR);
 
-			RemoveFragmentsFromHDRSurface(oldFragments, workingApproximationHDR);
-			CopyHDRSurfaceToGSSurface(workingApproximationHDR, workingApproximation, oldFragments);
-			auto removeEnergy = GetLocalEnergy(workingApproximation, oldFragments, Array<Fragment>());
+		edgeSupport.clear();
+		FindEdgeSupport();
+		if (config.tiledAnnealing)
+		{
+			SetUpTiles();
+		}
 
-			if (removeEnergy <= localEnergy)
-			{
-				RemoveCurve(i);
-				i--;
-			}
-			else
+		// Checkpoints written with fragments resume without re-rasterizing.
+		if (strokes.GetFragmentsCount())
+		{
+			Array<Fragment> scratch;
+			for (auto i = 0u; i < strokes.Size(); ++i)
 			{
-				PutFragmentsOnHDRSurface(oldFragments, workingApproximationHDR);
-				CopyHDRSurfaceToGSSurface(workingApproximationHDR, workingApproximation, oldFragments);
+				PutFragmentsOnHDRSurface(strokes.GetFragments(i, scratch), workingApproximationHDR);
 			}
 		}
+		else
+		{
+			RasterizeStrokes();
+		}
+		CopyHDRSurfaceToGSSurface(workingApproximationHDR, workingApproximation);
+		optimalEnergy = GetEnergy(workingApproximation);
+
+		if (config.residualSampling)
+		{
+			SetUpResidualSampling();
+		}
 	}
 
 	template<typename TF>
-	inline auto Annealer<TF>::SaveProgress() -> V
+	inline auto Annealer<TF>::SetUpResidualSampling() -> V
 	{
-		Array<Byte> outBuffer;
-		if (step < config.maxSteps)
+		auto stride = workingApproximation.lebesgueStride;
+		auto tilesCount = stride * stride >> residualTileShift;
+
+		residualAnchors.clear();
+		residualAnchorOffsets.assign(tilesCount + 1, 0);
+		for (auto idx : edgeSupport)
+		{
+			if (InsideInterestRegion(idx))
+			{
+				residualAnchors.push_back(idx);
+				residualAnchorOffsets[(idx >> residualTileShift) + 1]++;
+			}
+		}
+		for (auto t = 0u; t < tilesCount; ++t)
 		{
-			Serialize(outBuffer, this->config.maxSteps);
-			Serialize(outBuffer, this->config.maxStrokes);
-			Serialize(outBuffer, this->config.maxWidth);
-			Serialize(outBuffer, this->maxTemperature);
-			Serialize(outBuffer, this->step);
-			Serialize(outBuffer, this->temperature);
-			Serialize(outBuffer, this->optimalEnergy);
-			Serialize(outBuffer, this->strokes);
-			Serialize(outBuffer, this->widths);
-			Serialize(outBuffer, this->pigments);
-			Serialize(outBuffer, this->fragmentsMap);
+			residualAnchorOffsets[t + 1] += residualAnchorOffsets[t];
 		}
-		WriteWholeFile(CSaveFile, outBuffer);
+
+		Array<TF> weights(tilesCount);
+		ParallelFor
+		(
+			threadPool,
+			0,
+			tilesCount,
+			CPixelsPerChunk >> residualTileShift,
+			[&](U32 start, U32 end)
+			{
+				for (auto t = start; t < end; ++t)
+				{
+					weights[t] = GetTileWeight(t);
+				}
+			}
+		);
+		residualTiles.Build(weights);
 	}
 
 	template<typename TF>
-	inline auto Annealer<TF>::LoadProgress() -> V
+	inline auto Annealer<TF>::GetTileWeight(U32 tile) const -> TF
 	{
-		Array<Byte> inBuffer;
-		if (ReadWholeFile(CSaveFile, inBuffer))
+		if (residualAnchorOffsets[tile] == residualAnchorOffsets[tile + 1])
 		{
-			Span<const Byte> inData(inBuffer.data(), inBuffer.size());
-			Deserialize(inData, this->config.maxSteps);
-			Deserialize(inData, this->config.maxStrokes);
-			Deserialize(inData, this->config.maxWidth);
-			Deserialize(inData, this->maxTemperature);
-			Deserialize(inData, this->step);
-			Deserialize(inData, this->temperature);
-			Deserialize(inData, this->optimalEnergy);
-			Deserialize(inData, this->strokes);
-			Deserialize(inData, this->widths);
-			Deserialize(inData, this->pigments);
-			Deserialize(inData, this->fragmentsMap);
+			return 0;
 		}
-	}
 
+		static constexpr U32 side = 1u << (residualTileShift / 2);
+		auto begin = tile << residualTileShift;
+		auto [x0, y0] = LebesgueCurveInverse(begin);
+		auto inside = x0 + side <= workingApproximation.width && y0 + side <= workingApproximation.height;
+		// The A8 surface is stale on a fixed point surface.
+		auto isFixed = workingApproximationHDR.format == EFormat::A16Fixed;
+		auto fixedPtr = (const I16*)workingApproximationHDR.data.data();
 
-	template<typename TF>
-	inline auto Annealer<TF>::CopyCurrentApproximationToColor(ColorU32* data, U32 stride) -> V
-	{
-		currentApproximationLock.lock();
-		for (auto i = 0u; i < this->currentApproximation.height; ++i)
+		TF residual = 0;
+		for (auto i = begin; i < begin + (1u << residualTileShift); ++i)
 		{
-			for (auto j = 0u; j < this->currentApproximation.width; ++j)
+			if (!inside)
 			{
-				auto idx = LebesgueCurve(j, i);
-				auto inColor = this->currentApproximation.data[idx];
-				data[i * stride / 4 + j] = ColorU32(inColor, inColor, inColor, 255);
+				auto [x, y] = LebesgueCurveInverse(i);
+				if (x >= workingApproximation.width || y >= workingApproximation.height)
+				{
+					continue;
+				}
 			}
+			auto value = isFixed ? FixedToU8(fixedPtr[i]) : workingApproximation.data[i];
+			auto diff = TF(grayscaleReferenceFiltered.data[i]) - TF(value);
+			residual += diff * diff;
 		}
-		currentApproximationLock.unlock();
+		return residual;
 	}
 
 	template<typename TF>
-	inline auto Annealer<TF>::AnnealBezier() -> B
+	inline auto Annealer<TF>::UpdateTileWeights(Span<const Fragment> fragments) -> V
 	{
-		if (step >= config.maxSteps)
+		// Fragments are sorted, so the tiles they touch come in runs.
+		auto lastTile = ~0u;
+		for (const auto& fragment : fragments)
 		{
-            Log("Annealing done.");
-			return false;
+			auto tile = fragment.idx >> residualTileShift;
+			if (tile != lastTile)
+			{
+				residualTiles.Set(tile, GetTileWeight(tile));
+				lastTile = tile;
+			}
 		}
+	}
 
-		auto startTime = GetTimeStampUS();
-
-		temperature = temperature * TF(0.999);
-
-		U32 strokeIdx = 0;
-		if (config.nonRandomStrokeSelection)
-		{
-			static U32 counter = 0;
-			strokeIdx = counter;
-			counter = (counter + 1) % strokes.size();
-	 	}
-		else
+	template<typename TF>
+	inline auto Annealer<TF>::SampleAnchors(RandomEngine& engine) -> Span<const U32>
+	{
+		if (!config.residualSampling || residualTiles.GetTotal() <= TF(0))
 		{
-			strokeIdx = GetUniformU32(0, strokes.size() - 1);
+			return edgeSupport;
 		}
 
-		auto& oldCurve = strokes[strokeIdx];
-		auto& oldFragments = fragmentsMap[strokeIdx];
-		auto& oldWidth = widths[strokeIdx];
-		auto& oldPigment = pigments[strokeIdx];
+		auto tile = residualTiles.Find(GetUniformFloat(TF(0), residualTiles.GetTotal(), engine));
+		auto first = residualAnchorOffsets[tile];
+		return Span<const U32>(residualAnchors).subspan(first, residualAnchorOffsets[tile + 1] - first);
+	}
 
-		Array<Fragment> newFragments;
-		QuadraticBezier newCurve;
+	template<typename TF>
+	inline auto Annealer<TF>::PruneCurves() -> V
+	{
+		for (auto i = 0; i < I32(strokes.Size()); ++i)
+		{
+			if (!strokes.GetFragmentsCount(i))
+			{
+				strokes.Remove(i);
+				i--;
+				continue;
+			}
 
-		B validCurve = false; 
-		
-		auto maxLength = grayscaleReference.width * TF(0.1);
-		auto length = GetUniformFloat(TF(3), maxLength);
+			proposal.strokeIdx = i;
+			proposal.fragments.clear();
+			EvaluateProposal(proposal);
 
-		while (!validCurve) {
-			auto s0 = GetUniformU32(0, edgeSupport.size() - 1);
-			auto p1U = LebesgueCurveInverse(edgeSupport[s0]);
-			auto p1 = Vec(p1U.first, p1U.second);
-			auto p1Norm = grayscaleReference.ToNormalizedCoordinates(p1) - TF(0.5);
-			if (InsideInterestRegion(p1U.first, p1U.second)) {
-				auto a0 = GetUniformFloat(TF(0), Constants<TF>::C2Pi);
-				auto a2 = GetUniformFloat(TF(0), Constants<TF>::C2Pi);
-				auto p0 = p1 + length * Vec(Cos(a0), Sin(a0));
-				auto p2 = p1 + length * Vec(Cos(a2), Sin(a2));
-				newCurve = GetBezierPassingThrough(p0, p1, p2);
-				validCurve = true;
+			if (proposal.removeEnergy <= proposal.localEnergy)
+			{
+				ApplyToSurfaces(EOperation::Remove, proposal.oldFragments, proposal.fragments);
+				strokes.Remove(i);
+				i--;
 			}
 		}
+	}
 
+	template<typename TF>
+	inline auto Annealer<TF>::SaveProgress() -> V
+	{
+		checkpointWriter.Flush();
 
-		grayscaleReference.ToNormalizedCoordinates(Span<Vec>(newCurve.points));
-		auto newPigment = GetUniformFloat(TF(0.01), TF(1));
-		auto newWidth = Min(config.maxWidth, GetExponentialFloat((TF(2) / config.maxWidth)) * temperature + 1);
-
-		RasterizeToFragments
-		(
-			newCurve,
-			newFragments,
-			workingApproximationHDR.width,
-			workingApproximationHDR.height,
-			newPigment,
-			newWidth
-		);
-		
-		auto localEnergy = GetLocalEnergy(workingApproximation, oldFragments, newFragments);
-
-		RemoveFragmentsFromHDRSurface(oldFragments, workingApproximationHDR);
-		CopyHDRSurfaceToGSSurface(workingApproximationHDR, workingApproximation, oldFragments);
-		auto removeEnergy = GetLocalEnergy(workingApproximation, oldFragments, newFragments);
-
-		PutFragmentsOnHDRSurface(newFragments, workingApproximationHDR);
-		CopyHDRSurfaceToGSSurface(workingApproximationHDR, workingApproximation, newFragments);
-		auto updateEnergy = GetLocalEnergy(workingApproximation, oldFragments, newFragments);
-
-		PutFragmentsOnHDRSurface(oldFragments, workingApproximationHDR);
-		CopyHDRSurfaceToGSSurface(workingApproximationHDR, workingApproximation, oldFragments);
-		auto addEnergy = GetLocalEnergy(workingApproximation, oldFragments, newFragments);
-
-		enum class OpType { Remove, Update, Add } opType = OpType::Remove;
+		if (step >= config.maxSteps)
+		{
+			if (FileExists(config.checkpointPath))
+			{
+				RemoveFile(config.checkpointPath);
+			}
+			return;
+		}
 
-		auto currentEnergy = removeEnergy;
+		TakeCheckpoint();
+		checkpointWriter.Flush();
+	}
 
-		if (updateEnergy < currentEnergy)
+	template<typename TF>
+	inline auto Annealer<TF>::TakeCheckpoint() -> B
+	{
+		// Only the copy happens here, serialization and disk access are left
+		// to the writer thread.
+		auto snapshot = checkpointWriter.BeginSnapshot();
+		if (!snapshot)
 		{
-			currentEnergy = updateEnergy;
-			opType = OpType::Update;
+			return false;
 		}
 
-		if (addEnergy < currentEnergy && strokes.size() < config.maxStrokes)
+		snapshot->state.maxSteps = config.maxSteps;
+		snapshot->state.maxStrokes = config.maxStrokes;
+		snapshot->state.maxWidth = config.maxWidth;
+		snapshot->state.step = step;
+		snapshot->state.width = grayscaleReference.width;
+		snapshot->state.height = grayscaleReference.height;
+		snapshot->state.maxTemperature = maxTemperature;
+		snapshot->state.temperature = temperature;
+		snapshot->state.optimalEnergy = optimalEnergy;
+		snapshot->strokes.assign(strokes.GetCurves().begin(), strokes.GetCurves().end());
+		snapshot->widths.assign(strokes.GetWidths().begin(), strokes.GetWidths().end());
+		snapshot->pigments.assign(strokes.GetPigments().begin(), strokes.GetPigments().end());
+		if (config.fragmentCacheMB || !referencePyramid.empty())
 		{
-			currentEnergy = addEnergy;
-			opType = OpType::Add;
+			snapshot->fragmentOffsets.clear();
+			snapshot->fragments.clear();
 		}
+		else
+		{
+			strokes.CopyFragments(snapshot->fragmentOffsets, snapshot->fragments);
+		}
+		checkpointWriter.CommitSnapshot(snapshot);
 
-		auto energyImprovement = localEnergy - currentEnergy;
-		auto transitionThreshold = Exp((energyImprovement) / temperature);
-		auto minPixelImprovement = TF(5) / (workingApproximation.width * workingApproximation.height);
+		lastCheckpointStep = step;
+		lastCheckpointTime = GetTimeStampUS();
+		return true;
+	}
 
-		// Never add new curves for no reason.
-		if (energyImprovement < minPixelImprovement && opType == OpType::Add)
+	template<typename TF>
+	inline auto Annealer<TF>::LoadProgress() -> B
+	{
+		MappedFile file;
+		CheckpointView<TF> view;
+		if (!file.Open(config.checkpointPath) || !OpenCheckpoint(file.GetData(), view))
 		{
-			transitionThreshold = 0;
+			LogError("Ignoring invalid checkpoint ", config.checkpointPath, ".");
+			return false;
 		}
 
-		if (currentEnergy < localEnergy || transitionThreshold > GetUniformFloat<TF>())
+		if (view.state.width != grayscaleReference.width || view.state.height != grayscaleReference.height)
 		{
-			optimalEnergy -= energyImprovement > 0 ? energyImprovement : 0.f;
-			if (opType == OpType::Remove)
-			{
-				RemoveFragmentsFromHDRSurface(newFragments, workingApproximationHDR);
-				CopyHDRSurfaceToGSSurface(workingApproximationHDR, workingApproximation, newFragments);
-				RemoveFragmentsFromHDRSurface(oldFragments, workingApproximationHDR);
-				CopyHDRSurfaceToGSSurface(workingApproximationHDR, workingApproximation, oldFragments);
-				RemoveCurve(strokeIdx);
-			}
-			else if (opType == OpType::Add)
-			{
-				AddCurve(Move(newCurve), Move(newFragments), newWidth, newPigment);
-			}
-			else
-			{
-				RemoveFragmentsFromHDRSurface(oldFragments, workingApproximationHDR);
-				CopyHDRSurfaceToGSSurface(workingApproximationHDR, workingApproximation, oldFragments);
-				oldFragments = newFragments;
-				oldCurve = newCurve;
-				oldWidth = newWidth;
-				oldPigment = newPigment;
-			}
+			LogError("Ignoring checkpoint ", config.checkpointPath, " of a ", view.state.width, "x", view.state.height, " image.");
+			return false;
 		}
-		else
+
+		// Fragments are at full resolution.
+		auto extentSize = grayscaleReference.lebesgueStride * grayscaleReference.lebesgueStride;
+		for (const auto& fragment : view.fragments)
 		{
-			RemoveFragmentsFromHDRSurface(newFragments, workingApproximationHDR);
-			CopyHDRSurfaceToGSSurface(workingApproximationHDR, workingApproximation, newFragments);
+			if (fragment.idx >= extentSize)
+			{
+				LogError("Ignoring checkpoint ", config.checkpointPath, " with fragments outside the image.");
+				return false;
+			}
 		}
 
-		if (!(step % updateScreenAfterSteps) || step == config.maxSteps - 1)
+		config.maxSteps = view.state.maxSteps;
+		config.maxStrokes = view.state.maxStrokes;
+		config.maxWidth = view.state.maxWidth;
+		step = view.state.step;
+		maxTemperature = view.state.maxTemperature;
+		temperature = view.state.temperature;
+		optimalEnergy = view.state.optimalEnergy;
+
+		// With a fragment cache the strokes are rasterized again in parallel
+		// instead, see RasterizeStrokes.
+		auto loadFragments = !view.fragmentOffsets.empty() && !config.fragmentCacheMB && !GetPyramidLevel(step);
+		strokes.ReserveFragments(loadFragments ? U32(view.fragments.size()) : 0);
+		for (auto i = 0u; i < view.strokes.size(); ++i)
 		{
-			currentApproximationLock.lock();
-			currentApproximation = workingApproximation;
-			currentApproximationLock.unlock();
+			auto fragments = Span<const Fragment>();
+			if (loadFragments)
+			{
+				auto first = view.fragmentOffsets[i];
+				fragments = view.fragments.subspan(first, view.fragmentOffsets[i + 1] - first);
+			}
+			strokes.Add(view.strokes[i], view.widths[i], view.pigments[i], fragments);
 		}
 
-		step++;
-		auto progress = TF(step) / config.maxSteps * TF(100);
+		return true;
+	}
 
-		auto endTime = GetTimeStampUS();
+	template<typename TF>
+	inline auto Annealer<TF>::UpdatePreview() -> Extent
+	{
+		static constexpr U32 tileSide = 1u << (dirtyTileShift / 2);
 
-		static auto avgTime = TF(0);
+		if (!snapshots.Acquire())
+		{
+			return {};
+		}
 
-		avgTime += endTime - startTime;
+		const auto& snapshot = snapshots.GetFront();
+		auto width = grayscaleReference.width;
+		auto height = grayscaleReference.height;
+		U32 x0 = width;
+		U32 y0 = height;
+		U32 x1 = 0;
+		U32 y1 = 0;
 
-		if (!(step % logAfterSteps))
+		for (auto t = 0u; t < dirtyTilesCount; ++t)
 		{
-			avgTime /= TF(logAfterSteps);
-			Log
+			if (snapshot.tileGenerations[t] == previewTileGenerations[t])
+			{
+				continue;
+			}
+			previewTileGenerations[t] = snapshot.tileGenerations[t];
+
+			auto [tileX, tileY] = LebesgueCurveInverse(t << dirtyTileShift);
+			if (tileX >= width || tileY >= height)
+			{
+				continue;
+			}
+
+			auto tileWidth = Min(tileSide, width - tileX);
+			auto tileHeight = Min(tileSide, height - tileY);
+			LebesgueToLinear
 			(
-				"Energy = ",
-				optimalEnergy,
-				"\tTemperature = ",
-				temperature,
-				"\tStrokesCount = ",
-				strokes.size(),
-				"\tProgress = ",
-				progress,
-				"%",
-				"\tAvgStepTime = ",
-				avgTime,
-				"us"
+				snapshot.pixels.data() + (t << dirtyTileShift),
+				preview.data() + tileY * width + tileX,
+				width,
+				tileWidth,
+				0,
+				tileHeight,
+				[](const Byte* in, ColorU32* out, U32 count)
+				{
+					for (auto i = 0u; i < count; ++i)
+					{
+						out[i] = ColorU32(in[i], in[i], in[i], 255);
+					}
+				}
 			);
-			avgTime = 0;
+
+			x0 = Min(x0, U32(tileX));
+			y0 = Min(y0, U32(tileY));
+			x1 = Max(x1, tileX + tileWidth);
+			y1 = Max(y1, tileY + tileHeight);
 		}
 
-        return true;
+		if (x1 <= x0 || y1 <= y0)
+		{
+			return {};
+		}
+		return { x0, y0, 0, x1 - x0, y1 - y0, 1 };
 	}
 
 
+	template<typename TF>
+	inline auto Annealer<TF>::GetPreview() -> LockedTexture
+	{
+		auto width = grayscaleReference.width;
+		return { width, grayscaleReference.height, I32(width * sizeof(ColorU32)), (Byte*)preview.data() };
+	}
+
 
 	template<typename TF>
-	inline auto Annealer<TF>::ShutDownThreadPool() -> V
+	inline auto Annealer<TF>::AnnealBezier() -> B
 	{
-		threadPool.ShutDown();
+		if (step >= config.maxSteps)
+		{
+            Log("Annealing done.");
+			return false;
+		}
+
+		auto level = GetPyramidLevel(step);
+		if (level < referencePyramid.size())
+		{
+			strokes.ClearFragments();
+			SetPyramidLevel(level);
+			MarkDirtyTiles(0, workingApproximation.data.size());
+			Log("Annealing at ", workingApproximation.width, "x", workingApproximation.height, ".");
+		}
+
+		auto startTime = GetTimeStampUS();
+
+		if (config.tiledAnnealing)
+		{
+			auto stepsTaken = AnnealBezierTiled();
+			if (stepsTaken)
+			{
+				FinishSteps(stepsTaken, startTime);
+				return true;
+			}
+		}
+		else if (config.proposalsPerStep > 1)
+		{
+			auto stepsTaken = AnnealBezierBatch();
+			FinishSteps(stepsTaken, startTime);
+			return true;
+		}
+
+		temperature = temperature * TF(0.999);
+
+		proposal.strokeIdx = SelectStroke();
+		GenerateProposal(proposal, SampleAnchors(randomEngine), temperature, randomEngine);
+		if (config.localStrokeSelection)
+		{
+			proposal.strokeIdx = SelectNearbyStroke(proposal.curve, proposal.strokeIdx, false);
+		}
+		RasterizeToFragments
+		(
+			proposal.curve,
+			proposal.fragments,
+			workingApproximationHDR.width,
+			workingApproximationHDR.height,
+			proposal.pigment,
+			proposal.width * strokeWidthScale
+		);
+		EvaluateProposal(proposal);
+
+		auto [operation, energyImprovement] = SelectOperation(proposal, strokes.Size() < config.maxStrokes, randomEngine);
+
+		if (operation == EOperation::Reject)
+		{
+			CacheStrokeFragments(proposal.strokeIdx, proposal.oldFragments);
+		}
+		else
+		{
+			optimalEnergy -= energyImprovement > 0 ? energyImprovement : 0.f;
+			ApplyToSurfaces(operation, proposal.oldFragments, proposal.fragments);
+
+			if (operation == EOperation::Remove)
+			{
+				strokes.Remove(proposal.strokeIdx);
+			}
+			else if (operation == EOperation::Add)
+			{
+				strokes.Add(proposal.curve, proposal.width, proposal.pigment, proposal.fragments);
+			}
+			else
+			{
+				strokes.Update(proposal.strokeIdx, proposal.curve, proposal.width, proposal.pigment, proposal.fragments);
+			}
+		}
+
+		FinishSteps(1, startTime);
+
+        return true;
 	}
 
 
 	template<typename TF>
-	inline auto Annealer<TF>::GetEnergy(const RawCPUImage& img) -> TF
+	inline auto Annealer<TF>::SelectStroke() -> U32
 	{
-		auto extentSize = img.lebesgueStride * img.lebesgueStride;
-		auto imgSize = img.width * img.height;
-		auto taskCount = GetLogicalCPUCount();
-		auto pixelsPerTask = extentSize / taskCount;
+		U32 strokeIdx = 0;
+		if (config.nonRandomStrokeSelection)
+		{
+			strokeIdx = selectionCounter % strokes.Size();
+			selectionCounter = (strokeIdx + 1) % strokes.Size();
+	 	}
+		else
+		{
+			strokeIdx = GetUniformU32(0, strokes.Size() - 1, randomEngine);
+		}
+		return strokeIdx;
+	}
 
-		auto task =
-		[&](U32 start, U32 end) -> TF
+
+	template<typename TF>
+	inline auto Annealer<TF>::SelectNearbyStroke(const QuadraticBezier& curve, U32 fallbackIdx, B excludeSelected) -> U32
+	{
+		nearbyStrokes.clear();
+		strokes.QueryRegion(curve.GetBBox(), nearbyStrokes);
+		if (excludeSelected)
 		{
-			TF energy = 0;
-			for (auto i = start; i < end; ++i)
+			auto count = 0u;
+			for (auto strokeIdx : nearbyStrokes)
 			{
-				auto coords = LebesgueCurveInverse(i);
-				if (coords.first >= img.width || coords.second >= img.height)
+				if (!selectedStrokes.GetBitUnsafe(strokeIdx))
 				{
-					continue;
+					nearbyStrokes[count++] = strokeIdx;
 				}
+			}
+			nearbyStrokes.resize(count);
+		}
 
-				auto ref = TF(grayscaleReferenceFiltered.data[i]);
-				auto diff = ref - TF(img.data[i]);
-				energy += (diff * diff) / imgSize;
+		if (nearbyStrokes.empty())
+		{
+			return fallbackIdx;
+		}
+		return nearbyStrokes[GetUniformU32(0, nearbyStrokes.size() - 1, randomEngine)];
+	}
+
+
+	template<typename TF>
+	inline auto Annealer<TF>::GenerateProposal(Proposal& proposal, Span<const U32> anchors, Scalar temperature, RandomEngine& engine) -> V
+	{
+		B validCurve = false;
+
+		auto maxLength = grayscaleReferenceFiltered.width * TF(0.1);
+		auto length = GetUniformFloat(TF(3), maxLength, engine);
+
+		while (!validCurve) {
+			auto s0 = GetUniformU32(0, anchors.size() - 1, engine);
+			auto p1U = LebesgueCurveInverse(anchors[s0]);
+			auto p1 = Vec(p1U.first, p1U.second);
+			if (InsideInterestRegion(p1U.first, p1U.second)) {
+				auto a0 = GetUniformFloat(TF(0), Constants<TF>::C2Pi, engine);
+				auto a2 = GetUniformFloat(TF(0), Constants<TF>::C2Pi, engine);
+				auto p0 = p1 + length * Vec(Cos(a0), Sin(a0));
+				auto p2 = p1 + length * Vec(Cos(a2), Sin(a2));
+				proposal.curve = GetBezierPassingThrough(p0, p1, p2);
+				validCurve = true;
 			}
-			return energy;
+		}
+
+		grayscaleReferenceFiltered.ToNormalizedCoordinates(Span<Vec>(proposal.curve.points));
+		proposal.pigment = GetUniformFloat(TF(0.01), TF(1), engine);
+		proposal.width = Min(config.maxWidth, GetExponentialFloat((TF(2) / config.maxWidth), engine) * temperature + 1);
+		proposal.temperature = temperature;
+	}
+
+
+	template<typename TF>
+	inline auto Annealer<TF>::EvaluateProposal(Proposal& proposal) -> V
+	{
+		// Energies are computed without touching the surfaces so proposals
+		// for different strokes can be evaluated concurrently. Both fragment
+		// lists come out of the rasterizer in Morton order and are merged so
+		// every pixel of the footprint is visited exactly once.
+		auto& newFragments = proposal.fragments;
+		if (strokes.IsCompact())
+		{
+			// What gets added to the surfaces has to match what is subtracted
+			// once the stored fragments are decoded again.
+			QuantizeFragments(newFragments);
+		}
+		proposal.oldFragments = GetStrokeFragments(proposal.strokeIdx, proposal.oldFragmentsScratch);
+		auto oldFragments = proposal.oldFragments;
+
+		auto hdrPtr = (const F32*)workingApproximationHDR.data.data();
+		auto imgSize = workingApproximation.width * workingApproximation.height;
+		auto putSign = config.darkOnLight ? F32(-1) : F32(1);
+
+		auto squaredError =
+		[&](U32 idx, U8 value) -> TF
+		{
+			auto diff = TF(grayscaleReferenceFiltered.data[idx]) - TF(value);
+			return (diff * diff) / imgSize;
 		};
 
-		Array<TaskResult<TF>> results;
-		for (auto i = 0u; i < taskCount; ++i)
+		proposal.localEnergy = 0;
+		proposal.removeEnergy = 0;
+		proposal.updateEnergy = 0;
+		proposal.addEnergy = 0;
+
+		if (workingApproximationHDR.format == EFormat::A16Fixed)
+		{
+			// Wraps exactly like the fixed point surface does, see ApplyToSurfaces.
+			// Removing never leaves the range as the strokes all darken or all
+			// lighten, adding is ruled out where the sum would wrap.
+			auto fixedPtr = (const I16*)workingApproximationHDR.data.data();
+			auto fixedSign = config.darkOnLight ? -1 : 1;
+			auto updateFits = true;
+			auto addFits = true;
+
+			ForEachMergedFragment
+			(
+				oldFragments,
+				Span<const Fragment>(newFragments),
+				[&](U32 idx, F32 oldValue, F32 newValue)
+				{
+					auto hdr = I32(fixedPtr[idx]);
+					auto removed = hdr - fixedSign * ToFixed(oldValue);
+					auto added = fixedSign * ToFixed(newValue);
+
+					updateFits = updateFits && FitsFixed(removed + added);
+					addFits = addFits && FitsFixed(hdr + added);
+
+					proposal.localEnergy += squaredError(idx, FixedToU8(I16(hdr)));
+					proposal.removeEnergy += squaredError(idx, FixedToU8(I16(removed)));
+					proposal.updateEnergy += squaredError(idx, FixedToU8(I16(removed + added)));
+					proposal.addEnergy += squaredError(idx, FixedToU8(I16(hdr + added)));
+				}
+			);
+
+			if (!updateFits)
+			{
+				proposal.updateEnergy = Limits<Scalar>::infinity();
+			}
+			if (!addFits)
+			{
+				proposal.addEnergy = Limits<Scalar>::infinity();
+			}
+			return;
+		}
+
+		ForEachMergedFragment
+		(
+			oldFragments,
+			Span<const Fragment>(newFragments),
+			[&](U32 idx, F32 oldValue, F32 newValue)
+			{
+				auto hdr = hdrPtr[idx];
+				auto removed = hdr - putSign * oldValue;
+
+				proposal.localEnergy += squaredError(idx, workingApproximation.data[idx]);
+				proposal.removeEnergy += squaredError(idx, ClampedU8(removed * 255));
+				proposal.updateEnergy += squaredError(idx, ClampedU8((removed + putSign * newValue) * 255));
+				proposal.addEnergy += squaredError(idx, ClampedU8((hdr + putSign * newValue) * 255));
+			}
+		);
+	}
+
+
+	template<typename TF>
+	inline auto Annealer<TF>::SelectOperation(const Proposal& proposal, B canAdd, RandomEngine& engine) -> Pair<EOperation, Scalar>
+	{
+		auto operation = EOperation::Remove;
+		auto currentEnergy = proposal.removeEnergy;
+
+		if (proposal.updateEnergy < currentEnergy)
+		{
+			currentEnergy = proposal.updateEnergy;
+			operation = EOperation::Update;
+		}
+
+		if (proposal.addEnergy < currentEnergy && canAdd)
 		{
-			results.emplace_back(threadPool.AddTask(task, i * pixelsPerTask, (i + 1) * pixelsPerTask));
+			currentEnergy = proposal.addEnergy;
+			operation = EOperation::Add;
 		}
 
-		// Remainder
-		task(pixelsPerTask * taskCount, extentSize);
+		auto energyImprovement = proposal.localEnergy - currentEnergy;
+		auto transitionThreshold = Exp((energyImprovement) / proposal.temperature);
+		auto minPixelImprovement = TF(5) / (workingApproximation.width * workingApproximation.height);
 
-		TF energy = 0;
-		for (auto& result : results)
+		// Never add new curves for no reason.
+		if (energyImprovement < minPixelImprovement && operation == EOperation::Add)
 		{
-			energy += result.Retrieve();
+			transitionThreshold = 0;
 		}
 
-		return energy;
+		if (currentEnergy < proposal.localEnergy || transitionThreshold > GetUniformFloat<TF>(TF(0), TF(1), engine))
+		{
+			return MakePair(operation, energyImprovement);
+		}
+
+		return MakePair(EOperation::Reject, TF(0));
+	}
+
+
+	template<typename TF>
+	inline auto Annealer<TF>::ApplyToSurfaces(EOperation operation, Span<const Fragment> oldFragments, Span<const Fragment> newFragments, B markDirtyTiles) -> V
+	{
+		// Uses the same arithmetic as EvaluateProposal so the surfaces end up
+		// with exactly the values the accepted energy was computed from. Both
+		// surfaces are written once per pixel.
+		auto applyOld = operation == EOperation::Remove || operation == EOperation::Update;
+		auto applyNew = operation == EOperation::Add || operation == EOperation::Update;
+
+		auto hdrPtr = (F32*)workingApproximationHDR.data.data();
+		auto sdrPtr = (U8*)workingApproximation.data.data();
+		auto fixedPtr = (I16*)workingApproximationHDR.data.data();
+		auto isFixed = workingApproximationHDR.format == EFormat::A16Fixed;
+		auto putSign = config.darkOnLight ? F32(-1) : F32(1);
+		auto fixedSign = config.darkOnLight ? -1 : 1;
+		// Dirty tiles are at full resolution, a coarse level has fewer pixels per tile.
+		auto levelShift = 2 * U32(referencePyramid.size());
+		auto levelTileShift = dirtyTileShift - Min(levelShift, dirtyTileShift);
+		auto lastTile = ~0u;
+
+		ForEachMergedFragment
+		(
+			applyOld ? oldFragments : Span<const Fragment>(),
+			applyNew ? newFragments : Span<const Fragment>(),
+			[&](U32 idx, F32 oldValue, F32 newValue)
+			{
+				if (isFixed)
+				{
+					// The A8 surface is left stale, PublishSnapshot converts
+					// what the preview needs.
+					auto removed = fixedPtr[idx] - fixedSign * ToFixed(oldValue);
+					fixedPtr[idx] = I16(applyNew ? removed + fixedSign * ToFixed(newValue) : removed);
+				}
+				else
+				{
+					auto removed = hdrPtr[idx] - putSign * oldValue;
+					hdrPtr[idx] = applyNew ? removed + putSign * newValue : removed;
+					sdrPtr[idx] = ClampedU8(hdrPtr[idx] * 255);
+				}
+
+				// Merged fragments come in index order so each tile is seen in one run.
+				if (markDirtyTiles && (idx >> levelTileShift) != lastTile)
+				{
+					lastTile = idx >> levelTileShift;
+					MarkDirtyTiles(idx, idx + 1);
+				}
+			}
+		);
+
+		if (config.residualSampling)
+		{
+			UpdateTileWeights(applyOld ? oldFragments : Span<const Fragment>());
+			UpdateTileWeights(applyNew ? newFragments : Span<const Fragment>());
+		}
 	}
 
 
 	template<typename TF>
-	inline auto Annealer<TF>::GetLocalEnergy(const RawCPUImage& img, const Array<Fragment>& f0, const Array<Fragment>& f1) -> TF
+	inline auto Annealer<TF>::MarkDirtyTiles(U32 lebesgueBegin, U32 lebesgueEnd) -> V
 	{
-		static DynamicBitset visitedFragments;
-		visitedFragments.Expand(img.lebesgueStride * img.lebesgueStride);
+		// Every pixel of a coarse level covers a block of the full resolution.
+		auto levelShift = 2 * U32(referencePyramid.size());
+		auto first = (U64(lebesgueBegin) << levelShift) >> dirtyTileShift;
+		auto last = Min(((U64(lebesgueEnd) << levelShift) - 1) >> dirtyTileShift, U64(dirtyTilesCount - 1));
+		for (auto t = first; t <= last; ++t)
+		{
+			dirtyTiles.SetBitUnsafe(U32(t));
+		}
+	}
 
-		TF energy = 0;
-		auto imgSize = img.width * img.height;
 
-		auto collectEnergy =
-		[&](const Array<Fragment>& fragments) -> V
+	template<typename TF>
+	inline auto Annealer<TF>::PublishSnapshot() -> V
+	{
+		generation++;
+		for (auto t = 0u; t < dirtyTilesCount; ++t)
 		{
-			for (auto& frag : fragments)
+			if (dirtyTiles.GetBitUnsafe(t))
+			{
+				tileGenerations[t] = generation;
+				dirtyTiles.ClearBitUnsafe(t);
+			}
+		}
+
+		// The back buffer was last filled two generations ago at most.
+		auto& snapshot = snapshots.GetBack();
+		auto workingPtr = workingApproximation.data.data();
+		auto fixedPtr = (const I16*)workingApproximationHDR.data.data();
+		auto isFixed = workingApproximationHDR.format == EFormat::A16Fixed;
+		auto tileSize = Min(1u << dirtyTileShift, U32(snapshot.pixels.size()));
+		// Coarse levels are upsampled, a pixel covers a lebesgue block.
+		auto levelShift = 2 * U32(referencePyramid.size());
+		for (auto t = 0u; t < dirtyTilesCount; ++t)
+		{
+			if (snapshot.tileGenerations[t] != tileGenerations[t])
 			{
-				auto i = frag.idx;
-				if (visitedFragments.GetBitUnsafe(i))
+				auto offset = U64(t) << dirtyTileShift;
+				if (isFixed)
 				{
-					continue;
+					for (auto i = offset; i < offset + tileSize; ++i)
+					{
+						snapshot.pixels[i] = FixedToU8(fixedPtr[i >> levelShift]);
+					}
+				}
+				else if (levelShift)
+				{
+					for (auto i = offset; i < offset + tileSize; ++i)
+					{
+						snapshot.pixels[i] = workingPtr[i >> levelShift];
+					}
+				}
+				else
+				{
+					MemCopy(Span<const Byte>(workingPtr + offset, tileSize), snapshot.pixels.data() + offset);
 				}
+				snapshot.tileGenerations[t] = tileGenerations[t];
+			}
+		}
 
-				auto ref = TF(grayscaleReferenceFiltered.data[i]);
-				auto diff = ref - TF(img.data[i]);
-				energy += (diff * diff) / imgSize;
+		snapshots.Publish();
+	}
+
+
+	template<typename TF>
+	inline auto Annealer<TF>::AnnealBezierBatch() -> U32
+	{
+		auto batchSize = Min(config.proposalsPerStep, Min(strokes.Size(), config.maxSteps - step));
+		proposals.resize(batchSize);
+
+		// Random numbers are drawn here on the annealing thread only so a batch
+		// is reproducible regardless of how the evaluation gets scheduled.
+		selectedStrokes.Expand(strokes.Size());
+		for (auto& proposal : proposals)
+		{
+			temperature = temperature * TF(0.999);
+
+			do
+			{
+				proposal.strokeIdx = SelectStroke();
+			}
+			while (selectedStrokes.GetBitUnsafe(proposal.strokeIdx));
+
+			GenerateProposal(proposal, SampleAnchors(randomEngine), temperature, randomEngine);
+			if (config.localStrokeSelection)
+			{
+				proposal.strokeIdx = SelectNearbyStroke(proposal.curve, proposal.strokeIdx, true);
+			}
+			selectedStrokes.SetBitUnsafe(proposal.strokeIdx);
+		}
+
+		for (auto& proposal : proposals)
+		{
+			selectedStrokes.ClearBitUnsafe(proposal.strokeIdx);
+		}
+
+		ParallelFor
+		(
+			threadPool,
+			0,
+			U32(proposals.size()),
+			1,
+			[this](U32 start, U32 end)
+			{
+				for (auto i = start; i < end; ++i)
+				{
+					auto& proposal = proposals[i];
+					RasterizeToFragments
+					(
+						proposal.curve,
+						proposal.fragments,
+						workingApproximationHDR.width,
+						workingApproximationHDR.height,
+						proposal.pigment,
+						proposal.width * strokeWidthScale
+					);
+					EvaluateProposal(proposal);
+				}
+			}
+		);
+
+		// Commit in proposal order. Every proposal was evaluated against the
+		// surface state before the batch, so it is only still valid if none of
+		// the previously committed proposals touched any of its pixels.
+		claimedPixels.Expand(workingApproximationHDR.lebesgueStride * workingApproximationHDR.lebesgueStride);
 
-				visitedFragments.SetBitUnsafe(i);
+		auto overlapsClaimed =
+		[&](Span<const Fragment> fragments) -> B
+		{
+			for (auto& frag : fragments)
+			{
+				if (claimedPixels.GetBitUnsafe(frag.idx))
+				{
+					return true;
+				}
 			}
+			return false;
 		};
 
-		auto clearVisited = 
-		[&](const Array<Fragment>& fragments)
+		auto claim =
+		[&](Span<const Fragment> fragments) -> V
 		{
 			for (auto& frag : fragments)
 			{
-				visitedFragments.ClearBitUnsafe(frag.idx);
+				claimedPixels.SetBitUnsafe(frag.idx);
+				claimedPixelsList.push_back(frag.idx);
 			}
 		};
 
-		collectEnergy(f0);
-		collectEnergy(f1);
+		for (auto& proposal : proposals)
+		{
+			// Earlier commits may have moved the pool since the evaluation,
+			// only fragments decoded or rasterized into the scratch are safe.
+			auto oldFragments = proposal.oldFragments;
+			if (oldFragments.data() != proposal.oldFragmentsScratch.data())
+			{
+				oldFragments = GetStrokeFragments(proposal.strokeIdx, proposal.oldFragmentsScratch);
+			}
+			auto newFragments = Span<const Fragment>(proposal.fragments);
+
+			auto canAdd = strokes.Size() - removedStrokes.size() < config.maxStrokes;
+			auto [operation, energyImprovement] = SelectOperation(proposal, canAdd, randomEngine);
+
+			if (operation == EOperation::Reject || overlapsClaimed(oldFragments) || overlapsClaimed(newFragments))
+			{
+				CacheStrokeFragments(proposal.strokeIdx, oldFragments);
+				continue;
+			}
+
+			claim(oldFragments);
+			claim(newFragments);
+
+			optimalEnergy -= energyImprovement > 0 ? energyImprovement : 0.f;
+			ApplyToSurfaces(operation, oldFragments, newFragments);
+
+			if (operation == EOperation::Remove)
+			{
+				removedStrokes.push_back(proposal.strokeIdx);
+			}
+			else if (operation == EOperation::Add)
+			{
+				strokes.Add(proposal.curve, proposal.width, proposal.pigment, newFragments);
+			}
+			else
+			{
+				strokes.Update(proposal.strokeIdx, proposal.curve, proposal.width, proposal.pigment, newFragments);
+			}
+		}
+
+		for (auto idx : claimedPixelsList)
+		{
+			claimedPixels.ClearBitUnsafe(idx);
+		}
+		claimedPixelsList.clear();
+
+		// Removing in descending order keeps the swap with the back from
+		// moving a stroke that is still waiting to be removed.
+		Sort(removedStrokes, [](U32 i0, U32 i1) { return i0 > i1; });
+		for (auto strokeIdx : removedStrokes)
+		{
+			strokes.Remove(strokeIdx);
+		}
+		removedStrokes.clear();
+
+		return batchSize;
+	}
+
+
+	template<typename TF>
+	inline auto Annealer<TF>::AnnealBezierTiled() -> U32
+	{
+		// The Lebesgue extent is split into Morton aligned tiles. A tile is
+		// a contiguous index range, so a stroke belongs to a tile exactly when
+		// its lowest and highest fragment index fall into the same range.
+		// Each tile is annealed by a single task which makes it the only writer
+		// of its pixels, strokes crossing a border are annealed afterwards on
+		// this thread.
+		auto phaseBudget = config.stepsPerTile * U32(tiles.size());
+		if (strokes.Empty() || config.maxSteps - step < 2 * phaseBudget)
+		{
+			return 0;
+		}
+
+		for (auto& tile : tiles)
+		{
+			tile.strokes.clear();
+		}
+		borderStrokes.clear();
+
+		for (auto i = 0u; i < strokes.Size(); ++i)
+		{
+			if (!strokes.GetFragmentsCount(i))
+			{
+				borderStrokes.push_back(i);
+				continue;
+			}
+
+			auto [minIdx, maxIdx] = strokes.GetFragmentsRange(i);
+
+			if ((minIdx >> tileShift) == (maxIdx >> tileShift))
+			{
+				tiles[minIdx >> tileShift].strokes.push_back(i);
+			}
+			else
+			{
+				borderStrokes.push_back(i);
+			}
+		}
+
+		auto activeTiles = 0u;
+		for (auto& tile : tiles)
+		{
+			activeTiles += (!tile.strokes.empty() && !tile.edgeSupport.empty()) ? 1 : 0;
+		}
+
+		auto freeStrokes = strokes.Size() < config.maxStrokes ? config.maxStrokes - strokes.Size() : 0u;
+		for (auto& tile : tiles)
+		{
+			tile.addBudget = freeStrokes / Max(activeTiles, 1u);
+		}
+
+		// Every tile cools as if the steps of all the other tiles were
+		// interleaved with its own, so all of them end the phase at the
+		// temperature the serial schedule would have reached.
+		auto coolingFactor = Pow(TF(0.999), TF(Max(activeTiles, 1u)));
+
+		// Tiles cannot grow the fragment pool, updates that outgrow their slab
+		// take room from this reserve and are deferred once it runs out.
+		strokes.ReserveFragments(strokes.GetResidentFragmentsCount());
+
+		ParallelFor
+		(
+			threadPool,
+			0,
+			U32(tiles.size()),
+			1,
+			[this, coolingFactor](U32 start, U32 end)
+			{
+				for (auto tileIdx = start; tileIdx < end; ++tileIdx)
+				{
+					AnnealTile(tiles[tileIdx], tileIdx, coolingFactor);
+				}
+			}
+		);
+
+		auto stepsTaken = 0u;
+		for (auto tileIdx = 0u; tileIdx < tiles.size(); ++tileIdx)
+		{
+			auto& tile = tiles[tileIdx];
+			stepsTaken += tile.steps;
+			optimalEnergy -= tile.energyImprovement;
+
+			if (tile.modified)
+			{
+				MarkDirtyTiles(tileIdx << tileShift, (tileIdx + 1) << tileShift);
+				tile.modified = false;
+			}
+
+			for (auto& added : tile.addedStrokes)
+			{
+				strokes.Add(added.curve, added.width, added.pigment, added.fragments);
+			}
+			tile.addedStrokes.clear();
+
+			for (auto& updated : tile.updatedStrokes)
+			{
+				strokes.Update(updated.strokeIdx, updated.curve, updated.width, updated.pigment, updated.fragments);
+			}
+			tile.updatedStrokes.clear();
+
+			removedStrokes.insert(removedStrokes.end(), tile.removedStrokes.begin(), tile.removedStrokes.end());
+		}
+
+		temperature = temperature * Pow(TF(0.999), TF(stepsTaken));
+
+		// Serialized phase for the strokes crossing tile borders. They get a
+		// share of the phase proportional to their count.
+		auto borderSteps = U32(U64(phaseBudget) * borderStrokes.size() / strokes.Size());
+		borderSteps = borderStrokes.empty() ? 0 : Max(borderSteps, 1u);
+
+		for (auto s = 0u; s < borderSteps && !borderStrokes.empty(); ++s)
+		{
+			temperature = temperature * TF(0.999);
+
+			auto borderIdx = GetUniformU32(0, borderStrokes.size() - 1, randomEngine);
+			proposal.strokeIdx = borderStrokes[borderIdx];
+			GenerateProposal(proposal, edgeSupport, temperature, randomEngine);
+			RasterizeToFragments
+			(
+				proposal.curve,
+				proposal.fragments,
+				workingApproximationHDR.width,
+				workingApproximationHDR.height,
+				proposal.pigment,
+				proposal.width * strokeWidthScale
+			);
+			EvaluateProposal(proposal);
+
+			auto canAdd = strokes.Size() - removedStrokes.size() < config.maxStrokes;
+			auto [operation, energyImprovement] = SelectOperation(proposal, canAdd, randomEngine);
+			stepsTaken++;
+
+			if (operation == EOperation::Reject)
+			{
+				CacheStrokeFragments(proposal.strokeIdx, proposal.oldFragments);
+				continue;
+			}
+
+			optimalEnergy -= energyImprovement > 0 ? energyImprovement : 0.f;
+			ApplyToSurfaces(operation, proposal.oldFragments, proposal.fragments);
+
+			if (operation == EOperation::Remove)
+			{
+				removedStrokes.push_back(proposal.strokeIdx);
+				Swap(borderStrokes[borderIdx], borderStrokes.back());
+				borderStrokes.pop_back();
+			}
+			else if (operation == EOperation::Add)
+			{
+				strokes.Add(proposal.curve, proposal.width, proposal.pigment, proposal.fragments);
+			}
+			else
+			{
+				strokes.Update(proposal.strokeIdx, proposal.curve, proposal.width, proposal.pigment, proposal.fragments);
+			}
+		}
+
+		Sort(removedStrokes, [](U32 i0, U32 i1) { return i0 > i1; });
+		for (auto strokeIdx : removedStrokes)
+		{
+			strokes.Remove(strokeIdx);
+		}
+		removedStrokes.clear();
+
+		return stepsTaken;
+	}
+
+
+	template<typename TF>
+	inline auto Annealer<TF>::AnnealTile(Tile& tile, U32 tileIdx, Scalar coolingFactor) -> V
+	{
+		tile.steps = 0;
+		tile.energyImprovement = 0;
+		tile.removedStrokes.clear();
+
+		if (tile.strokes.empty() || tile.edgeSupport.empty())
+		{
+			return;
+		}
+
+		auto& proposal = tile.proposal;
+		auto localTemperature = temperature;
+
+		for (auto s = 0u; s < config.stepsPerTile && !tile.strokes.empty(); ++s)
+		{
+			localTemperature = localTemperature * coolingFactor;
+			tile.steps++;
+
+			auto queueIdx = GetUniformU32(0, tile.strokes.size() - 1, tile.randomEngine);
+			proposal.strokeIdx = tile.strokes[queueIdx];
+			GenerateProposal(proposal, tile.edgeSupport, localTemperature, tile.randomEngine);
+			RasterizeToFragments
+			(
+				proposal.curve,
+				proposal.fragments,
+				workingApproximationHDR.width,
+				workingApproximationHDR.height,
+				proposal.pigment,
+				proposal.width * strokeWidthScale
+			);
+
+			auto& fragments = proposal.fragments;
+			if (fragments.empty() || (fragments.front().idx >> tileShift) != tileIdx || (fragments.back().idx >> tileShift) != tileIdx)
+			{
+				continue;
+			}
+
+			EvaluateProposal(proposal);
+
+			auto canAdd = tile.addedStrokes.size() < tile.addBudget;
+			auto [operation, energyImprovement] = SelectOperation(proposal, canAdd, tile.randomEngine);
+
+			if (operation == EOperation::Reject)
+			{
+				continue;
+			}
+
+			tile.energyImprovement += energyImprovement > 0 ? energyImprovement : 0.f;
+			// Tiles run concurrently and would race on the bitset words, so
+			// the whole tile is marked once the phase is over.
+			ApplyToSurfaces(operation, proposal.oldFragments, proposal.fragments, false);
+			tile.modified = true;
+
+			if (operation == EOperation::Remove)
+			{
+				tile.removedStrokes.push_back(proposal.strokeIdx);
+				Swap(tile.strokes[queueIdx], tile.strokes.back());
+				tile.strokes.pop_back();
+			}
+			else if (operation == EOperation::Add)
+			{
+				// Appending to the stroke arrays would race with the other
+				// tiles so new strokes are kept aside until the phase ends.
+				tile.addedStrokes.emplace_back(Move(proposal));
+			}
+			else if (strokes.GrowSlab(proposal.strokeIdx, fragments))
+			{
+				strokes.Update(proposal.strokeIdx, proposal.curve, proposal.width, proposal.pigment, proposal.fragments);
+			}
+			else
+			{
+				// The stroke leaves the queue so nothing reads its stale
+				// fragments before the update is applied at the end of the phase.
+				Swap(tile.strokes[queueIdx], tile.strokes.back());
+				tile.strokes.pop_back();
+				tile.updatedStrokes.emplace_back(Move(proposal));
+			}
+		}
+	}
+
+
+	template<typename TF>
+	inline auto Annealer<TF>::FinishSteps(U32 stepsTaken, F64 startTime) -> V
+	{
+		auto firstStep = step;
+		auto lastStep = step + stepsTaken - 1;
+
+		if (!(firstStep % updateScreenAfterSteps) || firstStep / updateScreenAfterSteps != lastStep / updateScreenAfterSteps || lastStep >= config.maxSteps - 1)
+		{
+			PublishSnapshot();
+		}
+
+		step += stepsTaken;
+		auto progress = TF(step) / config.maxSteps * TF(100);
+
+		auto endTime = GetTimeStampUS();
+
+		if
+		(
+			(config.checkpointEverySteps && step - lastCheckpointStep >= config.checkpointEverySteps) ||
+			(config.checkpointEverySeconds > 0.f && UsToS(endTime - lastCheckpointTime) >= config.checkpointEverySeconds)
+		)
+		{
+			TakeCheckpoint();
+		}
+
+		avgStepTime += endTime - startTime;
+
+		if (firstStep / logAfterSteps != step / logAfterSteps)
+		{
+			avgStepTime /= TF(logAfterSteps);
+			Log
+			(
+				"Energy = ",
+				optimalEnergy,
+				"\tTemperature = ",
+				temperature,
+				"\tStrokesCount = ",
+				strokes.Size(),
+				"\tProgress = ",
+				progress,
+				"%",
+				"\tAvgStepTime = ",
+				avgStepTime,
+				"us"
+			);
+			avgStepTime = 0;
+		}
+	}
+
+
+
+	template<typename TF>
+	inline auto Annealer<TF>::ShutDownThreadPool() -> V
+	{
+		threadPool.ShutDown();
+	}
+
+
+	template<typename TF>
+	inline auto Annealer<TF>::GetEnergy(const RawCPUImage& img) -> TF
+	{
+		auto extentSize = img.lebesgueStride * img.lebesgueStride;
+		auto imgSize = img.width * img.height;
+
+		auto task =
+		[&](U32 start, U32 end) -> TF
+		{
+			TF energy = 0;
+			for (auto i = start; i < end; ++i)
+			{
+				auto coords = LebesgueCurveInverse(i);
+				if (coords.first >= img.width || coords.second >= img.height)
+				{
+					continue;
+				}
 
-		clearVisited(f0);
-		clearVisited(f1);
+				auto ref = TF(grayscaleReferenceFiltered.data[i]);
+				auto diff = ref - TF(img.data[i]);
+				energy += (diff * diff) / imgSize;
+			}
+			return energy;
+		};
 
-		return energy;
+		return ParallelReduce(threadPool, 0, extentSize, CPixelsPerChunk, TF(0), task, [](TF e0, TF e1) { return e0 + e1; });
 	}
+
 }
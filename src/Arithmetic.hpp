@@ -44,6 +44,8 @@ namespace PA
     template <typename TF>
     inline auto Logarithm(TF n) -> TF;
     template <typename TF>
+    inline auto Pow(TF base, TF exponent) -> TF;
+    template <typename TF>
     inline auto Sqrt(TF n) -> TF;
     template <typename TF>
     inline auto Cbrt(TF n) -> TF;
@@ -126,6 +128,13 @@ namespace PA
     }
 
 
+    template<typename TF>
+    auto Pow(TF base, TF exponent) -> TF
+    {
+        return std::pow(base, exponent);
+    }
+
+
     template<typename TF>
     auto Sqrt(TF n) -> TF
     {
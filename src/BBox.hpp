@@ -34,6 +34,7 @@ namespace PA
 		Vec lower;
 		Vec upper;
 
+		BBox() = default;
 		template <typename TPrimitive>
 		BBox(Span<const TPrimitive> primitives);
 		BBox(VecSpan points);
@@ -96,27 +97,17 @@ namespace PA
 	template<typename TF, U32 Dim>
 	inline auto BBox<TF, Dim>::Intersects(const BBox& other) const -> B
 	{
-		auto upperLeft = Vec(other.lower[0], other.upper[1]);
-		auto lowerRight = Vec(other.upper[0], other.lower[1]);
-		auto thisUpperLeft = Vec(lower[0], upper[1]);
-		auto thisLowerRight = Vec(upper[0], lower[1]);
-
-		if
-		(
-			Contains(upperLeft) ||
-			Contains(lowerRight) || 
-			Contains(other.lower) || 
-			Contains(other.upper) ||
-			other.Contains(thisUpperLeft) ||
-			other.Contains(thisLowerRight) ||
-			other.Contains(lower) ||
-			other.Contains(upper)
-		)
+		// Overlapping corners miss boxes crossing each other, the extents
+		// have to overlap along every axis instead.
+		for (auto i = 0u; i < Dim; ++i)
 		{
-			return true;
+			if (other.upper[i] < lower[i] || upper[i] < other.lower[i])
+			{
+				return false;
+			}
 		}
 
-		return false;
+		return true;
 	}
 
 
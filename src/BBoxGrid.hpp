@@ -0,0 +1,219 @@
+// Copyright 2024 Mihail Mladenov
+//
+// This file is part of PencilAnnealing.
+//
+// PencilAnnealing is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PencilAnnealing is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PencilAnnealing.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "Types.hpp"
+#include "BBox.hpp"
+#include "Algorithm.hpp"
+#include "Error.hpp"
+
+namespace PA
+{
+	// Boxes in the unit square binned into a uniform grid of cells, every box
+	// is listed in each cell it overlaps. Boxes are identified by small dense
+	// keys, e.g. stroke slots, and can be added, moved and removed at any
+	// time. Parts outside the unit square fall into the border cells.
+	template <typename TF>
+	class BBoxGrid
+	{
+	public:
+		using BBox = BBox<TF, 2>;
+		using Vec = typename BBox::Vec;
+
+		explicit BBoxGrid(U32 cellsPerSide = 32);
+
+		auto Clear() -> V;
+		auto Size() const -> U32;
+		auto Contains(U32 key) const -> B;
+		auto Add(U32 key, const BBox& bBox) -> V;
+		auto Remove(U32 key) -> V;
+		auto Update(U32 key, const BBox& bBox) -> V;
+		// Appends the key of every box that intersects region, each one once.
+		// Does not modify the grid, so queries can run concurrently.
+		auto Query(const BBox& region, Array<U32>& keys) const -> V;
+
+	private:
+		// Inclusive range of cells.
+		struct CellRange
+		{
+			U32 x0;
+			U32 y0;
+			U32 x1;
+			U32 y1;
+		};
+
+		struct Entry
+		{
+			BBox bBox = BBox(Vec(0), Vec(0));
+			CellRange cells = {};
+			B present = false;
+		};
+
+		auto GetCell(TF coordinate) const -> U32;
+		auto GetCellRange(const BBox& bBox) const -> CellRange;
+
+		U32 cellsPerSide;
+		Array<Array<U32>> cells;
+		Array<Entry> entries;
+		U32 size = 0;
+	};
+}
+
+
+namespace PA
+{
+	template<typename TF>
+	inline BBoxGrid<TF>::BBoxGrid(U32 cellsPerSide) :
+		cellsPerSide(cellsPerSide),
+		cells(cellsPerSide * cellsPerSide)
+	{
+		PA_ASSERT(cellsPerSide > 0);
+	}
+
+
+	template<typename TF>
+	inline auto BBoxGrid<TF>::Clear() -> V
+	{
+		for (auto& cell : cells)
+		{
+			cell.clear();
+		}
+		entries.clear();
+		size = 0;
+	}
+
+
+	template<typename TF>
+	inline auto BBoxGrid<TF>::Size() const -> U32
+	{
+		return size;
+	}
+
+
+	template<typename TF>
+	inline auto BBoxGrid<TF>::Contains(U32 key) const -> B
+	{
+		return key < entries.size() && entries[key].present;
+	}
+
+
+	template<typename TF>
+	inline auto BBoxGrid<TF>::Add(U32 key, const BBox& bBox) -> V
+	{
+		PA_ASSERT(!Contains(key));
+		if (key >= entries.size())
+		{
+			entries.resize(key + 1);
+		}
+
+		auto range = GetCellRange(bBox);
+		entries[key] = { bBox, range, true };
+		for (auto y = range.y0; y <= range.y1; ++y)
+		{
+			for (auto x = range.x0; x <= range.x1; ++x)
+			{
+				cells[y * cellsPerSide + x].push_back(key);
+			}
+		}
+		size++;
+	}
+
+
+	template<typename TF>
+	inline auto BBoxGrid<TF>::Remove(U32 key) -> V
+	{
+		PA_ASSERT(Contains(key));
+
+		auto& entry = entries[key];
+		auto range = entry.cells;
+		for (auto y = range.y0; y <= range.y1; ++y)
+		{
+			for (auto x = range.x0; x <= range.x1; ++x)
+			{
+				auto& cell = cells[y * cellsPerSide + x];
+				auto found = Find(cell.begin(), cell.end(), key);
+				PA_ASSERT(found != cell.end());
+				*found = cell.back();
+				cell.pop_back();
+			}
+		}
+		entry.present = false;
+		size--;
+	}
+
+
+	template<typename TF>
+	inline auto BBoxGrid<TF>::Update(U32 key, const BBox& bBox) -> V
+	{
+		if (!Contains(key))
+		{
+			Add(key, bBox);
+			return;
+		}
+
+		// Moves within the same cells only change the box.
+		auto range = GetCellRange(bBox);
+		auto& entry = entries[key];
+		if (range.x0 == entry.cells.x0 && range.y0 == entry.cells.y0 && range.x1 == entry.cells.x1 && range.y1 == entry.cells.y1)
+		{
+			entry.bBox = bBox;
+			return;
+		}
+
+		Remove(key);
+		Add(key, bBox);
+	}
+
+
+	template<typename TF>
+	inline auto BBoxGrid<TF>::Query(const BBox& region, Array<U32>& keys) const -> V
+	{
+		auto range = GetCellRange(region);
+		for (auto y = range.y0; y <= range.y1; ++y)
+		{
+			for (auto x = range.x0; x <= range.x1; ++x)
+			{
+				for (auto key : cells[y * cellsPerSide + x])
+				{
+					// A box spanning several cells is reported only from the
+					// first cell it shares with the region.
+					auto& entry = entries[key];
+					if (x == Max(entry.cells.x0, range.x0) && y == Max(entry.cells.y0, range.y0) && entry.bBox.Intersects(region))
+					{
+						keys.push_back(key);
+					}
+				}
+			}
+		}
+	}
+
+
+	template<typename TF>
+	inline auto BBoxGrid<TF>::GetCell(TF coordinate) const -> U32
+	{
+		auto cell = Floor(coordinate * TF(cellsPerSide));
+		return U32(Clamp(cell, TF(0), TF(cellsPerSide - 1)));
+	}
+
+
+	template<typename TF>
+	inline auto BBoxGrid<TF>::GetCellRange(const BBox& bBox) const -> CellRange
+	{
+		return { GetCell(bBox.lower[0]), GetCell(bBox.lower[1]), GetCell(bBox.upper[0]), GetCell(bBox.upper[1]) };
+	}
+}
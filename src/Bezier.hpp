@@ -20,6 +20,7 @@
 
 #include "Algebra.hpp"
 #include "BBox.hpp"
+#include "Random.hpp"
 
 namespace PA
 {
@@ -56,10 +57,11 @@ namespace PA
 
         auto operator[](U32 idx) -> Vec&;
         auto operator[](U32 idx) const -> const Vec&;
+		auto operator==(const QuadraticBezier& other) const -> B;
 	};
 
 	template <typename TF>
-	auto GetRandom2DQuadraticBezierInRange(TF MaxSpan, TF range0 = TF(0), TF range1 = TF(1)) -> QuadraticBezier<TF, 2>;
+	auto GetRandom2DQuadraticBezierInRange(TF MaxSpan, TF range0 = TF(0), TF range1 = TF(1), RandomEngine& engine = GMerseneTwister) -> QuadraticBezier<TF, 2>;
 
 	template <typename TF>
 	auto GetBezierPassingThrough(const Vector<TF, 2>& p0, const Vector<TF, 2>& p1, const Vector<TF, 2>& p2) -> QuadraticBezier<TF, 2>;
@@ -82,6 +84,13 @@ namespace PA
     }
 
 
+	template<typename TF, U32 Dim>
+	inline auto QuadraticBezier<TF, Dim>::operator==(const QuadraticBezier& other) const -> B
+	{
+		return p0 == other.p0 && p1 == other.p1 && p2 == other.p2;
+	}
+
+
 	template<typename TF, U32 Dim>
 	inline auto QuadraticBezier<TF, Dim>::GetPolynomialCoefficients() const -> StaticArray<Vec, 3>
 	{
@@ -181,15 +190,15 @@ namespace PA
 	}
 
 	template<typename TF>
-	auto GetRandom2DQuadraticBezierInRange(TF maxSpan, TF range0, TF range1) -> QuadraticBezier<TF, 2>
+	auto GetRandom2DQuadraticBezierInRange(TF maxSpan, TF range0, TF range1, RandomEngine& engine) -> QuadraticBezier<TF, 2>
 	{
-		auto directionAngle = GetUniformFloat<TF>() * Constants<TF>::C2Pi;
-		auto initialPos = Vec2(GetUniformFloat<TF>(range0, range1), GetUniformFloat<TF>(range0, range1));
-		auto midPointProp = GetUniformFloat<TF>(range0, range1);
-		auto midPointOffset = GetUniformFloat<TF>(range0, range1);
+		auto directionAngle = GetUniformFloat<TF>(TF(0), TF(1), engine) * Constants<TF>::C2Pi;
+		auto initialPos = Vec2(GetUniformFloat<TF>(range0, range1, engine), GetUniformFloat<TF>(range0, range1, engine));
+		auto midPointProp = GetUniformFloat<TF>(range0, range1, engine);
+		auto midPointOffset = GetUniformFloat<TF>(range0, range1, engine);
 
-		auto spanDirection = GetUniformFloat<TF>(TF(0), maxSpan);
-		auto spanNormal = GetUniformFloat<TF>(TF(0), maxSpan);
+		auto spanDirection = GetUniformFloat<TF>(TF(0), maxSpan, engine);
+		auto spanNormal = GetUniformFloat<TF>(TF(0), maxSpan, engine);
 
 		auto direction = Vec2(Cos(directionAngle), Sin(directionAngle));
 		auto normal = Vec2(-direction[1], direction[0]);
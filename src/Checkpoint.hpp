@@ -0,0 +1,499 @@
+// Copyright 2024 Mihail Mladenov
+//
+// This file is part of PencilAnnealing.
+//
+// PencilAnnealing is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PencilAnnealing is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PencilAnnealing.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "Types.hpp"
+#include "Bezier.hpp"
+#include "Rendering.hpp"
+#include "File.hpp"
+#include "Error.hpp"
+
+#include <bit>
+#include <cstring>
+
+namespace PA
+{
+	// A checkpoint file is a CheckpointHeader followed by sectionsCount
+	// CheckpointSection entries and the section payloads. Everything is stored
+	// little endian and every payload starts at a multiple of
+	// CCheckpointAlignment, so a mapped file can be used in place.
+	inline constexpr U32 CCheckpointMagic = 0x4B435041; // "APCK"
+	inline constexpr U32 CCheckpointVersion = 1;
+	inline constexpr U64 CCheckpointAlignment = 64;
+
+	enum class ECheckpointSection : U32
+	{
+		Strokes,
+		Widths,
+		Pigments,
+		// Per stroke offset into the fragment block followed by the total.
+		FragmentOffsets,
+		// Fragments in their in-memory layout, so each stroke is one span.
+		Fragments,
+		Count
+	};
+
+	struct CheckpointHeader
+	{
+		U32 magic;
+		U32 version;
+		U32 sectionsCount;
+		U32 scalarSize;
+		U32 maxSteps;
+		U32 maxStrokes;
+		F32 maxWidth;
+		U32 step;
+		// Size of the reference the strokes were annealed against.
+		U32 width;
+		U32 height;
+		F64 maxTemperature;
+		F64 temperature;
+		F64 optimalEnergy;
+		U64 strokesCount;
+		U64 fragmentsCount;
+	};
+
+	struct CheckpointSection
+	{
+		ECheckpointSection type;
+		U32 elementSize;
+		U64 offset;
+		U64 size;
+	};
+
+	static_assert
+	(
+		sizeof(CheckpointHeader) == 80 && sizeof(CheckpointSection) == 24 && sizeof(Fragment) == 8,
+		"Checkpoint layout changed, bump the version."
+	);
+
+	template <typename TF>
+	struct CheckpointState
+	{
+		U32 maxSteps = 0;
+		U32 maxStrokes = 0;
+		F32 maxWidth = 0;
+		U32 step = 0;
+		U32 width = 0;
+		U32 height = 0;
+		TF maxTemperature = 0;
+		TF temperature = 0;
+		TF optimalEnergy = 0;
+	};
+
+	// Read only view of a checkpoint, the spans point into the file data.
+	// The fragment spans are empty when the checkpoint was written without
+	// fragments. Fragment indices are not checked against the image size.
+	template <typename TF>
+	struct CheckpointView
+	{
+		CheckpointState<TF> state;
+		Span<const QuadraticBezier<TF, 2>> strokes;
+		Span<const TF> widths;
+		Span<const TF> pigments;
+		Span<const U64> fragmentOffsets;
+		Span<const Fragment> fragments;
+	};
+
+	// Lays out the whole checkpoint in outBuffer, allocating it only once.
+	template <typename TF>
+	inline auto SerializeCheckpoint
+	(
+		Array<Byte>& outBuffer,
+		const CheckpointState<TF>& state,
+		Span<const QuadraticBezier<TF, 2>> strokes,
+		Span<const TF> widths,
+		Span<const TF> pigments,
+		Span<const U64> fragmentOffsets,
+		Span<const Fragment> fragments
+	) -> V;
+
+	template <typename TF>
+	inline auto OpenCheckpoint(Span<const Byte> data, CheckpointView<TF>& view) -> B;
+
+	// Writes checkpoints on a background thread. The annealing thread fills
+	// one of two snapshots while the other one may still be on its way to the
+	// disk. Every file is written next to the target, synced and renamed over
+	// it, so even a power loss leaves a complete checkpoint behind.
+	template <typename TF>
+	class CheckpointWriter
+	{
+	public:
+		struct Snapshot
+		{
+			CheckpointState<TF> state;
+			Array<QuadraticBezier<TF, 2>> strokes;
+			Array<TF> widths;
+			Array<TF> pigments;
+			// Same layout as the checkpoint, empty to leave the fragments out.
+			Array<U64> fragmentOffsets;
+			Array<Fragment> fragments;
+		};
+
+		CheckpointWriter(StrView path);
+		~CheckpointWriter();
+
+		// Returns nullptr when both snapshots are still being written.
+		auto BeginSnapshot() -> Snapshot*;
+		// Queues the snapshot, replacing a queued one that was not picked up yet.
+		auto CommitSnapshot(Snapshot* snapshot) -> V;
+		// Waits until every committed snapshot is on disk.
+		auto Flush() -> V;
+
+	private:
+		enum class ESnapshotState
+		{
+			Free,
+			Filling,
+			Queued,
+			Writing
+		};
+
+		auto WriterLoop() -> V;
+
+		Str path;
+		Str tempPath;
+
+		Mutex snapshotsMutex;
+		StaticArray<Snapshot, 2> snapshots;
+		StaticArray<ESnapshotState, 2> states = { ESnapshotState::Free, ESnapshotState::Free };
+		Atomic<U32> snapshotsInFlight = 0;
+
+		Semaphore pendingSnapshots;
+		Atomic<B> keepRunning = true;
+		Array<Byte> outBuffer;
+		Thread writerThread;
+	};
+}
+
+
+namespace PA
+{
+	template<typename TF>
+	inline auto SerializeCheckpoint
+	(
+		Array<Byte>& outBuffer,
+		const CheckpointState<TF>& state,
+		Span<const QuadraticBezier<TF, 2>> strokes,
+		Span<const TF> widths,
+		Span<const TF> pigments,
+		Span<const U64> fragmentOffsets,
+		Span<const Fragment> fragments
+	) -> V
+	{
+		static_assert(std::endian::native == std::endian::little, "Checkpoints are stored little endian.");
+		PA_ASSERT(strokes.size() == widths.size() && strokes.size() == pigments.size());
+		PA_ASSERT(fragmentOffsets.empty() || (fragmentOffsets.size() == strokes.size() + 1 && fragmentOffsets.back() == fragments.size()));
+
+		U64 fragmentsCount = fragments.size();
+		auto sectionsCount = fragmentOffsets.empty() ? U32(ECheckpointSection::FragmentOffsets) : U32(ECheckpointSection::Count);
+		StaticArray<CheckpointSection, U32(ECheckpointSection::Count)> sections;
+		StaticArray<U64, U32(ECheckpointSection::Count)> elementCounts =
+		{
+			strokes.size(),
+			widths.size(),
+			pigments.size(),
+			strokes.size() + 1,
+			fragmentsCount
+		};
+		StaticArray<U32, U32(ECheckpointSection::Count)> elementSizes =
+		{
+			U32(sizeof(QuadraticBezier<TF, 2>)),
+			U32(sizeof(TF)),
+			U32(sizeof(TF)),
+			U32(sizeof(U64)),
+			U32(sizeof(Fragment))
+		};
+
+		auto alignUp = [](U64 offset) { return (offset + CCheckpointAlignment - 1) & ~(CCheckpointAlignment - 1); };
+
+		auto offset = alignUp(sizeof(CheckpointHeader) + sectionsCount * sizeof(CheckpointSection));
+		for (auto i = 0u; i < sectionsCount; ++i)
+		{
+			sections[i].type = ECheckpointSection(i);
+			sections[i].elementSize = elementSizes[i];
+			sections[i].offset = offset;
+			sections[i].size = elementCounts[i] * elementSizes[i];
+			offset = alignUp(offset + sections[i].size);
+		}
+
+		outBuffer.assign(offset, Byte(0));
+
+		CheckpointHeader header;
+		header.magic = CCheckpointMagic;
+		header.version = CCheckpointVersion;
+		header.sectionsCount = sectionsCount;
+		header.scalarSize = sizeof(TF);
+		header.maxSteps = state.maxSteps;
+		header.maxStrokes = state.maxStrokes;
+		header.maxWidth = state.maxWidth;
+		header.step = state.step;
+		header.width = state.width;
+		header.height = state.height;
+		header.maxTemperature = F64(state.maxTemperature);
+		header.temperature = F64(state.temperature);
+		header.optimalEnergy = F64(state.optimalEnergy);
+		header.strokesCount = strokes.size();
+		header.fragmentsCount = fragmentsCount;
+
+		memcpy(outBuffer.data(), &header, sizeof(header));
+		memcpy(outBuffer.data() + sizeof(header), sections.data(), sectionsCount * sizeof(CheckpointSection));
+
+		auto sectionData = [&](ECheckpointSection type) { return outBuffer.data() + sections[U32(type)].offset; };
+
+		memcpy(sectionData(ECheckpointSection::Strokes), strokes.data(), strokes.size_bytes());
+		memcpy(sectionData(ECheckpointSection::Widths), widths.data(), widths.size_bytes());
+		memcpy(sectionData(ECheckpointSection::Pigments), pigments.data(), pigments.size_bytes());
+
+		if (fragmentOffsets.empty())
+		{
+			return;
+		}
+
+		memcpy(sectionData(ECheckpointSection::FragmentOffsets), fragmentOffsets.data(), fragmentOffsets.size_bytes());
+		memcpy(sectionData(ECheckpointSection::Fragments), fragments.data(), fragments.size_bytes());
+	}
+
+
+	template<typename TF>
+	inline auto OpenCheckpoint(Span<const Byte> data, CheckpointView<TF>& view) -> B
+	{
+		if (data.size() < sizeof(CheckpointHeader))
+		{
+			return false;
+		}
+
+		CheckpointHeader header;
+		memcpy(&header, data.data(), sizeof(header));
+
+		if
+		(
+			header.magic != CCheckpointMagic ||
+			header.version != CCheckpointVersion ||
+			header.scalarSize != sizeof(TF) ||
+			header.sectionsCount > U32(ECheckpointSection::Count) ||
+			data.size() < sizeof(header) + header.sectionsCount * sizeof(CheckpointSection)
+		)
+		{
+			return false;
+		}
+
+		StaticArray<Span<const Byte>, U32(ECheckpointSection::Count)> payloads;
+		for (auto i = 0u; i < header.sectionsCount; ++i)
+		{
+			CheckpointSection section;
+			memcpy(&section, data.data() + sizeof(header) + i * sizeof(CheckpointSection), sizeof(section));
+
+			if
+			(
+				U32(section.type) >= U32(ECheckpointSection::Count) ||
+				section.offset % CCheckpointAlignment ||
+				section.offset > data.size() ||
+				section.size > data.size() - section.offset
+			)
+			{
+				return false;
+			}
+			payloads[U32(section.type)] = data.subspan(section.offset, section.size);
+		}
+
+		auto getBlock =
+		[&]<typename T>(ECheckpointSection type, U64 count, Span<const T>& out) -> B
+		{
+			auto& payload = payloads[U32(type)];
+			if (payload.size() != count * sizeof(T))
+			{
+				return false;
+			}
+			out = Span<const T>((const T*)payload.data(), count);
+			return true;
+		};
+
+		if
+		(
+			!getBlock(ECheckpointSection::Strokes, header.strokesCount, view.strokes) ||
+			!getBlock(ECheckpointSection::Widths, header.strokesCount, view.widths) ||
+			!getBlock(ECheckpointSection::Pigments, header.strokesCount, view.pigments)
+		)
+		{
+			return false;
+		}
+
+		view.fragmentOffsets = {};
+		view.fragments = {};
+		if (!payloads[U32(ECheckpointSection::FragmentOffsets)].empty())
+		{
+			if
+			(
+				!getBlock(ECheckpointSection::FragmentOffsets, header.strokesCount + 1, view.fragmentOffsets) ||
+				!getBlock(ECheckpointSection::Fragments, header.fragmentsCount, view.fragments) ||
+				view.fragmentOffsets.back() != header.fragmentsCount
+			)
+			{
+				return false;
+			}
+
+			for (auto i = 0u; i < header.strokesCount; ++i)
+			{
+				if (view.fragmentOffsets[i] > view.fragmentOffsets[i + 1])
+				{
+					return false;
+				}
+			}
+		}
+
+		view.state.maxSteps = header.maxSteps;
+		view.state.maxStrokes = header.maxStrokes;
+		view.state.maxWidth = header.maxWidth;
+		view.state.step = header.step;
+		view.state.width = header.width;
+		view.state.height = header.height;
+		view.state.maxTemperature = TF(header.maxTemperature);
+		view.state.temperature = TF(header.temperature);
+		view.state.optimalEnergy = TF(header.optimalEnergy);
+
+		return true;
+	}
+
+
+	template<typename TF>
+	inline CheckpointWriter<TF>::CheckpointWriter(StrView path) :
+		path(path),
+		tempPath(Str(path) + ".tmp"),
+		pendingSnapshots(0)
+	{
+		writerThread = Thread([this]() { WriterLoop(); });
+	}
+
+
+	template<typename TF>
+	inline CheckpointWriter<TF>::~CheckpointWriter()
+	{
+		Flush();
+		keepRunning = false;
+		pendingSnapshots.release();
+		writerThread.join();
+	}
+
+
+	template<typename TF>
+	inline auto CheckpointWriter<TF>::BeginSnapshot() -> Snapshot*
+	{
+		ScopedLock<Mutex> lock(snapshotsMutex);
+		for (auto i = 0u; i < snapshots.size(); ++i)
+		{
+			if (states[i] == ESnapshotState::Free)
+			{
+				states[i] = ESnapshotState::Filling;
+				return &snapshots[i];
+			}
+		}
+		return nullptr;
+	}
+
+
+	template<typename TF>
+	inline auto CheckpointWriter<TF>::CommitSnapshot(Snapshot* snapshot) -> V
+	{
+		{
+			ScopedLock<Mutex> lock(snapshotsMutex);
+			for (auto i = 0u; i < snapshots.size(); ++i)
+			{
+				if (&snapshots[i] == snapshot)
+				{
+					states[i] = ESnapshotState::Queued;
+					snapshotsInFlight++;
+				}
+				else if (states[i] == ESnapshotState::Queued)
+				{
+					states[i] = ESnapshotState::Free;
+					snapshotsInFlight--;
+				}
+			}
+		}
+		pendingSnapshots.release();
+	}
+
+
+	template<typename TF>
+	inline auto CheckpointWriter<TF>::Flush() -> V
+	{
+		for (auto inFlight = snapshotsInFlight.load(); inFlight; inFlight = snapshotsInFlight.load())
+		{
+			snapshotsInFlight.wait(inFlight);
+		}
+	}
+
+
+	template<typename TF>
+	inline auto CheckpointWriter<TF>::WriterLoop() -> V
+	{
+		while (true)
+		{
+			pendingSnapshots.acquire();
+
+			Snapshot* snapshot = nullptr;
+			U32 snapshotIdx = 0;
+			{
+				ScopedLock<Mutex> lock(snapshotsMutex);
+				for (auto i = 0u; i < snapshots.size(); ++i)
+				{
+					if (states[i] == ESnapshotState::Queued)
+					{
+						states[i] = ESnapshotState::Writing;
+						snapshot = &snapshots[i];
+						snapshotIdx = i;
+						break;
+					}
+				}
+			}
+
+			if (!snapshot)
+			{
+				if (!keepRunning)
+				{
+					break;
+				}
+				continue;
+			}
+
+			SerializeCheckpoint
+			(
+				outBuffer,
+				snapshot->state,
+				Span<const QuadraticBezier<TF, 2>>(snapshot->strokes),
+				Span<const TF>(snapshot->widths),
+				Span<const TF>(snapshot->pigments),
+				Span<const U64>(snapshot->fragmentOffsets),
+				Span<const Fragment>(snapshot->fragments)
+			);
+
+			if (!WriteWholeFileDurably(tempPath, outBuffer) || !RenameFile(tempPath, path))
+			{
+				LogError("Failed to write checkpoint ", path, ".");
+			}
+
+			{
+				ScopedLock<Mutex> lock(snapshotsMutex);
+				states[snapshotIdx] = ESnapshotState::Free;
+			}
+			snapshotsInFlight--;
+			snapshotsInFlight.notify_all();
+		}
+	}
+}
\ No newline at end of file
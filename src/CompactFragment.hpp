@@ -0,0 +1,200 @@
+// Copyright 2024 Mihail Mladenov
+//
+// This file is part of PencilAnnealing.
+//
+// PencilAnnealing is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PencilAnnealing is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PencilAnnealing.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "Types.hpp"
+#include "Rendering.hpp"
+#include "SIMD.hpp"
+
+namespace PA
+{
+	// A fragment in 4 bytes instead of 8: the distance of its lebesgue index
+	// to the previous one and its value in 16 bit fixed point. Entries with a
+	// zero delta are escapes, they advance the index by value * CCompactMaxDelta
+	// and emit nothing, so gaps of any size can be encoded.
+	struct CompactFragment
+	{
+		U16 delta;
+		U16 value;
+	};
+
+	inline constexpr U32 CCompactMaxDelta = 0xFFFF;
+	inline constexpr F32 CCompactValueScale = 1.f / 65535.f;
+
+	// Number of entries the encoding of fragments takes. Fragments have to
+	// be sorted and unique, see MergeFragments.
+	inline auto GetCompactSize(Span<const Fragment> fragments) -> U32;
+	// Encodes relative to the index before the first fragment, the decoder
+	// has to be given the index of the first fragment.
+	inline auto EncodeFragments(Span<const Fragment> fragments, CompactFragment* out) -> V;
+	// Returns the number of fragments written to out.
+	inline auto DecodeFragments(U32 first, Span<const CompactFragment> in, Fragment* out) -> U32;
+	inline auto QuantizeFragmentValue(F32 value) -> U16;
+	// Rounds values to what the encoding keeps, so fragments added to a
+	// surface can later be subtracted exactly from their decoded form.
+	inline auto QuantizeFragments(Span<Fragment> fragments) -> V;
+}
+
+
+namespace PA
+{
+	inline auto QuantizeFragmentValue(F32 value) -> U16
+	{
+		return U16(Clamp(value, 0.f, 1.f) * 65535.f + 0.5f);
+	}
+
+
+	inline auto GetCompactSize(Span<const Fragment> fragments) -> U32
+	{
+		if (fragments.empty())
+		{
+			return 0;
+		}
+
+		auto size = U32(fragments.size());
+		for (auto i = 1u; i < fragments.size(); ++i)
+		{
+			// Mirrors the escapes emitted by EncodeFragments.
+			auto gap = fragments[i].idx - fragments[i - 1].idx;
+			while (gap > CCompactMaxDelta)
+			{
+				gap -= Min((gap - 1) / CCompactMaxDelta, CCompactMaxDelta) * CCompactMaxDelta;
+				size++;
+			}
+		}
+		return size;
+	}
+
+
+	inline auto EncodeFragments(Span<const Fragment> fragments, CompactFragment* out) -> V
+	{
+		if (fragments.empty())
+		{
+			return;
+		}
+
+		auto previous = fragments.front().idx - 1;
+		for (const auto& fragment : fragments)
+		{
+			auto gap = fragment.idx - previous;
+			while (gap > CCompactMaxDelta)
+			{
+				auto steps = Min((gap - 1) / CCompactMaxDelta, CCompactMaxDelta);
+				*out++ = { 0, U16(steps) };
+				gap -= steps * CCompactMaxDelta;
+			}
+			*out++ = { U16(gap), QuantizeFragmentValue(fragment.value) };
+			previous = fragment.idx;
+		}
+	}
+
+
+	inline auto DecodeFragments(U32 first, Span<const CompactFragment> in, Fragment* out) -> U32
+	{
+		auto running = first - 1;
+		auto inPtr = in.data();
+		auto outPtr = out;
+		U32 i = 0;
+
+		// Blocks without escapes are decoded with a prefix sum of the deltas,
+		// the rest falls through to the scalar loop.
+		auto decodeScalar =
+			[&](U32 end)
+			{
+				for (; i < end; ++i)
+				{
+					if (inPtr[i].delta == 0)
+					{
+						running += inPtr[i].value * CCompactMaxDelta;
+						continue;
+					}
+					running += inPtr[i].delta;
+					*outPtr++ = { running, F32(inPtr[i].value) * CCompactValueScale };
+				}
+			};
+
+#if defined(PA_SIMD_AVX2)
+		auto deltaMask = _mm256_set1_epi32(0xFFFF);
+		auto scale = _mm256_set1_ps(CCompactValueScale);
+		auto carryLanes = _mm256_setr_epi32(0, 0, 0, 0, 3, 3, 3, 3);
+		for (; i + 8 <= in.size();)
+		{
+			auto entries = _mm256_loadu_si256((const __m256i*)(inPtr + i));
+			auto deltas = _mm256_and_si256(entries, deltaMask);
+			if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(deltas, _mm256_setzero_si256())))
+			{
+				decodeScalar(i + 8);
+				continue;
+			}
+
+			deltas = _mm256_add_epi32(deltas, _mm256_slli_si256(deltas, 4));
+			deltas = _mm256_add_epi32(deltas, _mm256_slli_si256(deltas, 8));
+			auto carry = _mm256_permutevar8x32_epi32(deltas, carryLanes);
+			deltas = _mm256_add_epi32(deltas, _mm256_blend_epi32(_mm256_setzero_si256(), carry, 0xF0));
+			auto indices = _mm256_add_epi32(deltas, _mm256_set1_epi32(I32(running)));
+			auto values = _mm256_castps_si256(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(entries, 16)), scale));
+
+			auto lo = _mm256_unpacklo_epi32(indices, values);
+			auto hi = _mm256_unpackhi_epi32(indices, values);
+			_mm256_storeu_si256((__m256i*)outPtr, _mm256_permute2x128_si256(lo, hi, 0x20));
+			_mm256_storeu_si256((__m256i*)(outPtr + 4), _mm256_permute2x128_si256(lo, hi, 0x31));
+
+			running = U32(_mm256_extract_epi32(indices, 7));
+			outPtr += 8;
+			i += 8;
+		}
+#elif defined(PA_SIMD_SSE2)
+		auto deltaMask = _mm_set1_epi32(0xFFFF);
+		auto scale = _mm_set1_ps(CCompactValueScale);
+		for (; i + 4 <= in.size();)
+		{
+			auto entries = _mm_loadu_si128((const __m128i*)(inPtr + i));
+			auto deltas = _mm_and_si128(entries, deltaMask);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(deltas, _mm_setzero_si128())))
+			{
+				decodeScalar(i + 4);
+				continue;
+			}
+
+			deltas = _mm_add_epi32(deltas, _mm_slli_si128(deltas, 4));
+			deltas = _mm_add_epi32(deltas, _mm_slli_si128(deltas, 8));
+			auto indices = _mm_add_epi32(deltas, _mm_set1_epi32(I32(running)));
+			auto values = _mm_castps_si128(_mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(entries, 16)), scale));
+
+			_mm_storeu_si128((__m128i*)outPtr, _mm_unpacklo_epi32(indices, values));
+			_mm_storeu_si128((__m128i*)(outPtr + 2), _mm_unpackhi_epi32(indices, values));
+
+			running = U32(_mm_cvtsi128_si32(_mm_shuffle_epi32(indices, 0xFF)));
+			outPtr += 4;
+			i += 4;
+		}
+#endif
+		decodeScalar(U32(in.size()));
+
+		return U32(outPtr - out);
+	}
+
+
+	inline auto QuantizeFragments(Span<Fragment> fragments) -> V
+	{
+		for (auto& fragment : fragments)
+		{
+			fragment.value = F32(QuantizeFragmentValue(fragment.value)) * CCompactValueScale;
+		}
+	}
+}
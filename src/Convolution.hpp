@@ -22,6 +22,7 @@
 #include "Image.hpp"
 #include "Error.hpp"
 #include "ThreadPool.hpp"
+#include "Parallel.hpp"
 #include "Vector.hpp"
 #include "Utilities.hpp"
 
@@ -40,18 +41,38 @@ namespace PA
 		constexpr Kernel(TArgs... args);
 
 		Conditional<UniformPerChannel, StaticArray<TF, Dim0 * Dim1>, StaticArray<TF, Dim0 * Dim1 * Channels>> data;
+
+		// Set when data is the outer product of column and row. Worked out by
+		// the constructor, so constexpr kernels are classified at compile time.
+		B separable = false;
+		StaticArray<TF, Dim0> row = {};
+		StaticArray<TF, Dim1> column = {};
 	};
 
+	// Convolutions are computed in lebesgue aligned tiles of this side, read
+	// together with a halo into a linear buffer.
+	inline constexpr U32 CConvolutionTileSide = 64;
+
+	// Calls convolve(const F32* in, U32 inStride, F32* out, U32 side) on each
+	// tile of input holding pixels of the image. in is the tile widened by
+	// Radius pixels on every side, pixels outside the image read as zero. out
+	// is the linear side x side result, written to the same tile of output
+	// through store(const F32* in, TOut* out, U32 count). Pixels of output
+	// outside the image are left untouched.
+	template <U32 Radius, typename TOut, typename TConvolve, typename TStore>
+	inline auto ConvoluteTiles(ThreadPool<>& threadPool, const RawCPUImage& input, TOut* output, TConvolve&& convolve, TStore&& store) -> V;
+
 	template <typename TKernel>
 	inline auto Convolute(ThreadPool<>& threadPool, const TKernel& kernel, const RawCPUImage& input) -> RawCPUImage;
 
 	template <typename TF, U32 Channels>
-	inline static constexpr auto SobelX = Kernel<TF, Channels, 3, 3, true>(TF(-1), TF(0), TF(1), TF(-2), TF(0), TF(2), TF(-1), TF(0), TF(-1));
+	inline static constexpr auto SobelX = Kernel<TF, Channels, 3, 3, true>(TF(-1), TF(0), TF(1), TF(-2), TF(0), TF(2), TF(-1), TF(0), TF(1));
 
 	template <typename TF, U32 Channels>
 	inline static constexpr auto SobelY = Kernel<TF, Channels, 3, 3, true>(TF(1), TF(2), TF(1), TF(0), TF(0), TF(0), TF(-1), TF(-2), TF(-1));
 
 	inline auto SobelEdgeDetect(ThreadPool<>& threadPool, const RawCPUImage& input, F32 threshold = 200) -> RawCPUImage;
+	// Both Sobel kernels and the magnitude are computed in a single pass.
 	inline auto GradientMagnitude(ThreadPool<>& threadPool, const RawCPUImage& input, F32 threshold = 150) -> RawCPUImage;
 }
 
@@ -63,6 +84,131 @@ namespace PA
 	inline constexpr Kernel<TF, Channels, Dim0, Dim1, UniformPerChannel>::Kernel(TArgs... args) :
 		data({ args... })
 	{
+		if constexpr (UniformPerChannel)
+		{
+			// Row and column through the first nonzero tap; the kernel is
+			// separable if their product gives back every tap.
+			auto pivot = 0u;
+			while (pivot < Dim0 * Dim1 && data[pivot] == TF(0))
+			{
+				++pivot;
+			}
+			if (pivot == Dim0 * Dim1)
+			{
+				return;
+			}
+
+			for (auto k = 0u; k < Dim0; ++k)
+			{
+				row[k] = data[pivot / Dim0 * Dim0 + k];
+			}
+			for (auto j = 0u; j < Dim1; ++j)
+			{
+				column[j] = data[j * Dim0 + pivot % Dim0] / data[pivot];
+			}
+
+			separable = true;
+			for (auto j = 0u; j < Dim1; ++j)
+			{
+				for (auto k = 0u; k < Dim0; ++k)
+				{
+					separable = separable && column[j] * row[k] == data[j * Dim0 + k];
+				}
+			}
+		}
+	}
+
+
+	template<U32 Radius, typename TOut, typename TConvolve, typename TStore>
+	inline auto ConvoluteTiles(ThreadPool<>& threadPool, const RawCPUImage& input, TOut* output, TConvolve&& convolve, TStore&& store) -> V
+	{
+		PA_ASSERT(input.lebesgueOrdered);
+		// TODO: Handle multiple formats.
+		PA_ASSERT(input.format == EFormat::A32Float || input.format == EFormat::A8);
+
+		auto side = Min(CConvolutionTileSide, input.lebesgueStride);
+		auto inStride = side + 2 * Radius;
+		auto tileSize = side * side;
+		auto tilesCount = input.lebesgueStride * input.lebesgueStride / tileSize;
+
+		auto gather =
+		[&](const auto* inPtr, U32 x0, U32 y0, U32 columns, U32 rows, F32* tile)
+		{
+			LebesgueToLinear
+			(
+				inPtr + LebesgueCurve(x0, y0),
+				tile + Radius * inStride + Radius,
+				inStride,
+				columns,
+				0,
+				rows,
+				[](const auto* in, F32* out, U32 count)
+				{
+					for (auto i = 0u; i < count; ++i)
+					{
+						out[i] = F32(in[i]);
+					}
+				}
+			);
+
+			auto fill =
+			[&](F32* tileRow, I32 y, U32 begin, U32 end)
+			{
+				for (auto i = begin; i < end; ++i)
+				{
+					auto x = I32(x0 + i) - I32(Radius);
+					auto inside = x >= 0 && y >= 0 && x < I32(input.width) && y < I32(input.height);
+					tileRow[i] = inside ? F32(inPtr[LebesgueCurve(x, y)]) : 0.f;
+				}
+			};
+
+			// The halo and the parts of the tile outside the image.
+			for (auto i = 0u; i < inStride; ++i)
+			{
+				auto y = I32(y0 + i) - I32(Radius);
+				if (i >= Radius && i < Radius + rows)
+				{
+					fill(tile + i * inStride, y, 0, Radius);
+					fill(tile + i * inStride, y, Radius + columns, inStride);
+				}
+				else
+				{
+					fill(tile + i * inStride, y, 0, inStride);
+				}
+			}
+		};
+
+		auto task =
+		[&](U32 start, U32 end)
+		{
+			Array<F32> tile(inStride * inStride);
+			Array<F32> result(tileSize);
+
+			for (auto t = start; t < end; ++t)
+			{
+				auto [x0, y0] = LebesgueCurveInverse(t * tileSize);
+				if (x0 >= input.width || y0 >= input.height)
+				{
+					continue;
+				}
+				auto columns = Min(side, input.width - x0);
+				auto rows = Min(side, input.height - y0);
+
+				if (input.format == EFormat::A8)
+				{
+					gather((const U8*)input.data.data(), x0, y0, columns, rows, tile.data());
+				}
+				else
+				{
+					gather((const F32*)input.data.data(), x0, y0, columns, rows, tile.data());
+				}
+
+				convolve((const F32*)tile.data(), inStride, result.data(), side);
+				LinearToLebesgue((const F32*)result.data(), side, output + t * tileSize, columns, rows, store);
+			}
+		};
+
+		ParallelFor(threadPool, 0, tilesCount, Max(CPixelsPerChunk / tileSize, 1u), task);
 	}
 
 
@@ -71,61 +217,86 @@ namespace PA
 	{
 		// TODO: Handle more output formats
 		RawCPUImage result(input.width, input.height, EFormat::A32Float, true);
-		PA_ASSERT(input.lebesgueOrdered);
 
-		auto extentSize = input.lebesgueStride * input.lebesgueStride;
-		auto tasksCount = threadPool.GetMaxTasks();
-		auto pixelsPerTask = extentSize / tasksCount;
+		static constexpr U32 dim0 = TKernel::dimension0;
+		static constexpr U32 dim1 = TKernel::dimension1;
+		static constexpr U32 radius = (dim0 > dim1 ? dim0 : dim1) / 2;
+		static constexpr U32 offsetX = (dim0 - 1) / 2;
+		static constexpr U32 offsetY = (dim1 - 1) / 2;
 
-		auto task =
-		[&] (U32 start, U32 end)
+		auto convolve =
+		[&](const F32* in, U32 inStride, F32* out, U32 side)
 		{
-			for (auto i = start; i < end; ++i)
+			// Top left tap of the first output pixel.
+			auto origin = in + (radius - offsetY) * inStride + radius - offsetX;
+
+			if (kernel.separable)
 			{
-				auto coords = LebesgueCurveInverse(i);
-				I32 offsetX = (kernel.dimension0 - 1) / 2;
-				I32 offsetY = (kernel.dimension1 - 1) / 2;
-				typename TKernel::Scalar accumulator(0);
-				for (auto j = 0u; j < kernel.dimension1; ++j)
+				// Columns first into a row buffer, then the row pass over it.
+				StaticArray<F32, CConvolutionTileSide + dim0 - 1> columnSums;
+				for (auto y = 0u; y < side; ++y)
 				{
-					for (auto k = 0u; k < kernel.dimension0; ++k)
+					auto columnsCount = side + dim0 - 1;
+					for (auto x = 0u; x < columnsCount; ++x)
+					{
+						columnSums[x] = 0;
+					}
+					for (auto j = 0u; j < dim1; ++j)
 					{
-						auto x = -offsetX + k + coords.first;
-						auto y = -offsetY + j + coords.second;
+						auto inRow = origin + (y + j) * inStride;
+						auto weight = F32(kernel.column[j]);
+						for (auto x = 0u; x < columnsCount; ++x)
+						{
+							columnSums[x] += inRow[x] * weight;
+						}
+					}
 
-						typename TKernel::Scalar value(0);
-						if (x >= 0 && y >= 0 && x < input.width && y < input.height)
+					auto outRow = out + y * side;
+					for (auto x = 0u; x < side; ++x)
+					{
+						outRow[x] = 0;
+					}
+					for (auto k = 0u; k < dim0; ++k)
+					{
+						auto weight = F32(kernel.row[k]);
+						for (auto x = 0u; x < side; ++x)
+						{
+							outRow[x] += columnSums[x + k] * weight;
+						}
+					}
+				}
+				return;
+			}
+
+			for (auto y = 0u; y < side; ++y)
+			{
+				auto outRow = out + y * side;
+				for (auto x = 0u; x < side; ++x)
+				{
+					outRow[x] = 0;
+				}
+				for (auto j = 0u; j < dim1; ++j)
+				{
+					for (auto k = 0u; k < dim0; ++k)
+					{
+						auto inRow = origin + (y + j) * inStride + k;
+						auto weight = F32(kernel.data[j * dim0 + k]);
+						for (auto x = 0u; x < side; ++x)
 						{
-							auto idx = LebesgueCurve(x, y);
-							// TODO: Handle multiple formats.
-							PA_ASSERT(input.format == EFormat::A32Float || input.format == EFormat::A8);
-							if (input.format == EFormat::A8)
-							{
-								value = input.data[idx];
-							}
-							else if (input.format == EFormat::A32Float)
-							{
-								value = ((F32*)input.data.data())[idx];
-							}
+							outRow[x] += inRow[x] * weight;
 						}
-						accumulator += value * kernel.data[j * kernel.dimension0 + k];
 					}
 				}
-				((F32*)result.data.data())[i] = accumulator;
 			}
 		};
 
-		Array<TaskResult<V>> results;
-		for (auto i = 0u; i < tasksCount; ++i)
+		auto store =
+		[](const F32* in, F32* out, U32 count)
 		{
-			results.emplace_back(threadPool.AddTask(task, i * pixelsPerTask, (i + 1) * pixelsPerTask));
-		}
-		task(pixelsPerTask * tasksCount, extentSize);
+			MemCopy(Span<const F32>(in, count), out);
+		};
 
-		for (auto& res : results)
-		{
-			res.Retrieve();
-		}
+		ConvoluteTiles<radius>(threadPool, input, (F32*)result.data.data(), convolve, store);
 
 		return result;
 	}
@@ -139,8 +310,6 @@ namespace PA
 		auto resultF = Convolute(threadPool, SobelY<F32, 1>, gX);
 
 		auto extentSize = input.lebesgueStride * input.lebesgueStride;
-		auto tasksCount = threadPool.GetMaxTasks();
-		auto pixelsPerTask = extentSize / tasksCount;
 
 		auto task =
 		[&](U32 start, U32 end)
@@ -157,17 +326,7 @@ namespace PA
 			}
 		};
 
-		Array<TaskResult<V>> results;
-		for (auto i = 0u; i < tasksCount; ++i)
-		{
-			results.emplace_back(threadPool.AddTask(task, i * pixelsPerTask, (i + 1) * pixelsPerTask));
-		}
-		task(pixelsPerTask * tasksCount, extentSize);
-
-		for (auto& res : results)
-		{
-			res.Retrieve();
-		}
+		ParallelFor(threadPool, 0, extentSize, CPixelsPerChunk, task);
 
 		return result;
 	}
@@ -177,44 +336,50 @@ namespace PA
 		PA_ASSERT(input.lebesgueOrdered);
 		RawCPUImage result(input.width, input.height, input.format, true);
 
-		auto gX = Convolute(threadPool, SobelX<F32, 1>, input);
-		auto gY = Convolute(threadPool, SobelY<F32, 1>, input);
+		static constexpr auto& sobelX = SobelX<F32, 1>;
+		static constexpr auto& sobelY = SobelY<F32, 1>;
+		static_assert(sobelX.separable && sobelY.separable);
 
-		auto extentSize = input.lebesgueStride * input.lebesgueStride;
-		auto tasksCount = threadPool.GetMaxTasks();
-		auto pixelsPerTask = extentSize / tasksCount;
-
-		auto task =
-		[&] (U32 start, U32 end)
+		auto convolve =
+		[](const F32* in, U32 inStride, F32* out, U32 side)
 		{
-			for (auto i = start; i < end; ++i)
+			// Column passes of both kernels for one row, then the row passes
+			// and the magnitude.
+			StaticArray<F32, CConvolutionTileSide + 2> columnX;
+			StaticArray<F32, CConvolutionTileSide + 2> columnY;
+			for (auto y = 0u; y < side; ++y)
 			{
-				auto coords = LebesgueCurveInverse(i);
-				if (coords.first >= input.width || coords.second >= input.height)
+				auto in0 = in + y * inStride;
+				auto in1 = in0 + inStride;
+				auto in2 = in1 + inStride;
+				for (auto x = 0u; x < side + 2; ++x)
 				{
-					continue;
+					columnX[x] = in0[x] * sobelX.column[0] + in1[x] * sobelX.column[1] + in2[x] * sobelX.column[2];
+					columnY[x] = in0[x] * sobelY.column[0] + in1[x] * sobelY.column[1] + in2[x] * sobelY.column[2];
+				}
+
+				auto outRow = out + y * side;
+				for (auto x = 0u; x < side; ++x)
+				{
+					auto gX = columnX[x] * sobelX.row[0] + columnX[x + 1] * sobelX.row[1] + columnX[x + 2] * sobelX.row[2];
+					auto gY = columnY[x] * sobelY.row[0] + columnY[x + 1] * sobelY.row[1] + columnY[x + 2] * sobelY.row[2];
+					outRow[x] = Sqrt(gX * gX + gY * gY);
 				}
-				// TODO: Handle more formats.
-				auto gXV = ((F32*)gX.data.data())[i];
-				auto gYV = ((F32*)gY.data.data())[i];
-				//result.data[i] = ClampedU8(Sqrt(gXV * gXV + gYV * gYV));
-				auto gradMag = Sqrt(gXV * gXV + gYV * gYV);
-				result.data[i] = (gradMag < threshold) ? gradMag : 255;
 			}
 		};
 
-		Array<TaskResult<V>> results;
-		for (auto i = 0u; i < tasksCount; ++i)
+		// TODO: Handle more formats.
+		auto store =
+		[threshold](const F32* in, Byte* out, U32 count)
 		{
-			results.emplace_back(threadPool.AddTask(task, i * pixelsPerTask, (i + 1) * pixelsPerTask));
-		}
-		task(pixelsPerTask * tasksCount, extentSize);
+			for (auto i = 0u; i < count; ++i)
+			{
+				out[i] = Byte((in[i] < threshold) ? in[i] : 255);
+			}
+		};
 
-		for (auto& res : results)
-		{
-			res.Retrieve();
-		}
+		ConvoluteTiles<1>(threadPool, input, result.data.data(), convolve, store);
 
-		return result;		
+		return result;
 	}
 }
\ No newline at end of file
@@ -20,20 +20,62 @@
 
 #include "Types.hpp"
 
+#include <algorithm>
 #include <cstdio>
 #include <filesystem>
 
+#if defined(_WIN32)
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+	#include <io.h>
+	#undef CreateDirectory
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
 namespace PA
 {
 	inline auto ReadWholeFile(StrView path, Array<Byte>& data) -> B;
 	inline auto WriteWholeFile(StrView path, Span<const Byte> data, B append = false) -> B;
+    // Returns once the data reached the disk, so a file renamed afterwards
+    // is never seen truncated after a power loss.
+    inline auto WriteWholeFileDurably(StrView path, Span<const Byte> data) -> B;
     inline auto FileExists(StrView path) -> B;
     inline auto RemoveFile(StrView path) -> B;
+    // Replaces the destination if it exists.
+    inline auto RenameFile(StrView from, StrView to) -> B;
     inline auto RemoveDirectoryRecursive(StrView path) -> B;
     inline auto CreateDirectory(StrView path) -> B;
+    // Regular files directly inside the directory, sorted, filtered by extension if one is given.
+    inline auto ListFiles(StrView directory, StrView extension = ""sv) -> Array<Str>;
 
     using Path = std::filesystem::path;
     using ErrorCode = std::error_code;
+
+    // Read only view of a whole file mapped into memory.
+    class MappedFile
+    {
+    public:
+        MappedFile() = default;
+        MappedFile(const MappedFile&) = delete;
+        ~MappedFile();
+
+        auto Open(StrView path) -> B;
+        auto Close() -> V;
+        auto GetData() const -> Span<const Byte>;
+
+    private:
+        const Byte* data = nullptr;
+        U64 size = 0;
+#if defined(_WIN32)
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+#endif
+    };
 }
 
 
@@ -85,6 +127,26 @@ namespace PA
 	}
 
 
+    inline auto WriteWholeFileDurably(StrView path, Span<const Byte> data) -> B
+    {
+        auto handle = fopen(Str(path).c_str(), "wb");
+
+        if (!handle)
+        {
+            return false;
+        }
+
+        auto written = fwrite(data.data(), data.size(), 1, handle) == 1 && fflush(handle) == 0;
+#if defined(_WIN32)
+        written = written && _commit(_fileno(handle)) == 0;
+#else
+        written = written && fsync(fileno(handle)) == 0;
+#endif
+
+        return fclose(handle) == 0 && written;
+    }
+
+
     inline auto FileExists(StrView p) -> B
     {
         Path path(p);
@@ -102,6 +164,14 @@ namespace PA
     }
 
 
+    inline auto RenameFile(StrView from, StrView to) -> B
+    {
+        ErrorCode ec;
+        std::filesystem::rename(Path(from), Path(to), ec);
+        return !ec;
+    }
+
+
     inline auto RemoveDirectoryRecursive(StrView path) -> B
     {
         ErrorCode ec;
@@ -114,4 +184,121 @@ namespace PA
     {
         return std::filesystem::create_directory(Path(path));
     }
+
+
+    inline auto ListFiles(StrView directory, StrView extension) -> Array<Str>
+    {
+        Array<Str> files;
+        ErrorCode ec;
+        for (const auto& entry : std::filesystem::directory_iterator(Path(directory), ec))
+        {
+            if (entry.is_regular_file() && (extension.empty() || entry.path().extension() == extension))
+            {
+                files.push_back(entry.path().string());
+            }
+        }
+        std::sort(files.begin(), files.end());
+        return files;
+    }
+
+
+    inline MappedFile::~MappedFile()
+    {
+        Close();
+    }
+
+
+    inline auto MappedFile::Open(StrView path) -> B
+    {
+        Close();
+
+#if defined(_WIN32)
+        file = CreateFileA(Str(path).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+        {
+            Close();
+            return false;
+        }
+
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping)
+        {
+            Close();
+            return false;
+        }
+
+        data = (const Byte*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!data)
+        {
+            Close();
+            return false;
+        }
+        size = U64(fileSize.QuadPart);
+#else
+        auto fd = open(Str(path).c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat fileStat;
+        if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        auto mapped = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        // The mapping keeps its own reference to the file.
+        close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            return false;
+        }
+
+        data = (const Byte*)mapped;
+        size = U64(fileStat.st_size);
+#endif
+        return true;
+    }
+
+
+    inline auto MappedFile::Close() -> V
+    {
+#if defined(_WIN32)
+        if (data)
+        {
+            UnmapViewOfFile(data);
+        }
+        if (mapping)
+        {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(file);
+        }
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data)
+        {
+            munmap((V*)data, size);
+        }
+#endif
+        data = nullptr;
+        size = 0;
+    }
+
+
+    inline auto MappedFile::GetData() const -> Span<const Byte>
+    {
+        return Span<const Byte>(data, size);
+    }
 }
\ No newline at end of file
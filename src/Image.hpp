@@ -21,7 +21,9 @@
 #include "Types.hpp"
 #include "Algebra.hpp"
 #include "ThreadPool.hpp"
+#include "Parallel.hpp"
 #include "Color.hpp"
+#include "SIMD.hpp"
 
 
 namespace PA
@@ -33,11 +35,25 @@ namespace PA
 		RGBA8,
 		RGBA32,
 		RGBA32Float,
+		// Signed Q6.9 fixed point, see ToFixed.
+		A16Fixed,
 		Invalid
 	};
 
 	inline auto GetSize(EFormat format);
 
+	// A16Fixed values cover [-64, 64) in steps of 1 / CFixedOne, half an A8
+	// step, so about 64 strokes can pile up on a pixel. Sums wrap around
+	// instead of saturating, so adding and later subtracting the same ToFixed
+	// value always restores a pixel exactly. A wrapped sum decodes wrongly
+	// though, see FitsFixed.
+	inline constexpr I32 CFixedOne = 1 << 9;
+	inline auto ToFixed(F32 value) -> I16;
+	// Whether a sum of A16Fixed values computed in 32 bits is representable.
+	inline auto FitsFixed(I32 value) -> B;
+	// Matches ClampedU8(value * 255) of the value the fixed point represents.
+	inline auto FixedToU8(I16 value) -> U8;
+
 	struct Extent
 	{
 		U32 x;
@@ -91,6 +107,7 @@ namespace PA
 	inline auto AdditiveBlendA8(const RawCPUImage& img0, const RawCPUImage& img1, F32 img0Contribution) -> RawCPUImage;
 
 	inline auto A32FloatToRGBA8Linear(const RawCPUImage & img)->RawCPUImage;
+	inline auto A16FixedToRGBA8Linear(const RawCPUImage& img) -> RawCPUImage;
 }
 
 
@@ -123,12 +140,31 @@ namespace PA
 			4,
 			16,
 			16,
+			2,
 			0
 		};
 
 		return sizeTable[U32(format)];
 	}
 
+
+	inline auto ToFixed(F32 value) -> I16
+	{
+		return I16(std::lrint(value * F32(CFixedOne)));
+	}
+
+
+	inline auto FitsFixed(I32 value) -> B
+	{
+		return value >= I32(Limits<I16>::min()) && value <= I32(Limits<I16>::max());
+	}
+
+
+	inline auto FixedToU8(I16 value) -> U8
+	{
+		return U8(Clamp((I32(value) * 255) >> 9, 0, 255));
+	}
+
 	inline auto AdditiveBlendA8(const RawCPUImage& img0, const RawCPUImage& img1, F32 img0Contribution) -> RawCPUImage
 	{
 		PA_ASSERT(img0.width == img0.width && img1.height == img1.height);
@@ -137,12 +173,33 @@ namespace PA
 
 		RawCPUImage result(img0.width, img0.height, img0.format, img0.lebesgueOrdered);
 
-		auto maxExtent = img0.lebesgueStride * img0.lebesgueStride;
-
-		for (auto i = 0; i < maxExtent; ++i)
-		{
-			result.data[i] = ClampedU8(img0Contribution * img0.data[i] + (1.f - img0Contribution) * img1.data[i]);
-		}
+		const auto zero = F32xN::Broadcast(0.f);
+		const auto maxU8 = F32xN::Broadcast(255.f);
+		const auto contribution0 = F32xN::Broadcast(img0Contribution);
+		const auto contribution1 = F32xN::Broadcast(1.f - img0Contribution);
+		auto in0 = img0.data.data();
+		auto in1 = img1.data.data();
+		auto out = result.data.data();
+
+		// Padding is left at zero.
+		ForEachLebesgueRange
+		(
+			img0.width,
+			img0.height,
+			[&](U32 begin, U32 end)
+			{
+				auto i = begin;
+				for (; i + F32xN::width <= end; i += F32xN::width)
+				{
+					auto blend = contribution0 * F32xN::LoadU8(in0 + i) + contribution1 * F32xN::LoadU8(in1 + i);
+					Min(Max(blend, zero), maxU8).StoreU8(out + i);
+				}
+				for (; i < end; ++i)
+				{
+					out[i] = ClampedU8(img0Contribution * in0[i] + (1.f - img0Contribution) * in1[i]);
+				}
+			}
+		);
 
 		return result;
 	}
@@ -157,15 +214,38 @@ namespace PA
 		auto inPtr = (const F32*)img.data.data();
 		auto outPtr = (ColorU32*)result.data.data();
 
-		for (auto i = 0u; i < img.height; ++i)
-		{
-			for (auto j = 0; j < img.width; ++j)
+		auto convert =
+			[](const F32* in, ColorU32* out, U32 count)
 			{
-				auto lebesgueIdx = LebesgueCurve(j, i);
-				auto color = ClampedU8(255.f * (inPtr[lebesgueIdx]));
-				outPtr[i * img.width + j] = ColorU32(color, color, color, 255u);
-			}
-		}
+				for (auto i = 0u; i < count; ++i)
+				{
+					auto color = ClampedU8(255.f * in[i]);
+					out[i] = ColorU32(color, color, color, 255u);
+				}
+			};
+
+		LebesgueToLinear(inPtr, outPtr, img.width, img.width, 0, img.height, convert);
+		return result;
+	}
+
+
+	inline auto A16FixedToRGBA8Linear(const RawCPUImage& img) -> RawCPUImage
+	{
+		PA_ASSERT(img.format == EFormat::A16Fixed);
+		PA_ASSERT(img.lebesgueOrdered == true);
+		RawCPUImage result(img.width, img.height, EFormat::RGBA8, false);
+
+		auto convert =
+			[](const I16* in, ColorU32* out, U32 count)
+			{
+				for (auto i = 0u; i < count; ++i)
+				{
+					auto color = FixedToU8(in[i]);
+					out[i] = ColorU32(color, color, color, 255u);
+				}
+			};
+
+		LebesgueToLinear((const I16*)img.data.data(), (ColorU32*)result.data.data(), img.width, img.width, 0, img.height, convert);
 		return result;
 	}
 
@@ -176,7 +256,7 @@ namespace PA
 		if (lebesgueOrdered)
 		{
 			auto maxDim = Max(width, height);
-			lebesgueStride = RoundToPowerOfTwo(maxDim);
+			lebesgueStride = Max(RoundToPowerOfTwo(maxDim), CLebesgueBlockSide);
 			data.resize(lebesgueStride * lebesgueStride * GetSize(format));
 		}
 		else
@@ -237,8 +317,6 @@ namespace PA
 	{
 		auto maxExtent = lebesgueOrdered ? lebesgueStride * lebesgueStride : width * height;
 		auto tPtr = (T*)data.data();
-		auto taskCount = GetLogicalCPUCount();
-		auto pixelsPerTask = maxExtent / taskCount;
 
 		auto task =
 			[&](U32 start, U32 end)
@@ -249,19 +327,7 @@ namespace PA
 				}
 			};
 
-		Array<TaskResult<V>> results;
-		for (auto i = 0u; i < taskCount; ++i)
-		{
-			results.emplace_back(threadPool.AddTask(task, i * pixelsPerTask, (i + 1) * pixelsPerTask));
-		}
-
-		// Remainder
-		task(pixelsPerTask * taskCount, maxExtent);
-
-		for (auto& result : results)
-		{
-			result.Retrieve();
-		}
+		ParallelFor(threadPool, 0, maxExtent, CPixelsPerChunk, task);
 	}
 
 }
\ No newline at end of file
@@ -24,6 +24,9 @@
 
 namespace PA
 {
+	// Keeps lines from concurrent annealers from interleaving.
+	inline Mutex GLogMutex;
+
 	template <typename... Ts>
 	auto Log(Ts... args) -> V;
 	template <typename... Ts>
@@ -36,6 +39,7 @@ namespace PA
 	template <typename... Ts>
 	auto Log(Ts... args) -> V
 	{
+		ScopedLock<Mutex> lock(GLogMutex);
 		(std::cout << ... << args) << std::endl;
 	}
 
@@ -43,6 +47,7 @@ namespace PA
 	template <typename... Ts>
 	auto LogError(Ts... args) -> V
 	{
+		ScopedLock<Mutex> lock(GLogMutex);
 		(std::cerr << ... << args) << std::endl;
 	}
 }
\ No newline at end of file
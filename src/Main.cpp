@@ -26,15 +26,215 @@
 
 using namespace PA;
 
+namespace
+{
+	auto ReadInputImage(StrView path, B useTestImageFallback) -> RawCPUImage
+	{
+		Span<const Byte> rawImageData;
+		Array<Byte> utilityBufer;
+
+		if (FileExists(path))
+		{
+			ReadWholeFile(path, utilityBufer);
+			rawImageData = Span<const Byte>(utilityBufer);
+		}
+		else if (useTestImageFallback)
+		{
+			LogError("File \"", path, "\" not found!");
+			rawImageData = Span<const Byte>(GEmbeddedTestImageData, CEmbeddedTestImageSize);
+		}
+		else
+		{
+			LogError("File \"", path, "\" not found!");
+			return {};
+		}
+
+		return DecodeWebP(rawImageData);
+	}
+
+
+	auto ReadManifest(StrView path) -> Array<Str>
+	{
+		Array<Byte> data;
+		Array<Str> inputs;
+		if (!ReadWholeFile(path, data))
+		{
+			LogError("Cannot read manifest \"", path, "\"!");
+			return inputs;
+		}
+
+		Str line;
+		for (auto c : data)
+		{
+			if (c != '\n' && c != '\r')
+			{
+				line.push_back(C(c));
+				continue;
+			}
+			if (!line.empty() && line[0] != '#')
+			{
+				inputs.push_back(line);
+			}
+			line.clear();
+		}
+		if (!line.empty() && line[0] != '#')
+		{
+			inputs.push_back(line);
+		}
+		return inputs;
+	}
+
+
+	auto RunHeadless
+	(
+		const Annealer<F32>::Config& cfg,
+		StrView inImagePath,
+		StrView manifestPath,
+		StrView inDirectory,
+		StrView outDirectory,
+		U32 jobCount
+	) -> I32
+	{
+		struct Job
+		{
+			Str inPath;
+			Annealer<F32>::Config cfg;
+		};
+
+		Array<Str> inputs;
+		if (!manifestPath.empty())
+		{
+			inputs = ReadManifest(manifestPath);
+		}
+		else if (!inDirectory.empty())
+		{
+			inputs = ListFiles(inDirectory, ".webp"sv);
+		}
+
+		Array<Job> jobs;
+		if (inputs.empty() && manifestPath.empty() && inDirectory.empty())
+		{
+			// A single image keeps the output paths given on the command line.
+			jobs.push_back({ Str(inImagePath), cfg });
+		}
+
+		if (!inputs.empty())
+		{
+			std::filesystem::create_directories(Path(outDirectory));
+		}
+
+		// Inputs from different directories may share a name. Their outputs
+		// get the position of the input appended, so no two jobs write or
+		// resume from the same files.
+		Map<Str, U32> stemCounts;
+		for (const auto& input : inputs)
+		{
+			stemCounts[Path(input).stem().string()]++;
+		}
+
+		Set<Str> usedStems;
+		for (auto i = 0u; i < inputs.size(); ++i)
+		{
+			const auto& input = inputs[i];
+			auto stem = Path(input).stem().string();
+			if (stemCounts[stem] > 1)
+			{
+				stem += "-" + ToString(i);
+			}
+			if (!usedStems.insert(stem).second)
+			{
+				LogError("Outputs of \"", input, "\" would overwrite the ones of another input!");
+				return 1;
+			}
+			auto outPrefix = (Path(outDirectory) / stem).string();
+
+			auto& job = jobs.emplace_back(input, cfg);
+			job.cfg.svgPath = outPrefix + ".svg";
+			job.cfg.webpPath = outPrefix + ".out.webp";
+			job.cfg.videoPath = outPrefix + ".ogv";
+			job.cfg.checkpointPath = outPrefix + ".pa";
+		}
+
+		if (jobs.empty())
+		{
+			LogError("No input images found!");
+			return 1;
+		}
+
+		auto coreCount = Max(1u, GetLogicalCPUCount());
+		jobCount = Min(U32(jobs.size()), jobCount ? jobCount : coreCount);
+		for (auto& job : jobs)
+		{
+			job.cfg.threadCount = job.cfg.threadCount ? job.cfg.threadCount : Max(1u, coreCount / jobCount);
+		}
+
+		Log("Processing ", jobs.size(), " images with ", jobCount, " concurrent jobs.");
+
+		Atomic<U32> nextJob = 0;
+		Atomic<U32> failedJobs = 0;
+		auto startTime = GetTimeStampUS();
+
+		{
+			Array<Thread> workers;
+			for (auto w = 0u; w < jobCount; ++w)
+			{
+				workers.emplace_back
+				(
+					[&]()
+					{
+						for (auto j = nextJob.fetch_add(1); j < jobs.size(); j = nextJob.fetch_add(1))
+						{
+							auto& job = jobs[j];
+							auto decodedImage = ReadInputImage(job.inPath, false);
+							if (decodedImage.data.empty())
+							{
+								LogError("Cannot read input image \"", job.inPath, "\"!");
+								failedJobs.fetch_add(1);
+								continue;
+							}
+
+							auto jobStartTime = GetTimeStampUS();
+							{
+								Annealer<F32> annealer(&decodedImage, job.cfg);
+								while (annealer.AnnealBezier());
+								annealer.ShutDownThreadPool();
+							}
+							Log("Finished \"", job.inPath, "\" in ", UsToS(GetTimeStampUS() - jobStartTime), "s.");
+						}
+					}
+				);
+			}
+		}
+
+		auto hours = UsToS(GetTimeStampUS() - startTime) / 3600.f;
+		auto finishedJobs = U32(jobs.size()) - failedJobs.load();
+		Log("Finished ", finishedJobs, " images in ", hours * 3600.f, "s (", finishedJobs / Max(hours, 1e-6f), " images per hour).");
+
+		return failedJobs.load() ? 1 : 0;
+	}
+}
+
+
 I32 main(I32 argc, const C** argv)
 {
 	Annealer<F32>::Config cfg;
 	Str inImagePath = "in.webp";
 	B recordOptimization = false;
+	B headless = false;
+	Str manifestPath;
+	Str inDirectory;
+	Str outDirectory = "batch";
+	U32 jobCount = 0;
 
 	CLI::Parser cliParser;
 	cliParser.Add("--in", inImagePath);
 	cliParser.Add("--recordOptimization", recordOptimization);
+	cliParser.Add("--headless", headless);
+	cliParser.Add("--manifest", manifestPath);
+	cliParser.Add("--inDir", inDirectory);
+	cliParser.Add("--outDir", outDirectory);
+	cliParser.Add("--jobs", jobCount);
+	cliParser.Add("--threads", cfg.threadCount);
 	cliParser.Add("--maxStrokes", cfg.maxStrokes);
 	cliParser.Add("--maxSteps", cfg.maxSteps);
 	cliParser.Add("--maxWidth", cfg.maxWidth);
@@ -46,23 +246,26 @@ I32 main(I32 argc, const C** argv)
 	cliParser.Add("--bgLightness", cfg.bgLightness);
 	cliParser.Add("--edgeContribution", cfg.edgeContribution);
 	cliParser.Add("--nonRandomStrokeSelection", cfg.nonRandomStrokeSelection);
+	cliParser.Add("--proposalsPerStep", cfg.proposalsPerStep);
+	cliParser.Add("--tiledAnnealing", cfg.tiledAnnealing);
+	cliParser.Add("--stepsPerTile", cfg.stepsPerTile);
+	cliParser.Add("--seed", cfg.seed);
+	cliParser.Add("--checkpointEverySteps", cfg.checkpointEverySteps);
+	cliParser.Add("--checkpointEverySeconds", cfg.checkpointEverySeconds);
+	cliParser.Add("--compactFragments", cfg.compactFragments);
+	cliParser.Add("--fragmentCacheMB", cfg.fragmentCacheMB);
+	cliParser.Add("--fixedPointSurface", cfg.fixedPointSurface);
+	cliParser.Add("--pyramidLevels", cfg.pyramidLevels);
+	cliParser.Add("--residualSampling", cfg.residualSampling);
+	cliParser.Add("--localStrokeSelection", cfg.localStrokeSelection);
 	cliParser.Parse(argc, argv);
 
-	Span<const Byte> rawImageData;
-	Array<Byte> utilityBufer;
-	
-	if (FileExists(inImagePath))
+	if (headless)
 	{
-		ReadWholeFile(inImagePath, utilityBufer);
-		rawImageData = Span<const Byte>(utilityBufer);
-	}
-	else
-	{
-		LogError("File \"", inImagePath, "\" not found!");
-		rawImageData = Span<const Byte>(GEmbeddedTestImageData, CEmbeddedTestImageSize);
+		return RunHeadless(cfg, inImagePath, manifestPath, inDirectory, outDirectory, jobCount);
 	}
 
-	auto decodedImage = DecodeWebP(rawImageData);
+	auto decodedImage = ReadInputImage(inImagePath, true);
 
 	if (decodedImage.data.empty())
 	{
@@ -114,13 +317,19 @@ I32 main(I32 argc, const C** argv)
 	(
 		[&annealer, encoder, recordOptimization]()
 		{
-			auto target = PresentSurface::LockScreenTarget();
-			annealer.CopyCurrentApproximationToColor((ColorU32*)target.data, target.stride);
+			auto changed = annealer.UpdatePreview();
+			if (!changed.w || !changed.h)
+			{
+				return false;
+			}
+
+			auto preview = annealer.GetPreview();
+			PresentSurface::UpdateScreenTarget(preview, changed);
 			if (recordOptimization)
 			{
-				encoder->EncodeRGBA8Linear(target, false);
+				encoder->EncodeRGBA8Linear(preview, changed, false);
 			}
-			PresentSurface::UnlockScreenTarget();
+			return true;
 		}
 	);
 
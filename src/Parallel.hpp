@@ -0,0 +1,116 @@
+// Copyright 2024 Mihail Mladenov
+//
+// This file is part of PencilAnnealing.
+//
+// PencilAnnealing is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PencilAnnealing is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PencilAnnealing.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "Types.hpp"
+#include "Utilities.hpp"
+#include "ThreadPool.hpp"
+
+namespace PA
+{
+	// Default grain for loops over pixels.
+	inline constexpr U32 CPixelsPerChunk = 1u << 14;
+
+	// Calls func(start, end) for consecutive chunks of at most grainSize
+	// elements covering [begin, end). Chunks are handed out one at a time so
+	// threads that draw cheap chunks keep pulling more. The calling thread
+	// takes part and the call returns once every chunk is done.
+	template <typename TFunc>
+	inline auto ParallelFor(ThreadPool<>& threadPool, U32 begin, U32 end, U32 grainSize, TFunc&& func) -> V;
+
+	// Same chunking as ParallelFor with func(start, end) returning a partial
+	// result per chunk. The partials are folded with reduce in chunk order, so
+	// for a given grain size the result does not depend on the scheduling.
+	template <typename T, typename TFunc, typename TReduce>
+	inline auto ParallelReduce(ThreadPool<>& threadPool, U32 begin, U32 end, U32 grainSize, T identity, TFunc&& func, TReduce&& reduce) -> T;
+}
+
+
+namespace PA
+{
+	template<typename TFunc>
+	inline auto ParallelFor(ThreadPool<>& threadPool, U32 begin, U32 end, U32 grainSize, TFunc&& func) -> V
+	{
+		if (begin >= end)
+		{
+			return;
+		}
+
+		grainSize = grainSize ? grainSize : 1;
+		auto chunksCount = (end - begin + grainSize - 1) / grainSize;
+		Atomic<U32> nextChunk = 0;
+
+		auto task =
+		[&]()
+		{
+			for (auto chunk = nextChunk.fetch_add(1, std::memory_order_relaxed); chunk < chunksCount; chunk = nextChunk.fetch_add(1, std::memory_order_relaxed))
+			{
+				auto start = begin + chunk * grainSize;
+				func(start, end - start < grainSize ? end : start + grainSize);
+			}
+		};
+
+		auto helpersCount = Min(threadPool.GetMaxTasks(), chunksCount - 1);
+
+		Array<TaskResult<V>> results;
+		results.reserve(helpersCount);
+		for (auto i = 0u; i < helpersCount; ++i)
+		{
+			results.emplace_back(threadPool.AddTask(task));
+		}
+
+		task();
+
+		for (auto& result : results)
+		{
+			result.Retrieve();
+		}
+	}
+
+
+	template<typename T, typename TFunc, typename TReduce>
+	inline auto ParallelReduce(ThreadPool<>& threadPool, U32 begin, U32 end, U32 grainSize, T identity, TFunc&& func, TReduce&& reduce) -> T
+	{
+		if (begin >= end)
+		{
+			return identity;
+		}
+
+		grainSize = grainSize ? grainSize : 1;
+		Array<T> partials((end - begin + grainSize - 1) / grainSize, identity);
+
+		ParallelFor
+		(
+			threadPool,
+			begin,
+			end,
+			grainSize,
+			[&](U32 start, U32 chunkEnd)
+			{
+				partials[(start - begin) / grainSize] = func(start, chunkEnd);
+			}
+		);
+
+		auto result = identity;
+		for (auto& partial : partials)
+		{
+			result = reduce(result, partial);
+		}
+		return result;
+	}
+}
@@ -36,18 +36,24 @@ namespace PA
         static auto Destroy() -> V;
         static auto PresentLoop() -> V;
 
-        using RenderFunction = Function<V()>;
+        // Returns true when the screen target changed and has to be presented.
+        using RenderFunction = Function<B()>;
 
         static auto AddRenderingCode(const RenderFunction& func) -> V;
         static auto GetDimensions() -> Vec2;
 
         static auto LockScreenTarget() -> LockedTexture;
         static auto UnlockScreenTarget() -> V;
+        // Uploads the region of source to the same region of the screen target.
+        static auto UpdateScreenTarget(const LockedTexture& source, const Extent& region) -> V;
         static auto IsClosed() -> B;
 
         static auto GetDisplayRes() -> Pair<U32, U32>;
 
     private:
+        // Upper bound on how long the loop sleeps waiting for input.
+        static constexpr I32 frameTimeMS = 16;
+
         static auto PresentLoopIteration() -> V;
         static auto ProcessInput() -> V;
         static auto InitVideo() -> B;
@@ -55,7 +61,8 @@ namespace PA
         inline static SDL_Window* window = nullptr;
         inline static SDL_Renderer* renderer = nullptr;
         inline static SDL_Texture* screenTarget = nullptr;
-        inline static RenderFunction renderFunction = [](){};
+        inline static RenderFunction renderFunction = [](){ return false; };
+        inline static B isPresentNeeded = true;
 
 
         inline static U32 width = 0;
@@ -130,8 +137,9 @@ namespace PA
 
     auto PresentSurface::ProcessInput() -> V
     {
+        // Sleeps until input arrives or a frame time passes, then drains the queue.
         SDL_Event event;
-        while (SDL_PollEvent(&event))
+        for (auto hasEvent = SDL_WaitEventTimeout(&event, frameTimeMS); hasEvent; hasEvent = SDL_PollEvent(&event))
         {
 
             if (event.window.event == SDL_WINDOWEVENT_CLOSE)
@@ -139,6 +147,11 @@ namespace PA
                 isWindowClosed = true;
             }
 
+            if (event.window.event == SDL_WINDOWEVENT_EXPOSED)
+            {
+                isPresentNeeded = true;
+            }
+
             if (event.window.event == SDL_WINDOWEVENT_RESIZED)
             {
                 //width = event.window.data1;
@@ -156,9 +169,12 @@ namespace PA
     auto PresentSurface::PresentLoopIteration() -> V
     {
         ProcessInput();
-        renderFunction();
-        SDL_RenderCopy(renderer, screenTarget, nullptr, nullptr);
-        SDL_RenderPresent(renderer);
+        if (renderFunction() || isPresentNeeded)
+        {
+            SDL_RenderCopy(renderer, screenTarget, nullptr, nullptr);
+            SDL_RenderPresent(renderer);
+            isPresentNeeded = false;
+        }
     }
 
 
@@ -219,6 +235,17 @@ namespace PA
     }
 
 
+    inline auto PresentSurface::UpdateScreenTarget(const LockedTexture& source, const Extent& region) -> V
+    {
+        SDL_Rect rect = { I32(region.x), I32(region.y), I32(region.w), I32(region.h) };
+        auto pixels = source.data + region.y * source.stride + region.x * sizeof(ColorU32);
+        if (SDL_UpdateTexture(screenTarget, &rect, pixels, source.stride))
+        {
+            LogError(SDL_GetError());
+        }
+    }
+
+
     inline auto PresentSurface::IsClosed() -> B
     {
         return isWindowClosed;
@@ -0,0 +1,99 @@
+// Copyright 2024 Mihail Mladenov
+//
+// This file is part of PencilAnnealing.
+//
+// PencilAnnealing is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PencilAnnealing is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PencilAnnealing.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "Types.hpp"
+#include "Image.hpp"
+#include "Error.hpp"
+#include "Utilities.hpp"
+
+
+namespace PA
+{
+	// Averages every 2x2 block of a lebesgue ordered A8 image into a pixel
+	// of an image with half the sides, odd sides rounded up. The four pixels
+	// of a block are consecutive in lebesgue order, so pixel i of the result
+	// is the mean of pixels 4i to 4i + 3. Pixels outside img are left out of
+	// the mean of the last row and column.
+	inline auto ReduceA8(const RawCPUImage& img) -> RawCPUImage;
+}
+
+
+namespace PA
+{
+	inline auto ReduceA8(const RawCPUImage& img) -> RawCPUImage
+	{
+		PA_ASSERT(img.lebesgueOrdered && img.format == EFormat::A8);
+
+		RawCPUImage result((img.width + 1) / 2, (img.height + 1) / 2, EFormat::A8, true);
+		auto in = img.data.data();
+		auto out = result.data.data();
+		// Images below a block per side keep their stride when reduced.
+		auto inputEnd = U32(img.data.size() / 4);
+
+		ForEachLebesgueRange
+		(
+			result.width,
+			result.height,
+			[&](U32 begin, U32 end)
+			{
+				for (auto i = begin; i < Min(end, inputEnd); ++i)
+				{
+					out[i] = Byte((in[4 * i] + in[4 * i + 1] + in[4 * i + 2] + in[4 * i + 3] + 2) / 4);
+				}
+			}
+		);
+
+		auto mean =
+		[&](U32 x, U32 y)
+		{
+			U32 sum = 0;
+			U32 count = 0;
+			for (auto dy = 0u; dy < 2; ++dy)
+			{
+				for (auto dx = 0u; dx < 2; ++dx)
+				{
+					if (2 * x + dx < img.width && 2 * y + dy < img.height)
+					{
+						sum += in[LebesgueCurve(2 * x + dx, 2 * y + dy)];
+						count++;
+					}
+				}
+			}
+			out[LebesgueCurve(x, y)] = Byte((sum + count / 2) / count);
+		};
+
+		if (img.width % 2)
+		{
+			for (auto y = 0u; y < result.height; ++y)
+			{
+				mean(result.width - 1, y);
+			}
+		}
+		if (img.height % 2)
+		{
+			for (auto x = 0u; x < result.width; ++x)
+			{
+				mean(x, result.height - 1);
+			}
+		}
+
+		return result;
+	}
+
+}
@@ -20,43 +20,65 @@
 
 #include "Algebra.hpp"
 #include "BBox.hpp"
-#include "Algebra.hpp"
 #include "Random.hpp"
 #include "Algorithm.hpp"
+#include "Error.hpp"
 
 namespace PA
 {
+	// Recursive partition of the bounds of a set of primitives into
+	// quadrants. Nodes live in a single array with the four children of a
+	// node next to each other. Every leaf owns a slab of a shared buffer with
+	// copies of the primitives overlapping it, so the primitives around a
+	// point are contiguous. Primitives added later go to the slabs of the
+	// leaves they overlap, a full slab moves to the end of the buffer with
+	// twice the room and its old place is only reclaimed by Build.
 	template <typename TPrimitive>
 	struct QuadTree
 	{
 		using Scalar = typename TPrimitive::Scalar;
 		using BBox = typename TPrimitive::BBox;
 		using Vec = typename TPrimitive::Vec;
-		
-		struct Node
-		{
-			Array<TPrimitive> primitives;
-			B isLeaf = false;
-			StaticArray<Node*, 4> descendants = {};
-		};
 
 		static constexpr U32 dimension = TPrimitive::dimension;
+		// Bounds the traversal stacks, nodes this deep are not split further.
+		static constexpr U32 maxDepth = 20;
 
-		auto Build(const Array<TPrimitive>& primitives) -> V;
+		auto Build(Span<const TPrimitive> source) -> V;
+		// Both only reach the leaves within the bounds given to Build.
 		auto Remove(const TPrimitive& prim) -> V;
 		auto Add(const TPrimitive& prim) -> V;
+		// Primitives of the leaf containing p, empty outside the bounds.
 		auto GetPrimitivesAround(const Vec& p) const -> Span<const TPrimitive>;
-		auto GetRandomPrimitive() -> TPrimitive;
-		auto Bounds(const TPrimitive& prim) -> B;
-		auto GetSerializedPrimitives() -> Array<TPrimitive>;
+		// The tree must not be empty.
+		auto GetRandomPrimitive(RandomEngine& engine = GMerseneTwister) const -> TPrimitive;
+		auto Bounds(const TPrimitive& prim) const -> B;
+		// Primitives of all leaves, the ones overlapping several leaves repeat.
+		auto GetSerializedPrimitives() const -> Array<TPrimitive>;
 
 	private:
-		auto BuildRecursive(const Array<TPrimitive>& primitives, const BBox& bBox) -> Node*;
+		struct Node
+		{
+			// Inner nodes have their children at nodes[first, first + 4),
+			// leaves own primitives[first, first + count) with room for
+			// capacity of them.
+			U32 first = 0;
+			U32 count = 0;
+			U32 capacity = 0;
+			B isLeaf = true;
+		};
+
+		auto BuildRecursive(U32 nodeIdx, Span<const TPrimitive> source, Span<const U32> indices, const BBox& bBox, U32 depth) -> V;
+		// Calls func with every leaf overlapping region.
+		template <typename TFunc>
+		auto ForEachLeaf(const BBox& region, TFunc func) -> V;
 		auto GetDescendantBBoxes(const BBox& bBox) const -> StaticArray<BBox, 4>;
 
-		Node* root = nullptr;
+		// An empty tree is a single leaf over the unit square.
+		Array<Node> nodes = Array<Node>(1);
+		Array<TPrimitive> primitives;
+		Array<U32> leaves = { 0 };
 		BBox globalBBox = BBox(Vec(0), Vec(1));
-		Array<Node*> leaves;
 	};
 
 }
@@ -65,30 +87,33 @@ namespace PA
 namespace PA
 {
 	template<typename TPrimitive>
-	inline auto QuadTree<TPrimitive>::Build(const Array<TPrimitive>& primitives) -> V
+	inline auto QuadTree<TPrimitive>::Build(Span<const TPrimitive> source) -> V
 	{
-		globalBBox = BBox(Span<const TPrimitive>(primitives.begin(), primitives.end()));
-		root = BuildRecursive(primitives, globalBBox);
+		globalBBox = BBox(source);
+		nodes.assign(1, Node());
+		primitives.clear();
+		leaves.clear();
+
+		auto indices = GenerateSequence(0u, U32(source.size()));
+		BuildRecursive(0, source, indices, globalBBox, 0);
 	}
 
 
 	template<typename TPrimitive>
-	inline auto QuadTree<TPrimitive>::Bounds(const TPrimitive& prim) -> B
+	inline auto QuadTree<TPrimitive>::Bounds(const TPrimitive& prim) const -> B
 	{
 		return globalBBox.Contains(prim);
 	}
 
 
 	template<typename TPrimitive>
-	inline auto QuadTree<TPrimitive>::GetSerializedPrimitives() -> Array<TPrimitive>
+	inline auto QuadTree<TPrimitive>::GetSerializedPrimitives() const -> Array<TPrimitive>
 	{
 		Array<TPrimitive> result;
-		for (auto leafPtr : leaves)
+		for (auto leafIdx : leaves)
 		{
-			if (!leafPtr->primitives.empty())
-			{
-				result.insert(result.end(), leafPtr->primitives.begin(), leafPtr->primitives.end());
-			}
+			auto& leaf = nodes[leafIdx];
+			result.insert(result.end(), primitives.begin() + leaf.first, primitives.begin() + leaf.first + leaf.count);
 		}
 		return result;
 	}
@@ -97,192 +122,199 @@ namespace PA
 	template<typename TPrimitive>
 	inline auto QuadTree<TPrimitive>::Remove(const TPrimitive& prim) -> V
 	{
-		Array<Pair<Node*, BBox>> toVisit;
-		toVisit.emplace_back(root, globalBBox);
-
-		while (!toVisit.empty())
-		{
-			auto currentLevel = toVisit.back();
-			toVisit.pop_back();
-
-			if (currentLevel.first->isLeaf)
-			{
-				auto found = Find(currentLevel.first->primitives.begin(), currentLevel.first->primitives.end(), prim);
-				if (found != currentLevel.first->primitives.end())
-				{
-					currentLevel.first->primitives.erase(found);
-				}
-			}
-			else
+		ForEachLeaf
+		(
+			prim.GetBBox(),
+			[&](Node& leaf)
 			{
-				auto descendantBBoxes = GetDescendantBBoxes(currentLevel.second);
-				for (auto i = 0; i < 4; ++i)
+				auto begin = primitives.begin() + leaf.first;
+				auto found = Find(begin, begin + leaf.count, prim);
+				if (found != begin + leaf.count)
 				{
-					if (currentLevel.first->descendants[i] && prim.Intersects(descendantBBoxes[i]))
-					{
-						toVisit.emplace_back(currentLevel.first->descendants[i], descendantBBoxes[i]);
-					}
+					*found = primitives[leaf.first + leaf.count - 1];
+					leaf.count--;
 				}
 			}
-		}
+		);
 	}
 
 
 	template<typename TPrimitive>
 	inline auto QuadTree<TPrimitive>::Add(const TPrimitive& prim) -> V
 	{
-		Array<Pair<Node*, BBox>> toVisit;
-		toVisit.emplace_back(root, globalBBox);
-
-		while (!toVisit.empty())
-		{
-			auto currentLevel = toVisit.back();
-			toVisit.pop_back();
-
-			if (currentLevel.first->isLeaf)
-			{
-				currentLevel.first->primitives.push_back(prim);
-			}
-			else
+		ForEachLeaf
+		(
+			prim.GetBBox(),
+			[&](Node& leaf)
 			{
-				auto descendantBBoxes = GetDescendantBBoxes(currentLevel.second);
-				for (auto i = 0; i < 4; ++i)
+				if (leaf.count == leaf.capacity)
 				{
-					if (prim.Intersects(descendantBBoxes[i]))
+					auto first = U32(primitives.size());
+					auto capacity = Max(2 * leaf.capacity, 4u);
+					primitives.resize(first + capacity);
+					for (auto i = 0u; i < leaf.count; ++i)
 					{
-						if (!currentLevel.first->descendants[i])
-						{
-							auto newNode = new Node;
-							newNode->isLeaf = true;
-							leaves.push_back(newNode);
-							currentLevel.first->descendants[i] = newNode;
-						}
-						toVisit.emplace_back(currentLevel.first->descendants[i], descendantBBoxes[i]);
+						primitives[first + i] = primitives[leaf.first + i];
 					}
+					leaf.first = first;
+					leaf.capacity = capacity;
 				}
+				primitives[leaf.first + leaf.count] = prim;
+				leaf.count++;
 			}
-		}
+		);
 	}
 
 
 	template<typename TPrimitive>
 	inline auto QuadTree<TPrimitive>::GetPrimitivesAround(const Vec& p) const -> Span<const TPrimitive>
 	{
-		Span<const TPrimitive> result;
-
-		Array<Pair<Node*, BBox>> toVisit;
-		toVisit.emplace_back(root, globalBBox);
-
-		while (!toVisit.empty())
+		if (!globalBBox.Contains(p))
 		{
-			auto currentLevel = toVisit.back();
-			toVisit.pop_back();
+			return {};
+		}
 
-			if (currentLevel.first->isLeaf)
-			{
-				if (currentLevel.second.Contains(p))
-				{
-					result = currentLevel.first->primitives;
-					return result;
-				}
-			}
-			else
-			{
-				auto descendantBBoxes = GetDescendantBBoxes(currentLevel.second);
-				for (auto i = 0; i < 4; ++i)
-				{
-					if (currentLevel.first->descendants[i] && descendantBBoxes[i].Contains(p))
-					{
-						toVisit.emplace_back(currentLevel.first->descendants[i], descendantBBoxes[i]);
-						break;
-					}
-				}
-			}
+		// A single path leads down to the leaf. Points on the border between
+		// quadrants go to the upper and then to the left one.
+		auto bBox = globalBBox;
+		auto nodeIdx = 0u;
+		while (!nodes[nodeIdx].isLeaf)
+		{
+			auto center = (bBox.lower + bBox.upper) / Scalar(2);
+			auto upper = p[1] >= center[1];
+			auto right = p[0] > center[0];
+			auto quadrant = upper ? (right ? 1u : 0u) : (right ? 3u : 2u);
+			bBox = GetDescendantBBoxes(bBox)[quadrant];
+			nodeIdx = nodes[nodeIdx].first + quadrant;
 		}
 
-		return result;
+		auto& leaf = nodes[nodeIdx];
+		return Span<const TPrimitive>(primitives.data() + leaf.first, leaf.count);
 	}
 
 
 	template<typename TPrimitive>
-	inline auto QuadTree<TPrimitive>::GetRandomPrimitive() -> TPrimitive
+	inline auto QuadTree<TPrimitive>::GetRandomPrimitive(RandomEngine& engine) const -> TPrimitive
 	{
-		auto currentNode = root;
-		B found = false;
-		TPrimitive result;
-
-		while (!found)
+		while (true)
 		{
-			auto randomIdx = GetUniformU32(0, leaves.size() - 1);
-			auto leaf = leaves[randomIdx];
-			if (!leaf->primitives.empty())
+			auto& leaf = nodes[leaves[GetUniformU32(0, U32(leaves.size()) - 1, engine)]];
+			if (leaf.count)
 			{
-				auto idx = GetUniformU32(0, leaf->primitives.size() - 1);
-				found = true;
-				result = leaf->primitives[idx];
+				return primitives[leaf.first + GetUniformU32(0, leaf.count - 1, engine)];
 			}
 		}
-
-		return result;
 	}
 
 
 	template<typename TPrimitive>
-	inline auto QuadTree<TPrimitive>::BuildRecursive(const Array<TPrimitive>& primitives, const BBox& bBox) -> Node*
+	inline auto QuadTree<TPrimitive>::BuildRecursive(U32 nodeIdx, Span<const TPrimitive> source, Span<const U32> indices, const BBox& bBox, U32 depth) -> V
 	{
-		auto newNode = new Node;
+		auto makeLeaf =
+		[&]()
+		{
+			auto& node = nodes[nodeIdx];
+			node.isLeaf = true;
+			node.first = U32(primitives.size());
+			node.count = U32(indices.size());
+			node.capacity = node.count;
+			for (auto idx : indices)
+			{
+				primitives.push_back(source[idx]);
+			}
+			leaves.push_back(nodeIdx);
+		};
 
-		if (primitives.empty())
+		if (indices.empty() || depth == maxDepth)
 		{
-			newNode->isLeaf = true;
-			leaves.push_back(newNode);
-			return newNode;
+			makeLeaf();
+			return;
 		}
 
 		auto descendantBBoxes = GetDescendantBBoxes(bBox);
 
-		StaticArray<Array<TPrimitive>, 4> splits;
-		
-		for (auto& primitive : primitives)
+		StaticArray<Array<U32>, 4> splits;
+
+		for (auto idx : indices)
 		{
+			auto primitiveBBox = source[idx].GetBBox();
 			for (auto quadrant = 0u; quadrant < 4; ++quadrant)
 			{
-				if (primitive.GetBBox().Intersects(descendantBBoxes[quadrant]))
+				if (primitiveBBox.Intersects(descendantBBoxes[quadrant]))
 				{
-					splits[quadrant].push_back(primitive);
+					splits[quadrant].push_back(idx);
 				}
 			}
 		}
 
 
-		if (splits[0].size() + splits[1].size() + splits[2].size() + splits[3].size() >= 2 * primitives.size())
+		if (splits[0].size() + splits[1].size() + splits[2].size() + splits[3].size() >= 2 * indices.size())
 		{
 			// Partitions start to become worse.
-			newNode->isLeaf = true;
-			newNode->primitives.insert(newNode->primitives.end(), primitives.begin(), primitives.end());
-			leaves.push_back(newNode);
-			return newNode;
+			makeLeaf();
+			return;
+		}
+
+		auto first = U32(nodes.size());
+		nodes.resize(first + 4);
+		nodes[nodeIdx].isLeaf = false;
+		nodes[nodeIdx].first = first;
+
+		for (auto q = 0u; q < 4; ++q)
+		{
+			BuildRecursive(first + q, source, splits[q], descendantBBoxes[q], depth + 1);
 		}
+	}
 
 
-		for (auto q = 0; q < 4; ++q)
+	template<typename TPrimitive>
+	template<typename TFunc>
+	inline auto QuadTree<TPrimitive>::ForEachLeaf(const BBox& region, TFunc func) -> V
+	{
+		// Every level replaces a node with at most four, so the stack never
+		// holds more than three nodes per level.
+		StaticArray<Pair<U32, BBox>, 3 * maxDepth + 1> toVisit;
+		U32 toVisitCount = 0;
+
+		if (region.Intersects(globalBBox))
 		{
-			newNode->descendants[q] = BuildRecursive(splits[q], descendantBBoxes[q]);
+			toVisit[toVisitCount++] = { 0u, globalBBox };
 		}
 
-		return newNode;
+		while (toVisitCount)
+		{
+			auto [nodeIdx, bBox] = toVisit[--toVisitCount];
+			auto& node = nodes[nodeIdx];
+
+			if (node.isLeaf)
+			{
+				func(node);
+				continue;
+			}
+
+			auto descendantBBoxes = GetDescendantBBoxes(bBox);
+			for (auto q = 0u; q < 4; ++q)
+			{
+				if (region.Intersects(descendantBBoxes[q]))
+				{
+					PA_ASSERT(toVisitCount < toVisit.size());
+					toVisit[toVisitCount++] = { node.first + q, descendantBBoxes[q] };
+				}
+			}
+		}
 	}
 
 
 	template<typename TPrimitive>
 	inline auto QuadTree<TPrimitive>::GetDescendantBBoxes(const BBox& bBox) const -> StaticArray<BBox, 4>
 	{
+		auto center = (bBox.lower + bBox.upper) / Scalar(2);
 		StaticArray<BBox, 4> descendantBBoxes =
 		{
-			BBox(Vec2(bBox.lower[0], (bBox.lower[1] + bBox.upper[1]) / Scalar(2)), Vec2((bBox.lower[0] + bBox.upper[0]) / Scalar(2), bBox.upper[1])),
-			BBox((bBox.lower + bBox.upper) / Scalar(2), bBox.upper),
-			BBox(bBox.lower, (bBox.lower + bBox.upper) / Scalar(2)),
-			BBox(Vec2((bBox.lower[0] + bBox.upper[0]) / Scalar(2), bBox.lower[1]), Vec2(bBox.upper[0], (bBox.lower[1] + bBox.upper[1]) / Scalar(2)))
+			BBox(Vec(bBox.lower[0], center[1]), Vec(center[0], bBox.upper[1])),
+			BBox(center, bBox.upper),
+			BBox(bBox.lower, center),
+			BBox(Vec(center[0], bBox.lower[1]), Vec(bBox.upper[0], center[1]))
 		};
 
 		return descendantBBoxes;
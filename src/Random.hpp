@@ -18,51 +18,55 @@
 
 #pragma once
 
+#include "Types.hpp"
+
 #include <random>
 
 namespace PA
 {
+	using RandomEngine = std::mt19937;
+
 	inline static std::random_device GRandomSeed;
-	inline static std::mt19937 GMerseneTwister(GRandomSeed());
+	inline static RandomEngine GMerseneTwister(GRandomSeed());
 
 	template <typename TF>
-	auto GetUniformFloat(TF range0 = TF(0), TF range1 = TF(1)) -> TF;
+	auto GetUniformFloat(TF range0 = TF(0), TF range1 = TF(1), RandomEngine& engine = GMerseneTwister) -> TF;
 
 	template <typename TF>
-	inline auto GetExponentialFloat(TF lambda = TF(1)) -> TF;
+	inline auto GetExponentialFloat(TF lambda = TF(1), RandomEngine& engine = GMerseneTwister) -> TF;
 
-	inline auto GetUniformU32(U32 range0, U32 range1) -> U32;
-	inline auto GetUniformBernoulli() -> B;
+	inline auto GetUniformU32(U32 range0, U32 range1, RandomEngine& engine = GMerseneTwister) -> U32;
+	inline auto GetUniformBernoulli(RandomEngine& engine = GMerseneTwister) -> B;
 }
 
 
 namespace PA
 {
 	template<typename TF>
-	auto GetUniformFloat(TF range0, TF range1) -> TF
+	auto GetUniformFloat(TF range0, TF range1, RandomEngine& engine) -> TF
 	{
 		std::uniform_real_distribution<TF> dist(range0, range1);
-		return dist(GMerseneTwister);
+		return dist(engine);
 	}
 
 	template<typename TF>
-	auto GetExponentialFloat(TF lambda) -> TF
+	auto GetExponentialFloat(TF lambda, RandomEngine& engine) -> TF
 	{
 		std::exponential_distribution<TF> dist(lambda);
 
-		return dist(GMerseneTwister);
+		return dist(engine);
 	}
 
-	inline auto GetUniformU32(U32 range0, U32 range1) -> U32
+	inline auto GetUniformU32(U32 range0, U32 range1, RandomEngine& engine) -> U32
 	{
 		std::uniform_int_distribution<U32> dist(range0, range1);
-		return dist(GMerseneTwister);
+		return dist(engine);
 	}
 
-	inline auto GetUniformBernoulli() -> B
+	inline auto GetUniformBernoulli(RandomEngine& engine) -> B
 	{
 		std::bernoulli_distribution dist(0.5);
 
-		return dist(GMerseneTwister);
+		return dist(engine);
 	}
 }
\ No newline at end of file
@@ -23,11 +23,17 @@
 #include "QuadTree.hpp"
 #include "Image.hpp"
 #include "ThreadPool.hpp"
+#include "Parallel.hpp"
+#include "Algorithm.hpp"
+#include "SIMD.hpp"
 
 namespace PA
 {
+	// Curve lengths vary a lot, small chunks keep the threads evenly loaded.
+	inline constexpr U32 CCurvesPerChunk = 16;
+
 	template <typename TPrimitive>
-	inline auto DrawToGSSurface(QuadTree<TPrimitive>& primitives, RawCPUImage& img, ThreadPool<>& threadPool) -> V;
+	inline auto DrawToGSSurface(const QuadTree<TPrimitive>& primitives, RawCPUImage& img, ThreadPool<>& threadPool) -> V;
 
 	template <typename TF>
 	inline auto RasterizeToGSSurface(const QuadraticBezier<TF, 2>& curve, RawCPUImage& img) -> V;
@@ -43,7 +49,27 @@ namespace PA
 		Fragment(U32 i, F32 v) : idx(i), value(v) {}
 	};
 
+	// Sampled approximates the distance to every small curve segment by three
+	// samples. Analytic flattens the curve once and computes the exact distance
+	// to the resulting polyline for whole rows of pixels at a time.
+	enum class ERasterizer
+	{
+		Sampled,
+		Analytic
+	};
+
+	template <typename TF>
+	inline auto RasterizeToFragmentsSampled(const QuadraticBezier<TF, 2>& curve, Array<Fragment>& fragments, U32 width, U32 height, TF color, TF curveWidth) -> V;
 	template <typename TF>
+	inline auto RasterizeToFragmentsAnalytic(const QuadraticBezier<TF, 2>& curve, Array<Fragment>& fragments, U32 width, U32 height, TF color, TF curveWidth) -> V;
+	inline auto MergeFragments(Array<Fragment>& fragments) -> V;
+
+	// Walks two idx sorted fragment lists as one, calling func(idx, value0, value1)
+	// once per covered pixel. A list that does not cover the pixel contributes 0.
+	template <typename TFunc>
+	inline auto ForEachMergedFragment(Span<const Fragment> f0, Span<const Fragment> f1, TFunc&& func) -> V;
+
+	template <ERasterizer TRasterizer = ERasterizer::Analytic, typename TF>
 	inline auto RasterizeToFragments
 	(
 		const QuadraticBezier<TF, 2>& curve,
@@ -54,7 +80,7 @@ namespace PA
 		TF curveWidth = TF(1)
 	) -> V;
 
-	template<typename TF>
+	template<ERasterizer TRasterizer = ERasterizer::Analytic, typename TF>
 	inline auto RasterizeToFragments
 	(
 		Span<const QuadraticBezier<TF, 2>> curves,
@@ -66,27 +92,28 @@ namespace PA
 		ThreadPool<>& threadPool
 	) -> V;
 
-	inline auto AddFragmentsOnHDRSurface(Array<Fragment>& fragments, RawCPUImage& surface) -> V;
-	inline auto SubtractFragmentsFromHDRSurface(Array<Fragment>& fragments, RawCPUImage& surface) -> V;
+	inline auto AddFragmentsOnHDRSurface(Span<const Fragment> fragments, RawCPUImage& surface) -> V;
+	inline auto SubtractFragmentsFromHDRSurface(Span<const Fragment> fragments, RawCPUImage& surface) -> V;
 	inline auto AddFragmentsOnHDRSurface(Array<Array<Fragment>>& fragMap, RawCPUImage& surface) -> V;
 	inline auto SubtractFragmentsFromHDRSurface(Array<Array<Fragment>>& fragMap, RawCPUImage& surface) -> V;
 
+	// Only converts the lebesgue tiles that cover the image.
 	inline auto CopyHDRSurfaceToGSSurface(RawCPUImage& hdr, RawCPUImage& sdr) -> V;
+	// Fragments have to be sorted, runs of consecutive indices are converted
+	// as a whole.
 	inline auto CopyHDRSurfaceToGSSurface(RawCPUImage& hdr, RawCPUImage& sdr, Span<const Fragment> fragments) -> V;
+	inline auto CopyHDRRangeToGSSurface(const RawCPUImage& hdr, RawCPUImage& sdr, U32 begin, U32 end) -> V;
 }
 
 namespace PA
 {
 	template<typename TPrimitive>
-	inline auto DrawToGSSurface(QuadTree<TPrimitive>& primitives, RawCPUImage& img, ThreadPool<>& threadPool) -> V
+	inline auto DrawToGSSurface(const QuadTree<TPrimitive>& primitives, RawCPUImage& img, ThreadPool<>& threadPool) -> V
 	{
 		using Scalar = TPrimitive::Scalar;
 		using Vec = typename TPrimitive::Vec;
 		auto imgSize = img.width * img.height;
 
-		auto taskCount = GetLogicalCPUCount();
-		auto pixelsPerTask = imgSize / taskCount;
-
 		auto task =
 		[&](U32 start, U32 end)
 		{
@@ -114,19 +141,7 @@ namespace PA
 			}
 		};
 
-		Array<TaskResult<V>> results;
-		for (auto i = 0u; i < taskCount; ++i)
-		{
-			results.emplace_back(threadPool.AddTask(task, i * pixelsPerTask, (i + 1) * pixelsPerTask));
-		}
-
-		// Remainder
-		task(taskCount * pixelsPerTask, imgSize);
-
-		for (auto& result : results)
-		{
-			result.Retrieve();
-		}
+		ParallelFor(threadPool, 0, imgSize, CPixelsPerChunk, task);
 	}
 
 	template<typename TF>
@@ -173,8 +188,6 @@ namespace PA
 	template<typename TF>
 	inline auto RasterizeToGSSurfaceUnsafe(Span<const QuadraticBezier<TF, 2>> curves, RawCPUImage& img, ThreadPool<>& threadPool) -> V
 	{
-		auto taskCount = GetLogicalCPUCount();
-		auto curvesPerTask = curves.size() / taskCount;
 
 		auto task =
 			[&](U32 start, U32 end)
@@ -185,29 +198,16 @@ namespace PA
 				}
 			};
 
-		Array<TaskResult<V>> results;
-		for (auto i = 0u; i < taskCount; ++i)
-		{
-			results.emplace_back(threadPool.AddTask(task, i * curvesPerTask, (i + 1) * curvesPerTask));
-		}
-
-		// Remainder
-		task(taskCount * curvesPerTask, curves.size());
-
-		for (auto& result : results)
-		{
-			result.Retrieve();
-		}
+		ParallelFor(threadPool, 0, U32(curves.size()), CCurvesPerChunk, task);
 	}
 
 
 	template<typename TF>
-	auto RasterizeToFragments(const QuadraticBezier<TF, 2>& curve, Array<Fragment>& fragments, U32 width, U32 height, TF color, TF curveWidth) -> V
+	auto RasterizeToFragmentsSampled(const QuadraticBezier<TF, 2>& curve, Array<Fragment>& fragments, U32 width, U32 height, TF color, TF curveWidth) -> V
 	{
 		const auto halfCurveWidth = curveWidth / TF(2);
 		TF splitCutoff = 4;
 		static constexpr TF valThreshold = TF(0.0001);
-		fragments.clear();
 		auto screenCurve = curve;
 		ToSurfaceCoordinates(Span<Vector<TF, 2>>(screenCurve.points), width, height);
 
@@ -215,8 +215,6 @@ namespace PA
 		auto stackSize = 0u;
 		stack[stackSize++] = screenCurve;
 
-		Map<U32, F32> rasterizedFragments;
-
 		while (stackSize)
 		{
 			stackSize--;
@@ -250,15 +248,7 @@ namespace PA
 						auto val = color * Max(TF(0), TF(1) - SmoothStep(TF(0), TF(0.75), dist));
 						if (val > valThreshold)
 						{
-							auto oldVal = rasterizedFragments.find(idx);
-							if (oldVal != rasterizedFragments.end())
-							{
-								oldVal->second = Max(oldVal->second, val);
-							}
-							else
-							{
-								rasterizedFragments[idx] = val;
-							}
+							fragments.emplace_back(idx, F32(val));
 						}
 					}
 				}
@@ -270,16 +260,195 @@ namespace PA
 				stack[stackSize++] = split.first;
 			}
 		}
+	}
+
+
+	template<typename TF>
+	auto RasterizeToFragmentsAnalytic(const QuadraticBezier<TF, 2>& curve, Array<Fragment>& fragments, U32 width, U32 height, TF color, TF curveWidth) -> V
+	{
+		const auto halfCurveWidth = F32(curveWidth / TF(2));
+		const auto reach = halfCurveWidth + 0.75f;
+		const auto pigment = F32(color);
+		static constexpr TF flatnessTolerance = TF(1) / TF(16);
+		static constexpr TF splitCutoff = 8;
+		static constexpr F32 valThreshold = 0.0001f;
+		static constexpr U32 lanes = F32xN::width;
+
+		auto screenCurve = curve;
+		ToSurfaceCoordinates(Span<Vector<TF, 2>>(screenCurve.points), width, height);
+
+		StaticArray<QuadraticBezier<TF, 2>, 64> stack;
+		auto stackSize = 0u;
+		stack[stackSize++] = screenCurve;
+
+		StaticArray<F32, lanes> rowValues;
 
-		fragments.reserve(rasterizedFragments.size());
-		for (auto& frag : rasterizedFragments)
+		while (stackSize)
 		{
-			fragments.emplace_back(frag.first, frag.second);
+			stackSize--;
+			auto current = stack[stackSize];
+
+			// A quadratic deviates from its chord by at most a quarter of its
+			// second difference, so once that is below the tolerance the chord
+			// stands in for the curve exactly enough.
+			auto deviation = (current.p0 - TF(2) * current.p1 + current.p2).Length() / TF(4);
+			auto chordLength = (current.p2 - current.p0).Length();
+			auto isLeaf = (deviation <= flatnessTolerance && chordLength <= splitCutoff) || stackSize + 2 > stack.size();
+
+			if (!isLeaf)
+			{
+				auto split = current.Split(TF(0.5));
+				stack[stackSize++] = split.second;
+				stack[stackSize++] = split.first;
+				continue;
+			}
+
+			auto ax = F32(current.p0[0]);
+			auto ay = F32(current.p0[1]);
+			auto bx = F32(current.p2[0]);
+			auto by = F32(current.p2[1]);
+			auto dx = bx - ax;
+			auto dy = by - ay;
+			auto squaredLength = dx * dx + dy * dy;
+			auto invSquaredLength = squaredLength > 0.f ? 1.f / squaredLength : 0.f;
+
+			auto xLower = Floor(Min(ax, bx) - reach);
+			auto xUpper = Ceil(Max(ax, bx) + reach);
+			auto yLower = Floor(Min(ay, by) - reach);
+			auto yUpper = Ceil(Max(ay, by) + reach);
+			if (xUpper < 0.f || yUpper < 0.f || xLower > F32(width - 1) || yLower > F32(height - 1))
+			{
+				continue;
+			}
+
+			auto xMin = U32(Max(0.f, xLower));
+			auto xMax = Min(U32(xUpper), width - 1);
+			auto yMin = U32(Max(0.f, yLower));
+			auto yMax = Min(U32(yUpper), height - 1);
+
+			auto segmentX = F32xN::Broadcast(dx);
+			auto segmentY = F32xN::Broadcast(dy);
+			auto invLength = F32xN::Broadcast(invSquaredLength);
+			auto halfWidth = F32xN::Broadcast(halfCurveWidth);
+			auto zero = F32xN::Broadcast(0.f);
+			auto one = F32xN::Broadcast(1.f);
+			auto two = F32xN::Broadcast(2.f);
+			auto three = F32xN::Broadcast(3.f);
+			auto falloff = F32xN::Broadcast(0.75f);
+			auto pigmentN = F32xN::Broadcast(pigment);
+
+			for (auto i = yMin; i <= yMax; ++i)
+			{
+				auto py = F32xN::Broadcast(F32(i) + 0.5f - ay);
+
+				// Every pixel goes through the vector path, including the ones
+				// past the end of the row, so the coverage of a pixel does not
+				// depend on which lane it lands in.
+				for (auto j = xMin; j <= xMax; j += lanes)
+				{
+					auto px = (F32xN::Broadcast(F32(j) + 0.5f) + F32xN::LaneOffsets()) - F32xN::Broadcast(ax);
+					auto t = Min(Max((px * segmentX + py * segmentY) * invLength, zero), one);
+					auto ex = px - t * segmentX;
+					auto ey = py - t * segmentY;
+					auto dist = Sqrt(ex * ex + ey * ey) - halfWidth;
+					auto x = Min(Max(dist / falloff, zero), one);
+					auto val = pigmentN * (one - x * x * (three - two * x));
+					val.Store(rowValues.data());
+
+					auto count = Min(lanes, xMax - j + 1);
+					for (auto l = 0u; l < count; ++l)
+					{
+						if (rowValues[l] > valThreshold)
+						{
+							fragments.emplace_back(LebesgueCurve(j + l, i), rowValues[l]);
+						}
+					}
+				}
+			}
 		}
 	}
 
 
-	template<typename TF>
+	inline auto MergeFragments(Array<Fragment>& fragments) -> V
+	{
+		// Neighbouring segments cover some pixels more than once. Sorting in
+		// Morton order puts the duplicates next to each other so they can be
+		// merged in place, keeping the strongest coverage. The output is
+		// sorted by idx, which the fragment consumers rely on.
+		Sort(fragments, [](const Fragment& f0, const Fragment& f1) { return f0.idx < f1.idx; });
+
+		auto last = 0u;
+		for (auto i = 1u; i < fragments.size(); ++i)
+		{
+			if (fragments[i].idx == fragments[last].idx)
+			{
+				fragments[last].value = Max(fragments[last].value, fragments[i].value);
+			}
+			else
+			{
+				fragments[++last] = fragments[i];
+			}
+		}
+		fragments.resize(fragments.empty() ? 0 : last + 1);
+	}
+
+
+	template<typename TFunc>
+	inline auto ForEachMergedFragment(Span<const Fragment> f0, Span<const Fragment> f1, TFunc&& func) -> V
+	{
+		auto i = 0u;
+		auto j = 0u;
+		while (i < f0.size() && j < f1.size())
+		{
+			if (f0[i].idx < f1[j].idx)
+			{
+				func(f0[i].idx, f0[i].value, 0.f);
+				i++;
+			}
+			else if (f1[j].idx < f0[i].idx)
+			{
+				func(f1[j].idx, 0.f, f1[j].value);
+				j++;
+			}
+			else
+			{
+				func(f0[i].idx, f0[i].value, f1[j].value);
+				i++;
+				j++;
+			}
+		}
+
+		for (; i < f0.size(); ++i)
+		{
+			func(f0[i].idx, f0[i].value, 0.f);
+		}
+
+		for (; j < f1.size(); ++j)
+		{
+			func(f1[j].idx, 0.f, f1[j].value);
+		}
+	}
+
+
+	template<ERasterizer TRasterizer, typename TF>
+	auto RasterizeToFragments(const QuadraticBezier<TF, 2>& curve, Array<Fragment>& fragments, U32 width, U32 height, TF color, TF curveWidth) -> V
+	{
+		fragments.clear();
+
+		if constexpr (TRasterizer == ERasterizer::Analytic)
+		{
+			RasterizeToFragmentsAnalytic(curve, fragments, width, height, color, curveWidth);
+		}
+		else
+		{
+			RasterizeToFragmentsSampled(curve, fragments, width, height, color, curveWidth);
+		}
+
+		MergeFragments(fragments);
+	}
+
+
+	template<ERasterizer TRasterizer, typename TF>
 	auto RasterizeToFragments
 	(
 		Span<const QuadraticBezier<TF, 2>> curves,
@@ -291,36 +460,32 @@ namespace PA
 		ThreadPool<>& threadPool
 	) -> V
 	{
-		auto taskCount = GetLogicalCPUCount();
-		auto curvesPerTask = curves.size() / taskCount;
 
 		auto task =
 			[&](U32 start, U32 end)
 			{
 				for (auto i = start; i < end; ++i)
 				{
-					RasterizeToFragments(curves[i], fragMap[i], width, height, pigments[i], widths[i]);
+					RasterizeToFragments<TRasterizer>(curves[i], fragMap[i], width, height, pigments[i], widths[i]);
 				}
 			};
 
-		Array<TaskResult<V>> results;
-		for (auto i = 0u; i < taskCount; ++i)
-		{
-			results.emplace_back(threadPool.AddTask(task, i * curvesPerTask, (i + 1) * curvesPerTask));
-		}
+		ParallelFor(threadPool, 0, U32(curves.size()), CCurvesPerChunk, task);
+	}
 
-		// Remainder
-		task(taskCount * curvesPerTask, curves.size());
 
-		for (auto& result : results)
+	inline auto AddFragmentsOnHDRSurface(Span<const Fragment> fragments, RawCPUImage& surface) -> V
+	{
+		if (surface.format == EFormat::A16Fixed)
 		{
-			result.Retrieve();
+			auto fixedPtr = (I16*)surface.data.data();
+			for (const auto& frag : fragments)
+			{
+				fixedPtr[frag.idx] = I16(fixedPtr[frag.idx] + ToFixed(frag.value));
+			}
+			return;
 		}
-	}
 
-
-	inline auto AddFragmentsOnHDRSurface(Array<Fragment>& fragments, RawCPUImage& surface) -> V
-	{
 		auto sPtr = (F32*)surface.data.data();
 		for (const auto& frag : fragments)
 		{
@@ -329,8 +494,18 @@ namespace PA
 	}
 
 
-	inline auto SubtractFragmentsFromHDRSurface(Array<Fragment>& fragments, RawCPUImage& surface) -> V
+	inline auto SubtractFragmentsFromHDRSurface(Span<const Fragment> fragments, RawCPUImage& surface) -> V
 	{
+		if (surface.format == EFormat::A16Fixed)
+		{
+			auto fixedPtr = (I16*)surface.data.data();
+			for (const auto& frag : fragments)
+			{
+				fixedPtr[frag.idx] = I16(fixedPtr[frag.idx] - ToFixed(frag.value));
+			}
+			return;
+		}
+
 		auto sPtr = (F32*)surface.data.data();
 		for (const auto& frag : fragments)
 		{
@@ -359,33 +534,66 @@ namespace PA
 
 	inline auto CopyHDRSurfaceToGSSurface(RawCPUImage& hdr, RawCPUImage& sdr) -> V
 	{
-		auto extentSize = sdr.data.size();
 		PA_ASSERT(hdr.width == sdr.width && sdr.height == hdr.height);
-		PA_ASSERT(hdr.format == EFormat::A32Float);
-		PA_ASSERT(sdr.format == EFormat::A8);
 		PA_ASSERT(hdr.lebesgueOrdered && sdr.lebesgueOrdered);
 
-		auto hdrPtr = (F32*)hdr.data.data();
-		auto sdrPtr = (U8*)sdr.data.data();
+		ForEachLebesgueRange
+		(
+			hdr.width,
+			hdr.height,
+			[&](U32 begin, U32 end)
+			{
+				CopyHDRRangeToGSSurface(hdr, sdr, begin, end);
+			}
+		);
+	}
+
 
-		for (auto i = 0u; i < extentSize; ++i)
+	inline auto CopyHDRSurfaceToGSSurface(RawCPUImage& hdr, RawCPUImage& sdr, Span<const Fragment> fragments) -> V
+	{
+		for (auto i = 0u; i < fragments.size();)
 		{
-			sdrPtr[i] = ClampedU8(hdrPtr[i] * 255);
+			auto runEnd = i + 1;
+			while (runEnd < fragments.size() && fragments[runEnd].idx == fragments[runEnd - 1].idx + 1)
+			{
+				runEnd++;
+			}
+
+			CopyHDRRangeToGSSurface(hdr, sdr, fragments[i].idx, fragments[runEnd - 1].idx + 1);
+			i = runEnd;
 		}
 	}
 
 
-	inline auto CopyHDRSurfaceToGSSurface(RawCPUImage& hdr, RawCPUImage& sdr, Span<const Fragment> fragments) -> V
+	inline auto CopyHDRRangeToGSSurface(const RawCPUImage& hdr, RawCPUImage& sdr, U32 begin, U32 end) -> V
 	{
-		PA_ASSERT(hdr.format == EFormat::A32Float);
+		PA_ASSERT(hdr.format == EFormat::A32Float || hdr.format == EFormat::A16Fixed);
 		PA_ASSERT(sdr.format == EFormat::A8);
 
-		auto hdrPtr = (F32*)hdr.data.data();
 		auto sdrPtr = (U8*)sdr.data.data();
+		auto i = begin;
 
-		for (const auto& frag : fragments)
+		if (hdr.format == EFormat::A16Fixed)
 		{
-			sdrPtr[frag.idx] = ClampedU8(hdrPtr[frag.idx] * 255);
+			auto fixedPtr = (const I16*)hdr.data.data();
+			for (; i < end; ++i)
+			{
+				sdrPtr[i] = FixedToU8(fixedPtr[i]);
+			}
+			return;
+		}
+
+		const auto zero = F32xN::Broadcast(0.f);
+		const auto maxU8 = F32xN::Broadcast(255.f);
+		auto hdrPtr = (const F32*)hdr.data.data();
+
+		for (; i + F32xN::width <= end; i += F32xN::width)
+		{
+			Min(Max(F32xN::Load(hdrPtr + i) * maxU8, zero), maxU8).StoreU8(sdrPtr + i);
+		}
+		for (; i < end; ++i)
+		{
+			sdrPtr[i] = ClampedU8(hdrPtr[i] * 255);
 		}
 	}
 }
\ No newline at end of file
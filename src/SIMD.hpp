@@ -0,0 +1,254 @@
+// Copyright 2024 Mihail Mladenov
+//
+// This file is part of PencilAnnealing.
+//
+// PencilAnnealing is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PencilAnnealing is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PencilAnnealing.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX2__)
+	#define PA_SIMD_AVX2
+	#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define PA_SIMD_SSE2
+	#include <emmintrin.h>
+#endif
+
+namespace PA
+{
+	// Packed single precision floats of the widest width enabled at compile
+	// time. Only correctly rounded operations are exposed so every lane gives
+	// the same result as the scalar fallback.
+	struct F32xN
+	{
+#if defined(PA_SIMD_AVX2)
+		static constexpr U32 width = 8;
+		__m256 v;
+#elif defined(PA_SIMD_SSE2)
+		static constexpr U32 width = 4;
+		__m128 v;
+#else
+		static constexpr U32 width = 4;
+		StaticArray<F32, width> v;
+#endif
+
+		static auto Load(const F32* data) -> F32xN;
+		static auto LoadU8(const Byte* data) -> F32xN;
+		static auto Broadcast(F32 value) -> F32xN;
+		static auto LaneOffsets() -> F32xN;
+		auto Store(F32* data) const -> V;
+		// Lanes are truncated and have to be in [0, 255].
+		auto StoreU8(Byte* data) const -> V;
+	};
+
+	inline auto operator+(F32xN a, F32xN b) -> F32xN;
+	inline auto operator-(F32xN a, F32xN b) -> F32xN;
+	inline auto operator*(F32xN a, F32xN b) -> F32xN;
+	inline auto operator/(F32xN a, F32xN b) -> F32xN;
+	inline auto Min(F32xN a, F32xN b) -> F32xN;
+	inline auto Max(F32xN a, F32xN b) -> F32xN;
+	inline auto Sqrt(F32xN a) -> F32xN;
+	// Rounds towards zero. Lanes have to fit in I32.
+	inline auto Truncate(F32xN a) -> F32xN;
+}
+
+
+namespace PA
+{
+#if defined(PA_SIMD_AVX2)
+	inline auto F32xN::Load(const F32* data) -> F32xN
+	{
+		return { _mm256_loadu_ps(data) };
+	}
+
+
+	inline auto F32xN::LoadU8(const Byte* data) -> F32xN
+	{
+		return { _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)data))) };
+	}
+
+
+	inline auto F32xN::Broadcast(F32 value) -> F32xN
+	{
+		return { _mm256_set1_ps(value) };
+	}
+
+
+	inline auto F32xN::LaneOffsets() -> F32xN
+	{
+		return { _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f) };
+	}
+
+
+	inline auto F32xN::Store(F32* data) const -> V
+	{
+		_mm256_storeu_ps(data, v);
+	}
+
+
+	inline auto F32xN::StoreU8(Byte* data) const -> V
+	{
+		auto i32 = _mm256_cvttps_epi32(v);
+		auto i16 = _mm_packs_epi32(_mm256_castsi256_si128(i32), _mm256_extracti128_si256(i32, 1));
+		_mm_storel_epi64((__m128i*)data, _mm_packus_epi16(i16, i16));
+	}
+
+
+	inline auto operator+(F32xN a, F32xN b) -> F32xN { return { _mm256_add_ps(a.v, b.v) }; }
+	inline auto operator-(F32xN a, F32xN b) -> F32xN { return { _mm256_sub_ps(a.v, b.v) }; }
+	inline auto operator*(F32xN a, F32xN b) -> F32xN { return { _mm256_mul_ps(a.v, b.v) }; }
+	inline auto operator/(F32xN a, F32xN b) -> F32xN { return { _mm256_div_ps(a.v, b.v) }; }
+	inline auto Min(F32xN a, F32xN b) -> F32xN { return { _mm256_min_ps(a.v, b.v) }; }
+	inline auto Max(F32xN a, F32xN b) -> F32xN { return { _mm256_max_ps(a.v, b.v) }; }
+	inline auto Sqrt(F32xN a) -> F32xN { return { _mm256_sqrt_ps(a.v) }; }
+	inline auto Truncate(F32xN a) -> F32xN { return { _mm256_cvtepi32_ps(_mm256_cvttps_epi32(a.v)) }; }
+#elif defined(PA_SIMD_SSE2)
+	inline auto F32xN::Load(const F32* data) -> F32xN
+	{
+		return { _mm_loadu_ps(data) };
+	}
+
+
+	inline auto F32xN::LoadU8(const Byte* data) -> F32xN
+	{
+		I32 u8;
+		std::memcpy(&u8, data, sizeof(u8));
+		auto zero = _mm_setzero_si128();
+		auto i16 = _mm_unpacklo_epi8(_mm_cvtsi32_si128(u8), zero);
+		return { _mm_cvtepi32_ps(_mm_unpacklo_epi16(i16, zero)) };
+	}
+
+
+	inline auto F32xN::Broadcast(F32 value) -> F32xN
+	{
+		return { _mm_set1_ps(value) };
+	}
+
+
+	inline auto F32xN::LaneOffsets() -> F32xN
+	{
+		return { _mm_setr_ps(0.f, 1.f, 2.f, 3.f) };
+	}
+
+
+	inline auto F32xN::Store(F32* data) const -> V
+	{
+		_mm_storeu_ps(data, v);
+	}
+
+
+	inline auto F32xN::StoreU8(Byte* data) const -> V
+	{
+		auto i16 = _mm_packs_epi32(_mm_cvttps_epi32(v), _mm_setzero_si128());
+		auto u8 = _mm_cvtsi128_si32(_mm_packus_epi16(i16, i16));
+		std::memcpy(data, &u8, sizeof(u8));
+	}
+
+
+	inline auto operator+(F32xN a, F32xN b) -> F32xN { return { _mm_add_ps(a.v, b.v) }; }
+	inline auto operator-(F32xN a, F32xN b) -> F32xN { return { _mm_sub_ps(a.v, b.v) }; }
+	inline auto operator*(F32xN a, F32xN b) -> F32xN { return { _mm_mul_ps(a.v, b.v) }; }
+	inline auto operator/(F32xN a, F32xN b) -> F32xN { return { _mm_div_ps(a.v, b.v) }; }
+	inline auto Min(F32xN a, F32xN b) -> F32xN { return { _mm_min_ps(a.v, b.v) }; }
+	inline auto Max(F32xN a, F32xN b) -> F32xN { return { _mm_max_ps(a.v, b.v) }; }
+	inline auto Sqrt(F32xN a) -> F32xN { return { _mm_sqrt_ps(a.v) }; }
+	inline auto Truncate(F32xN a) -> F32xN { return { _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v)) }; }
+#else
+	inline auto F32xN::Load(const F32* data) -> F32xN
+	{
+		F32xN result;
+		for (auto i = 0u; i < width; ++i)
+		{
+			result.v[i] = data[i];
+		}
+		return result;
+	}
+
+
+	inline auto F32xN::LoadU8(const Byte* data) -> F32xN
+	{
+		F32xN result;
+		for (auto i = 0u; i < width; ++i)
+		{
+			result.v[i] = F32(data[i]);
+		}
+		return result;
+	}
+
+
+	inline auto F32xN::Broadcast(F32 value) -> F32xN
+	{
+		F32xN result;
+		result.v.fill(value);
+		return result;
+	}
+
+
+	inline auto F32xN::LaneOffsets() -> F32xN
+	{
+		F32xN result;
+		for (auto i = 0u; i < width; ++i)
+		{
+			result.v[i] = F32(i);
+		}
+		return result;
+	}
+
+
+	inline auto F32xN::Store(F32* data) const -> V
+	{
+		for (auto i = 0u; i < width; ++i)
+		{
+			data[i] = v[i];
+		}
+	}
+
+
+	inline auto F32xN::StoreU8(Byte* data) const -> V
+	{
+		for (auto i = 0u; i < width; ++i)
+		{
+			data[i] = Byte(v[i]);
+		}
+	}
+
+
+	template <typename TOp>
+	inline auto ApplyPerLane(F32xN a, F32xN b, TOp op) -> F32xN
+	{
+		F32xN result;
+		for (auto i = 0u; i < F32xN::width; ++i)
+		{
+			result.v[i] = op(a.v[i], b.v[i]);
+		}
+		return result;
+	}
+
+
+	inline auto operator+(F32xN a, F32xN b) -> F32xN { return ApplyPerLane(a, b, [](F32 x, F32 y) { return x + y; }); }
+	inline auto operator-(F32xN a, F32xN b) -> F32xN { return ApplyPerLane(a, b, [](F32 x, F32 y) { return x - y; }); }
+	inline auto operator*(F32xN a, F32xN b) -> F32xN { return ApplyPerLane(a, b, [](F32 x, F32 y) { return x * y; }); }
+	inline auto operator/(F32xN a, F32xN b) -> F32xN { return ApplyPerLane(a, b, [](F32 x, F32 y) { return x / y; }); }
+	inline auto Min(F32xN a, F32xN b) -> F32xN { return ApplyPerLane(a, b, [](F32 x, F32 y) { return x < y ? x : y; }); }
+	inline auto Max(F32xN a, F32xN b) -> F32xN { return ApplyPerLane(a, b, [](F32 x, F32 y) { return x > y ? x : y; }); }
+	inline auto Sqrt(F32xN a) -> F32xN { return ApplyPerLane(a, a, [](F32 x, F32) { return std::sqrt(x); }); }
+	inline auto Truncate(F32xN a) -> F32xN { return ApplyPerLane(a, a, [](F32 x, F32) { return F32(I32(x)); }); }
+#endif
+}
@@ -27,6 +27,8 @@
 #include "Algorithm.hpp"
 #include "Concepts.hpp"
 #include "VideoEncoder.hpp"
+#include "ThreadPool.hpp"
+#include "Parallel.hpp"
 
 namespace PA
 {
@@ -67,7 +69,8 @@ namespace PA
 		U32 height,
 		B darkOnLight,
 		U8 bgLightness,
-		StrView outFile = "out.ogv"sv
+		StrView outFile = "out.ogv"sv,
+		U32 threadCount = GetLogicalCPUCount()
 	);
 
 	template <typename T>
@@ -170,7 +173,7 @@ namespace PA
 
 	inline auto SerializeToWebP(RawCPUImage& hdrSurface, StrView outFile)
 	{
-		auto rgba8Surface = A32FloatToRGBA8Linear(hdrSurface);
+		auto rgba8Surface = hdrSurface.format == EFormat::A16Fixed ? A16FixedToRGBA8Linear(hdrSurface) : A32FloatToRGBA8Linear(hdrSurface);
 		auto webpEncoded = EncodeWebP(rgba8Surface, 70);
 		WriteWholeFile(outFile, Span<const Byte>(webpEncoded.data(), webpEncoded.size()));
 	}
@@ -194,7 +197,7 @@ namespace PA
 		CreateDirectory(outFolder);
 
 		using FragmentsMapDrawFunc = Void(*)(Array<Array<Fragment>>& fragments, RawCPUImage& surface);
-		using FragmentsDrawFunc = Void(*)(Array<Fragment>& fragments, RawCPUImage& surface);
+		using FragmentsDrawFunc = Void(*)(Span<const Fragment> fragments, RawCPUImage& surface);
 		FragmentsDrawFunc PutFragmentsOnHDRSurface = nullptr;
 		FragmentsDrawFunc RemoveFragmentsFromHDRSurface = nullptr;
 
@@ -295,12 +298,11 @@ namespace PA
 
 
 	template<typename TF>
-	auto SerializeToVideo(Span<const QuadraticBezier<TF, 2>> normalizedCoords, Span<const TF> widths, Span<const TF> pigments, U32 width, U32 height, B darkOnLight, U8 bgLightness, StrView outFile)
+	auto SerializeToVideo(Span<const QuadraticBezier<TF, 2>> normalizedCoords, Span<const TF> widths, Span<const TF> pigments, U32 width, U32 height, B darkOnLight, U8 bgLightness, StrView outFile, U32 threadCount)
 	{
 		RemoveFile(outFile);
 
-		using FragmentsMapDrawFunc = Void(*)(Array<Array<Fragment>>& fragments, RawCPUImage& surface);
-		using FragmentsDrawFunc = Void(*)(Array<Fragment>& fragments, RawCPUImage& surface);
+		using FragmentsDrawFunc = Void(*)(Span<const Fragment> fragments, RawCPUImage& surface);
 		FragmentsDrawFunc PutFragmentsOnHDRSurface = nullptr;
 		FragmentsDrawFunc RemoveFragmentsFromHDRSurface = nullptr;
 
@@ -325,7 +327,6 @@ namespace PA
 
 		Log("Serializing to video");
 
-		auto frameCount = 0u;
 		auto seq = GenerateSequence(U32(0), U32(normalizedCoords.size()));
 
 		Sort
@@ -361,53 +362,167 @@ namespace PA
 			}
 		);
 
-		RawCPUImage surface(width, height, EFormat::A32Float, true);
-		Array<Fragment> fragments;
-		surface.Clear(bgLightness / 255.f);
+		if (seq.empty())
+		{
+			encoder.FlushCacheToDisk();
+			return;
+		}
 
+		// The pool rasterizes strokes and converts frames while a dedicated
+		// thread feeds finished frames to the encoder in order. The ring of
+		// frames bounds how far the producer can run ahead of the encoder.
+		static constexpr U32 framesInFlight = 4;
+		static constexpr U32 strokesPerBatch = 64;
 		static constexpr U32 logAfterFrames = 128;
-		U32 curvesPerFrame = 0;
-		for (auto i = 0u; i < seq.size(); ++i)
+
+		enum EFrameState : U32
 		{
-			auto idx = seq[i];
-			auto& curve = normalizedCoords[idx];
-			auto lengthApprox = Distance(curve.p0, curve.p1) + Distance(curve.p1, curve.p2);
-			auto strokeSegmentation = U32(TF(5) * lengthApprox);
-			auto multiCurvesPerFrame = (lengthApprox < TF(0.05)) ? true : false;
+			Free,
+			Ready,
+			ReadyLast
+		};
+
+		ThreadPool<> threadPool(threadCount);
+		StaticArray<VideoEncoder::Frame, framesInFlight> frames;
+		StaticArray<Atomic<U32>, framesInFlight> frameStates;
+		for (auto i = 0u; i < framesInFlight; ++i)
+		{
+			frames[i] = encoder.AllocateFrame();
+			frameStates[i] = Free;
+		}
 
-			for (auto s = 1u; s < strokeSegmentation; ++s)
+		Thread encoderThread
+		(
+			[&]()
 			{
-				auto splitPoint = TF(s) / strokeSegmentation;
-				auto currentCurve = curve.Split(splitPoint).first;
+				for (auto frameIdx = 0u; ; ++frameIdx)
+				{
+					auto& state = frameStates[frameIdx % framesInFlight];
+					state.wait(Free);
+					auto lastFrame = state.load() == ReadyLast;
+					encoder.EncodeFrame(frames[frameIdx % framesInFlight], lastFrame);
+					state = Free;
+					state.notify_one();
+					if (lastFrame)
+					{
+						break;
+					}
+				}
+			}
+		);
 
-				RasterizeToFragments(currentCurve, fragments, width, height, pigments[idx], widths[idx]);
-				PutFragmentsOnHDRSurface(fragments, surface);
-				encoder.EncodeA32Float(surface, false);
-				RemoveFragmentsFromHDRSurface(fragments, surface);
+		RawCPUImage surface(width, height, EFormat::A32Float, true);
+		surface.Clear(bgLightness / 255.f);
+
+		// Luma is converted in lebesgue blocks, so chunks start on block rows.
+		auto rowsPerChunk = Max(CLebesgueBlockSide, (CPixelsPerChunk / width) & ~(CLebesgueBlockSide - 1));
+		auto frameCount = 0u;
+		auto emitFrame =
+			[&](B lastFrame)
+			{
+				auto& state = frameStates[frameCount % framesInFlight];
+				for (auto current = state.load(); current != Free; current = state.load())
+				{
+					state.wait(current);
+				}
+
+				auto& frame = frames[frameCount % framesInFlight];
+				ParallelFor
+				(
+					threadPool,
+					0,
+					height,
+					rowsPerChunk,
+					[&](U32 rowBegin, U32 rowEnd) { encoder.ConvertA32Float(surface, frame, rowBegin, rowEnd); }
+				);
+
+				state = lastFrame ? ReadyLast : Ready;
+				state.notify_one();
 				frameCount++;
-			}
+			};
 
-			RasterizeToFragments(curve, fragments, width, height, pigments[idx], widths[idx]);
-			PutFragmentsOnHDRSurface(fragments, surface);
+		Array<QuadraticBezier<TF, 2>> batchCurves;
+		Array<TF> batchWidths;
+		Array<TF> batchPigments;
+		Array<U32> batchOffsets;
+		Array<Array<Fragment>> batchFragments;
 
-			if ((multiCurvesPerFrame && curvesPerFrame > 3) || i == seq.size() - 1 || !multiCurvesPerFrame)
+		U32 curvesPerFrame = 0;
+		for (auto batchBegin = 0u; batchBegin < seq.size(); batchBegin += strokesPerBatch)
+		{
+			auto batchEnd = Min(U32(seq.size()), batchBegin + strokesPerBatch);
+
+			// The partial curves of every stroke followed by the whole stroke.
+			batchCurves.clear();
+			batchWidths.clear();
+			batchPigments.clear();
+			batchOffsets.clear();
+			for (auto i = batchBegin; i < batchEnd; ++i)
 			{
-				encoder.EncodeA32Float(surface, i == seq.size() - 1);
-				curvesPerFrame = 0;
+				auto idx = seq[i];
+				auto& curve = normalizedCoords[idx];
+				auto lengthApprox = Distance(curve.p0, curve.p1) + Distance(curve.p1, curve.p2);
+				auto strokeSegmentation = U32(TF(5) * lengthApprox);
+
+				batchOffsets.push_back(batchCurves.size());
+				for (auto s = 1u; s < strokeSegmentation; ++s)
+				{
+					auto splitPoint = TF(s) / strokeSegmentation;
+					batchCurves.push_back(curve.Split(splitPoint).first);
+				}
+				batchCurves.push_back(curve);
+				batchWidths.resize(batchCurves.size(), widths[idx]);
+				batchPigments.resize(batchCurves.size(), pigments[idx]);
 			}
-			else
+			batchOffsets.push_back(batchCurves.size());
+
+			batchFragments.resize(Max(batchFragments.size(), batchCurves.size()));
+			RasterizeToFragments
+			(
+				Span<const QuadraticBezier<TF, 2>>(batchCurves),
+				Span<const TF>(batchWidths),
+				Span<const TF>(batchPigments),
+				batchFragments,
+				width,
+				height,
+				threadPool
+			);
+
+			for (auto i = batchBegin; i < batchEnd; ++i)
 			{
-				curvesPerFrame++;
-			}
+				auto& curve = normalizedCoords[seq[i]];
+				auto lengthApprox = Distance(curve.p0, curve.p1) + Distance(curve.p1, curve.p2);
+				auto multiCurvesPerFrame = (lengthApprox < TF(0.05)) ? true : false;
 
-			frameCount++;
-			if (i % logAfterFrames == 0)
-			{
-				auto progress = F32(i) / seq.size() * 100;
-				Log(Format("Progress: {:3.2f}%", progress));
-				SerializeToWebP(surface, "debug.webp");
+				auto wholeCurve = batchOffsets[i - batchBegin + 1] - 1;
+				for (auto c = batchOffsets[i - batchBegin]; c < wholeCurve; ++c)
+				{
+					PutFragmentsOnHDRSurface(batchFragments[c], surface);
+					emitFrame(false);
+					RemoveFragmentsFromHDRSurface(batchFragments[c], surface);
+				}
+
+				PutFragmentsOnHDRSurface(batchFragments[wholeCurve], surface);
+
+				if ((multiCurvesPerFrame && curvesPerFrame > 3) || i == seq.size() - 1 || !multiCurvesPerFrame)
+				{
+					emitFrame(i == seq.size() - 1);
+					curvesPerFrame = 0;
+				}
+				else
+				{
+					curvesPerFrame++;
+				}
+
+				if (i % logAfterFrames == 0)
+				{
+					auto progress = F32(i) / seq.size() * 100;
+					Log(Format("Progress: {:3.2f}%", progress));
+				}
 			}
 		}
+
+		encoderThread.join();
 		encoder.FlushCacheToDisk();
 	}
 
@@ -0,0 +1,744 @@
+// Copyright 2024 Mihail Mladenov
+//
+// This file is part of PencilAnnealing.
+//
+// PencilAnnealing is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PencilAnnealing is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PencilAnnealing.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "Types.hpp"
+#include "Bezier.hpp"
+#include "Rendering.hpp"
+#include "CompactFragment.hpp"
+#include "BBoxGrid.hpp"
+#include "Error.hpp"
+
+namespace PA
+{
+	// Refers to a stroke independently of its position in the store. Stays
+	// recognizably stale once the stroke is removed, even if the slot is
+	// reused.
+	struct StrokeHandle
+	{
+		U32 slot = ~0u;
+		U32 generation = 0;
+
+		auto operator==(const StrokeHandle& other) const -> B = default;
+	};
+
+	// Strokes are kept densely packed, one array per attribute. The fragments
+	// of all strokes share a single pool, every stroke owns a slab of it.
+	// Removal moves the last stroke into the freed position, so indices are
+	// only stable until the next removal while handles stay valid.
+	// In compact mode the pool holds CompactFragments, half the size, and the
+	// values of the stored fragments are quantized. With a fragments budget
+	// the least recently used slabs are dropped once the budget is exceeded;
+	// the caller has to regenerate the fragments of those strokes. The pool
+	// then holds a quarter more than the budget, the room left behind by
+	// dropped and moved slabs is reclaimed in place once that is used up.
+	// Optionally the bounds of the control points of every stroke are kept in
+	// a grid, so the strokes around a region can be found without a scan.
+	template <typename TF>
+	class StrokeStore
+	{
+	public:
+		using Curve = QuadraticBezier<TF, 2>;
+		using BBox = typename Curve::BBox;
+
+		explicit StrokeStore(B compactFragments = false);
+
+		auto Size() const -> U32;
+		auto Empty() const -> B;
+		auto Clear() -> V;
+		// Empties the slab of every stroke, keeping the pool for the fragments
+		// set next, e.g. when the strokes are rasterized at another resolution.
+		auto ClearFragments() -> V;
+
+		// Add, Update and ReserveFragments may move the fragments of every
+		// stroke, spans returned by GetFragments do not survive them.
+		auto Add(const Curve& curve, TF width, TF pigment, Span<const Fragment> fragments) -> StrokeHandle;
+		auto Remove(U32 idx) -> V;
+		// Updates of different strokes can run concurrently as long as the
+		// fragments fit the slab of the stroke, see GrowSlab, and the store
+		// is not indexed.
+		auto Update(U32 idx, const Curve& curve, TF width, TF pigment, Span<const Fragment> fragments) -> V;
+		auto SetFragments(U32 idx, Span<const Fragment> fragments) -> V;
+		// Makes sure the slab of the stroke can hold fragments, keeping its
+		// contents. Lock free for different strokes, it fails when the room
+		// set aside with ReserveFragments is used up.
+		auto GrowSlab(U32 idx, Span<const Fragment> fragments) -> B;
+		// With a fragments budget less may be set aside and the least
+		// recently used slabs are dropped to make room for it.
+		auto ReserveFragments(U32 fragmentsCount) -> V;
+		auto IsCompact() const -> B;
+		// Zero keeps the fragments of every stroke.
+		auto SetFragmentsBudget(U64 bytes) -> V;
+		auto IsResident(U32 idx) const -> B;
+		// Marks the stroke as used, so it is dropped after the strokes used
+		// less recently. Different strokes can be touched concurrently.
+		auto Touch(U32 idx) -> V;
+		// Memory held by the fragment pool, including the room not in use.
+		auto GetPoolBytes() const -> U64;
+		// Starts or stops keeping the spatial index, starting builds it from
+		// the current strokes.
+		auto SetIndexed(B enabled) -> V;
+		auto IsIndexed() const -> B;
+		// Appends the index of every stroke whose control points bounds
+		// intersect region, in normalized coordinates. The store has to be
+		// indexed.
+		auto QueryRegion(const BBox& region, Array<U32>& indices) const -> V;
+
+		auto GetCurves() const -> Span<const Curve>;
+		auto GetWidths() const -> Span<const TF>;
+		auto GetPigments() const -> Span<const TF>;
+		auto GetCurve(U32 idx) const -> const Curve&;
+		// Compact fragments are decoded to scratch, otherwise the span points
+		// into the pool. The stroke has to be resident.
+		auto GetFragments(U32 idx, Array<Fragment>& scratch) const -> Span<const Fragment>;
+		// Count and range are kept for strokes that are not resident.
+		auto GetFragmentsCount(U32 idx) const -> U32;
+		// Indices of the first and the last fragment, the stroke has to have some.
+		auto GetFragmentsRange(U32 idx) const -> Pair<U32, U32>;
+		auto GetFragmentsCount() const -> U32;
+		auto GetResidentFragmentsCount() const -> U32;
+		// Concatenates the fragments of all strokes in order. offsets gets the
+		// first fragment of every stroke followed by the total.
+		auto CopyFragments(Array<U64>& offsets, Array<Fragment>& fragments) const -> V;
+
+		auto GetHandle(U32 idx) const -> StrokeHandle;
+		auto IsValid(StrokeHandle handle) const -> B;
+		auto GetIndex(StrokeHandle handle) const -> U32;
+
+	private:
+		// offset, size and capacity are in words of the pool. Slabs that are
+		// not resident have an offset of evicted and no room.
+		static constexpr U32 evicted = ~0u;
+
+		struct Slab
+		{
+			U32 offset;
+			U32 size;
+			U32 capacity;
+			U32 count;
+			U32 first;
+			U32 last;
+		};
+
+		auto GetWordsCount(Span<const Fragment> fragments) const -> U32;
+		auto AllocateWords(U32 count) -> U32;
+		// size is the GetWordsCount of fragments.
+		auto WriteFragments(Span<const Fragment> fragments, U32 size, Slab& slab) -> V;
+		// Copies without touching the pool when either side is empty.
+		static auto WriteWords(Span<const U32> from, U32* to) -> V;
+		// Packs the slabs and leaves room for extra words.
+		auto Compact(U32 extra) -> V;
+		// Drops the least recently used slabs until at most words are resident.
+		auto Evict(U64 words) -> V;
+
+		Array<Curve> curves;
+		Array<TF> widths;
+		Array<TF> pigments;
+		Array<Slab> slabs;
+		Array<U64> lastUses;
+		Array<U32> slots;
+
+		Array<U32> slotIndices;
+		Array<U32> slotGenerations;
+		Array<U32> freeSlots;
+
+		// Keyed by slot, so moving strokes around on removal leaves it intact.
+		B indexed = false;
+		BBoxGrid<TF> index;
+
+		B compact;
+		Array<U32> fragmentPool;
+		Atomic<U32> poolEnd = 0;
+
+		U64 budgetWords = 0;
+		Atomic<U64> residentWords = 0;
+		Atomic<U64> usesCount = 0;
+	};
+}
+
+
+namespace PA
+{
+	template<typename TF>
+	inline StrokeStore<TF>::StrokeStore(B compactFragments) :
+		compact(compactFragments)
+	{
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::Size() const -> U32
+	{
+		return U32(curves.size());
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::Empty() const -> B
+	{
+		return curves.empty();
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::Clear() -> V
+	{
+		while (!Empty())
+		{
+			Remove(Size() - 1);
+		}
+		poolEnd = 0;
+		residentWords = 0;
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::ClearFragments() -> V
+	{
+		for (auto& slab : slabs)
+		{
+			slab = {};
+		}
+		poolEnd = 0;
+		residentWords = 0;
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::Add(const Curve& curve, TF width, TF pigment, Span<const Fragment> fragments) -> StrokeHandle
+	{
+		auto size = GetWordsCount(fragments);
+		Slab slab = { AllocateWords(size), 0, size, 0, 0, 0 };
+		residentWords += size;
+		WriteFragments(fragments, size, slab);
+
+		U32 slot = 0;
+		if (freeSlots.empty())
+		{
+			slot = U32(slotIndices.size());
+			slotIndices.push_back(0);
+			slotGenerations.push_back(0);
+		}
+		else
+		{
+			slot = freeSlots.back();
+			freeSlots.pop_back();
+		}
+		slotIndices[slot] = Size();
+		if (indexed)
+		{
+			index.Add(slot, curve.GetBBox());
+		}
+
+		curves.push_back(curve);
+		widths.push_back(width);
+		pigments.push_back(pigment);
+		slabs.push_back(slab);
+		lastUses.push_back(usesCount++);
+		slots.push_back(slot);
+
+		return { slot, slotGenerations[slot] };
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::Remove(U32 idx) -> V
+	{
+		PA_ASSERT(idx < Size());
+
+		auto slot = slots[idx];
+		slotGenerations[slot]++;
+		freeSlots.push_back(slot);
+		if (indexed)
+		{
+			index.Remove(slot);
+		}
+
+		auto last = Size() - 1;
+		slotIndices[slots[last]] = idx;
+		residentWords -= slabs[idx].capacity;
+
+		curves[idx] = curves[last];
+		widths[idx] = widths[last];
+		pigments[idx] = pigments[last];
+		slabs[idx] = slabs[last];
+		lastUses[idx] = lastUses[last];
+		slots[idx] = slots[last];
+
+		curves.pop_back();
+		widths.pop_back();
+		pigments.pop_back();
+		slabs.pop_back();
+		lastUses.pop_back();
+		slots.pop_back();
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::Update(U32 idx, const Curve& curve, TF width, TF pigment, Span<const Fragment> fragments) -> V
+	{
+		SetFragments(idx, fragments);
+		if (indexed)
+		{
+			index.Update(slots[idx], curve.GetBBox());
+		}
+		curves[idx] = curve;
+		widths[idx] = width;
+		pigments[idx] = pigment;
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::SetFragments(U32 idx, Span<const Fragment> fragments) -> V
+	{
+		auto size = GetWordsCount(fragments);
+		if (size > slabs[idx].capacity || !IsResident(idx))
+		{
+			// Allocating may evict this very slab, which is replaced anyway.
+			auto offset = AllocateWords(size);
+			residentWords += size - slabs[idx].capacity;
+			slabs[idx].offset = offset;
+			slabs[idx].capacity = size;
+		}
+		WriteFragments(fragments, size, slabs[idx]);
+		Touch(idx);
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::GrowSlab(U32 idx, Span<const Fragment> fragments) -> B
+	{
+		auto& slab = slabs[idx];
+		auto size = GetWordsCount(fragments);
+		if (size <= slab.capacity && slab.offset != evicted)
+		{
+			return true;
+		}
+
+		// Threads only ever write the ranges they claimed, the caller joining
+		// them publishes the results.
+		auto offset = poolEnd.load(std::memory_order_relaxed);
+		do
+		{
+			if (fragmentPool.size() - offset < size)
+			{
+				return false;
+			}
+		}
+		while (!poolEnd.compare_exchange_weak(offset, offset + size, std::memory_order_relaxed));
+
+		if (slab.offset != evicted)
+		{
+			WriteWords(Span<const U32>(fragmentPool.data() + slab.offset, slab.size), fragmentPool.data() + offset);
+		}
+		residentWords.fetch_add(size - slab.capacity, std::memory_order_relaxed);
+		slab.offset = offset;
+		slab.capacity = size;
+		return true;
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::ReserveFragments(U32 fragmentsCount) -> V
+	{
+		// Escapes are rare enough to be left out of the estimate.
+		auto size = compact ? fragmentsCount : 2 * fragmentsCount;
+		if (budgetWords)
+		{
+			// The reserve comes out of the budget, at most a quarter of it,
+			// so packing never grows the pool past the room it already has.
+			size = U32(Min(U64(size), budgetWords / 4));
+			if (residentWords + size > budgetWords)
+			{
+				Evict(budgetWords - size);
+			}
+		}
+		if (fragmentPool.size() - poolEnd < size)
+		{
+			Compact(size);
+		}
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::IsCompact() const -> B
+	{
+		return compact;
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::SetFragmentsBudget(U64 bytes) -> V
+	{
+		budgetWords = bytes / sizeof(U32);
+		if (budgetWords && residentWords > budgetWords)
+		{
+			Evict(budgetWords);
+		}
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::IsResident(U32 idx) const -> B
+	{
+		return slabs[idx].offset != evicted;
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::Touch(U32 idx) -> V
+	{
+		lastUses[idx] = usesCount.fetch_add(1, std::memory_order_relaxed);
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::GetPoolBytes() const -> U64
+	{
+		return U64(fragmentPool.capacity()) * sizeof(U32);
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::SetIndexed(B enabled) -> V
+	{
+		indexed = enabled;
+		index.Clear();
+		if (indexed)
+		{
+			for (auto i = 0u; i < Size(); ++i)
+			{
+				index.Add(slots[i], curves[i].GetBBox());
+			}
+		}
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::IsIndexed() const -> B
+	{
+		return indexed;
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::QueryRegion(const BBox& region, Array<U32>& indices) const -> V
+	{
+		PA_ASSERT(indexed);
+		auto first = indices.size();
+		index.Query(region, indices);
+		for (auto i = first; i < indices.size(); ++i)
+		{
+			indices[i] = slotIndices[indices[i]];
+		}
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::GetCurves() const -> Span<const Curve>
+	{
+		return Span<const Curve>(curves);
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::GetWidths() const -> Span<const TF>
+	{
+		return Span<const TF>(widths);
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::GetPigments() const -> Span<const TF>
+	{
+		return Span<const TF>(pigments);
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::GetCurve(U32 idx) const -> const Curve&
+	{
+		return curves[idx];
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::GetFragments(U32 idx, Array<Fragment>& scratch) const -> Span<const Fragment>
+	{
+		PA_ASSERT(IsResident(idx));
+		const auto& slab = slabs[idx];
+		auto words = fragmentPool.data() + slab.offset;
+		if (!compact)
+		{
+			return Span<const Fragment>((const Fragment*)words, slab.count);
+		}
+
+		scratch.resize(slab.count);
+		DecodeFragments(slab.first, Span<const CompactFragment>((const CompactFragment*)words, slab.size), scratch.data());
+		return Span<const Fragment>(scratch.data(), slab.count);
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::GetFragmentsCount(U32 idx) const -> U32
+	{
+		return slabs[idx].count;
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::GetFragmentsRange(U32 idx) const -> Pair<U32, U32>
+	{
+		PA_ASSERT(slabs[idx].count);
+		return { slabs[idx].first, slabs[idx].last };
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::GetFragmentsCount() const -> U32
+	{
+		U32 count = 0;
+		for (const auto& slab : slabs)
+		{
+			count += slab.count;
+		}
+		return count;
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::GetResidentFragmentsCount() const -> U32
+	{
+		U32 count = 0;
+		for (const auto& slab : slabs)
+		{
+			count += slab.offset != evicted ? slab.count : 0;
+		}
+		return count;
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::CopyFragments(Array<U64>& offsets, Array<Fragment>& fragments) const -> V
+	{
+		offsets.resize(Size() + 1);
+		fragments.resize(GetFragmentsCount());
+
+		U64 offset = 0;
+		for (auto i = 0u; i < Size(); ++i)
+		{
+			offsets[i] = offset;
+			PA_ASSERT(IsResident(i));
+			const auto& slab = slabs[i];
+			auto words = fragmentPool.data() + slab.offset;
+			if (compact)
+			{
+				DecodeFragments(slab.first, Span<const CompactFragment>((const CompactFragment*)words, slab.size), fragments.data() + offset);
+			}
+			else
+			{
+				WriteWords(Span<const U32>(words, slab.size), (U32*)(fragments.data() + offset));
+			}
+			offset += slab.count;
+		}
+		offsets[Size()] = offset;
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::GetHandle(U32 idx) const -> StrokeHandle
+	{
+		return { slots[idx], slotGenerations[slots[idx]] };
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::IsValid(StrokeHandle handle) const -> B
+	{
+		return handle.slot < slotGenerations.size() && slotGenerations[handle.slot] == handle.generation;
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::GetIndex(StrokeHandle handle) const -> U32
+	{
+		PA_ASSERT(IsValid(handle));
+		return slotIndices[handle.slot];
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::GetWordsCount(Span<const Fragment> fragments) const -> U32
+	{
+		static_assert(sizeof(Fragment) == 2 * sizeof(U32) && sizeof(CompactFragment) == sizeof(U32));
+		return compact ? GetCompactSize(fragments) : 2 * U32(fragments.size());
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::AllocateWords(U32 count) -> U32
+	{
+		// Evicting a quarter of the budget at once keeps the scans rare.
+		if (budgetWords && residentWords + count > budgetWords)
+		{
+			auto words = budgetWords - Min(budgetWords, U64(count));
+			Evict(words - words / 4);
+		}
+
+		if (fragmentPool.size() - poolEnd < count)
+		{
+			Compact(count);
+		}
+
+		auto offset = poolEnd.load(std::memory_order_relaxed);
+		poolEnd = offset + count;
+		return offset;
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::WriteFragments(Span<const Fragment> fragments, U32 size, Slab& slab) -> V
+	{
+		auto words = fragmentPool.data() + slab.offset;
+		if (compact)
+		{
+			EncodeFragments(fragments, (CompactFragment*)words);
+		}
+		else
+		{
+			WriteWords(Span<const U32>((const U32*)fragments.data(), size), words);
+		}
+
+		slab.size = size;
+		slab.count = U32(fragments.size());
+		if (!fragments.empty())
+		{
+			slab.first = fragments.front().idx;
+			slab.last = fragments.back().idx;
+		}
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::WriteWords(Span<const U32> from, U32* to) -> V
+	{
+		if (!from.empty())
+		{
+			MemCopy(from, to);
+		}
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::Compact(U32 extra) -> V
+	{
+		U64 live = 0;
+		for (const auto& slab : slabs)
+		{
+			live += slab.offset != evicted ? slab.size : 0;
+		}
+
+		U32 offset = 0;
+		if (!budgetWords)
+		{
+			Array<U32> packed(2 * (live + extra));
+			for (auto& slab : slabs)
+			{
+				if (slab.offset == evicted)
+				{
+					continue;
+				}
+				WriteWords(Span<const U32>(fragmentPool.data() + slab.offset, slab.size), packed.data() + offset);
+				slab.offset = offset;
+				slab.capacity = slab.size;
+				offset += slab.size;
+			}
+			fragmentPool = Move(packed);
+		}
+		else
+		{
+			// Moving the slabs down in the order they lie in the pool never
+			// overwrites one that is still to be moved, so no second pool is
+			// needed. Only a reserve beyond the budget grows the pool.
+			Array<U32> resident;
+			for (auto i = 0u; i < Size(); ++i)
+			{
+				if (slabs[i].offset != evicted)
+				{
+					resident.push_back(i);
+				}
+			}
+			Sort(resident, [this](U32 i0, U32 i1) { return slabs[i0].offset < slabs[i1].offset; });
+
+			for (auto idx : resident)
+			{
+				auto& slab = slabs[idx];
+				if (slab.size)
+				{
+					MemMove(Span<const U32>(fragmentPool.data() + slab.offset, slab.size), fragmentPool.data() + offset);
+				}
+				slab.offset = offset;
+				slab.capacity = slab.size;
+				offset += slab.size;
+			}
+
+			// The pool also shrinks here after the budget was lowered.
+			auto poolWords = Max(budgetWords + budgetWords / 4, live + extra);
+			if (fragmentPool.size() < poolWords)
+			{
+				fragmentPool.reserve(poolWords);
+				fragmentPool.resize(poolWords);
+			}
+			else if (fragmentPool.size() > poolWords)
+			{
+				fragmentPool.resize(poolWords);
+				fragmentPool.shrink_to_fit();
+			}
+		}
+
+		poolEnd = offset;
+		residentWords = live;
+	}
+
+
+	template<typename TF>
+	inline auto StrokeStore<TF>::Evict(U64 words) -> V
+	{
+		Array<U32> resident;
+		for (auto i = 0u; i < Size(); ++i)
+		{
+			if (slabs[i].offset != evicted && slabs[i].capacity)
+			{
+				resident.push_back(i);
+			}
+		}
+		Sort(resident, [this](U32 i0, U32 i1) { return lastUses[i0] < lastUses[i1]; });
+
+		for (auto idx : resident)
+		{
+			if (residentWords <= words)
+			{
+				break;
+			}
+			residentWords -= slabs[idx].capacity;
+			slabs[idx].offset = evicted;
+			slabs[idx].size = 0;
+			slabs[idx].capacity = 0;
+		}
+	}
+}
@@ -0,0 +1,131 @@
+// Copyright 2024 Mihail Mladenov
+//
+// This file is part of PencilAnnealing.
+//
+// PencilAnnealing is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PencilAnnealing is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PencilAnnealing.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "Types.hpp"
+#include "Utilities.hpp"
+
+namespace PA
+{
+	// Non negative weights in a complete binary tree whose inner nodes hold
+	// the sum of their children. Setting a weight and finding the index a
+	// prefix sum falls into both take O(log n), so indices can be drawn in
+	// proportion to weights that keep changing.
+	template <typename T>
+	class SumTree
+	{
+	public:
+		SumTree() = default;
+
+		// Replaces all the weights, in O(n).
+		auto Build(Span<const T> weights) -> V;
+		auto Size() const -> U32;
+		auto Set(U32 idx, T weight) -> V;
+		auto Get(U32 idx) const -> T;
+		auto GetTotal() const -> T;
+		// Index i for which the weights before it sum to at most u and the
+		// weights up to and including it to more than u. Indices of zero
+		// weight are never returned, the total has to be positive.
+		auto Find(T u) const -> U32;
+
+	private:
+		// Node 1 is the root, the children of node n are 2n and 2n + 1 and
+		// the leaves start at leavesCount.
+		Array<T> nodes;
+		U32 leavesCount = 0;
+		U32 size = 0;
+	};
+}
+
+
+namespace PA
+{
+	template<typename T>
+	inline auto SumTree<T>::Build(Span<const T> weights) -> V
+	{
+		size = U32(weights.size());
+		leavesCount = RoundToPowerOfTwo(Max(size, 1u));
+		nodes.assign(2 * leavesCount, T(0));
+		for (auto i = 0u; i < size; ++i)
+		{
+			nodes[leavesCount + i] = weights[i];
+		}
+		for (auto n = leavesCount - 1; n > 0; --n)
+		{
+			nodes[n] = nodes[2 * n] + nodes[2 * n + 1];
+		}
+	}
+
+
+	template<typename T>
+	inline auto SumTree<T>::Size() const -> U32
+	{
+		return size;
+	}
+
+
+	template<typename T>
+	inline auto SumTree<T>::Set(U32 idx, T weight) -> V
+	{
+		// Sums are recomputed from the children, so no error accumulates
+		// over many updates.
+		auto n = leavesCount + idx;
+		nodes[n] = weight;
+		for (n /= 2; n > 0; n /= 2)
+		{
+			nodes[n] = nodes[2 * n] + nodes[2 * n + 1];
+		}
+	}
+
+
+	template<typename T>
+	inline auto SumTree<T>::Get(U32 idx) const -> T
+	{
+		return nodes[leavesCount + idx];
+	}
+
+
+	template<typename T>
+	inline auto SumTree<T>::GetTotal() const -> T
+	{
+		return nodes.empty() ? T(0) : nodes[1];
+	}
+
+
+	template<typename T>
+	inline auto SumTree<T>::Find(T u) const -> U32
+	{
+		auto n = 1u;
+		while (n < leavesCount)
+		{
+			auto left = nodes[2 * n];
+			// Rounding may leave u at or past the total, the right child is
+			// only taken when it has weight.
+			if (u < left || nodes[2 * n + 1] <= T(0))
+			{
+				n = 2 * n;
+			}
+			else
+			{
+				u -= left;
+				n = 2 * n + 1;
+			}
+		}
+		return n - leavesCount;
+	}
+}
@@ -15,27 +15,97 @@
 // You should have received a copy of the GNU General Public License
 // along with PencilAnnealing.  If not, see <http://www.gnu.org/licenses/>.
 
-
 #pragma once
 
 #include "Types.hpp"
 
+#include <new>
+
 namespace PA
 {
+	enum class ETaskState : U32
+	{
+		Free,
+		Pending,
+		Done
+	};
+
+	// Pool owned state and return value of a task. TaskResult only points
+	// here so it can be moved around while the task is still running.
+	struct TaskSlot
+	{
+		static constexpr U32 resultCapacity = 64;
+
+		Atomic<ETaskState> state = ETaskState::Free;
+		alignas(16) StaticArray<Byte, resultCapacity> result;
+	};
+
 	template <typename T>
 	struct TaskResult
 	{
+		TaskResult() = default;
+		TaskResult(TaskSlot* slot, B(*runPendingTask)(V*), V* pool);
+		TaskResult(TaskResult&& other);
+		TaskResult(const TaskResult&) = delete;
+		~TaskResult();
+
+		auto operator=(TaskResult&& other) -> TaskResult&;
+
+		// Helps with the pending tasks of the pool while waiting.
 		auto Retrieve() -> T;
-		Future<T> future;
+
+	private:
+		TaskSlot* slot = nullptr;
+		B(*runPendingTask)(V* pool) = nullptr;
+		V* pool = nullptr;
 	};
 
-	template <typename TTask = Function<V()>>
+	// Type erased callable stored inline so submitting a task never allocates.
+	template <U32 Capacity = 96>
+	class InplaceTask
+	{
+	public:
+		InplaceTask() = default;
+		InplaceTask(const InplaceTask&) = delete;
+
+		template <typename TFunc>
+		auto Emplace(TFunc&& f) -> V;
+
+		// Invokes and destroys the stored callable.
+		auto Run(V* resultStorage) -> V;
+
+	private:
+		alignas(16) StaticArray<Byte, Capacity> storage;
+		V(*invoke)(V* task, V* resultStorage) = nullptr;
+	};
+
+	// Chase-Lev deque of fixed capacity. The owning worker pushes and pops at
+	// the bottom while the other threads steal from the top.
+	template <typename T, U32 Capacity>
+	class WorkStealingDeque
+	{
+	public:
+		auto Push(T* item) -> B;
+		auto Pop() -> T*;
+		auto Steal() -> T*;
+
+	private:
+		static constexpr I64 mask = I64(Capacity) - 1;
+		static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two.");
+
+		alignas(64) Atomic<I64> top = 0;
+		alignas(64) Atomic<I64> bottom = 0;
+		StaticArray<Atomic<T*>, Capacity> items;
+	};
+
+	template <typename TTask = InplaceTask<>>
 	class ThreadPool
 	{
 	public:
 		using Task = TTask;
 
 		ThreadPool(U32 numberOfThreads = GetLogicalCPUCount());
+		~ThreadPool();
 
 		template <typename TFunc, typename... TArgs>
 		auto AddTask(TFunc f, TArgs... args) -> TaskResult<InvokeResult<TFunc, TArgs...>>;
@@ -44,11 +114,46 @@ namespace PA
 		auto ShutDown() -> V;
 
 	private:
+		static constexpr U32 maxJobs = 4096;
+		static constexpr U32 dequeCapacity = 1024;
+		static constexpr U32 noWorker = ~0u;
+		static constexpr U32 spinsBeforeSleep = 64;
+
+		struct Job : TaskSlot
+		{
+			Task task;
+		};
+
+		using JobDeque = WorkStealingDeque<Job, dequeCapacity>;
+
+		auto AcquireJob() -> Job*;
+		auto Submit(Job* job) -> V;
+		auto PopExternal() -> Job*;
+		auto FindJob(U32 workerIdx) -> Job*;
+		auto RunJob(Job* job) -> V;
+		auto WorkerLoop(U32 workerIdx) -> V;
+		static auto RunPendingTask(V* pool) -> B;
+
+		static inline thread_local ThreadPool* currentPool = nullptr;
+		static inline thread_local U32 currentWorker = noWorker;
+
 		Atomic<B> keepRunning = true;
-		Mutex queueMutex;
-		Deque<Task> queue;
+
+		Array<Job> jobs;
+		Atomic<U32> nextJob = 0;
+		Array<JobDeque> deques;
+
+		// Tasks submitted from outside the pool. The lock is only held for a
+		// couple of stores.
+		Atomic<B> externalLock = false;
+		Array<Job*> externalJobs;
+		U32 externalHead = 0;
+		Atomic<U32> externalCount = 0;
+
+		Atomic<U32> epoch = 0;
+		Atomic<U32> sleepingWorkers = 0;
+
 		Array<Thread> threads;
-		Semaphore availableTasks;
 	};
 
 }
@@ -56,43 +161,194 @@ namespace PA
 
 namespace PA
 {
+	template<typename T>
+	inline TaskResult<T>::TaskResult(TaskSlot* slot, B(*runPendingTask)(V*), V* pool) :
+		slot(slot),
+		runPendingTask(runPendingTask),
+		pool(pool)
+	{
+	}
+
+
+	template<typename T>
+	inline TaskResult<T>::TaskResult(TaskResult&& other) :
+		slot(other.slot),
+		runPendingTask(other.runPendingTask),
+		pool(other.pool)
+	{
+		other.slot = nullptr;
+	}
+
+
+	template<typename T>
+	inline TaskResult<T>::~TaskResult()
+	{
+		if (slot)
+		{
+			Retrieve();
+		}
+	}
+
+
+	template<typename T>
+	inline auto TaskResult<T>::operator=(TaskResult&& other) -> TaskResult&
+	{
+		if (this != &other)
+		{
+			if (slot)
+			{
+				Retrieve();
+			}
+			slot = other.slot;
+			runPendingTask = other.runPendingTask;
+			pool = other.pool;
+			other.slot = nullptr;
+		}
+		return *this;
+	}
+
+
 	template<typename T>
 	inline auto TaskResult<T>::Retrieve() -> T
 	{
-		return future.get();
+		while (slot->state.load(std::memory_order_acquire) != ETaskState::Done)
+		{
+			if (!runPendingTask(pool))
+			{
+				slot->state.wait(ETaskState::Pending, std::memory_order_acquire);
+			}
+		}
+
+		auto finished = slot;
+		slot = nullptr;
+
+		if constexpr (IsSameType<T, V>)
+		{
+			finished->state.store(ETaskState::Free, std::memory_order_release);
+		}
+		else
+		{
+			auto resultPtr = (T*)finished->result.data();
+			T result = Move(*resultPtr);
+			resultPtr->~T();
+			finished->state.store(ETaskState::Free, std::memory_order_release);
+			return result;
+		}
+	}
+
+
+	template<U32 Capacity>
+	template<typename TFunc>
+	inline auto InplaceTask<Capacity>::Emplace(TFunc&& f) -> V
+	{
+		using Func = RemoveReference<TFunc>;
+		static_assert(sizeof(Func) <= Capacity && alignof(Func) <= 16, "Task captures too much state to be stored inline.");
+
+		new (storage.data()) Func(Forward<TFunc>(f));
+		invoke =
+		[](V* task, V* resultStorage)
+		{
+			auto func = (Func*)task;
+			(*func)(resultStorage);
+			func->~Func();
+		};
+	}
+
+
+	template<U32 Capacity>
+	inline auto InplaceTask<Capacity>::Run(V* resultStorage) -> V
+	{
+		invoke(storage.data(), resultStorage);
+	}
+
+
+	template<typename T, U32 Capacity>
+	inline auto WorkStealingDeque<T, Capacity>::Push(T* item) -> B
+	{
+		auto b = bottom.load(std::memory_order_relaxed);
+		auto t = top.load(std::memory_order_acquire);
+		if (b - t > mask)
+		{
+			return false;
+		}
+
+		items[b & mask].store(item, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom.store(b + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+
+	template<typename T, U32 Capacity>
+	inline auto WorkStealingDeque<T, Capacity>::Pop() -> T*
+	{
+		auto b = bottom.load(std::memory_order_relaxed) - 1;
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		auto t = top.load(std::memory_order_relaxed);
+
+		if (t > b)
+		{
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		auto item = items[b & mask].load(std::memory_order_relaxed);
+		if (t == b)
+		{
+			// Last item, race the thieves for it.
+			if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			{
+				item = nullptr;
+			}
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+		return item;
+	}
+
+
+	template<typename T, U32 Capacity>
+	inline auto WorkStealingDeque<T, Capacity>::Steal() -> T*
+	{
+		auto t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		auto b = bottom.load(std::memory_order_acquire);
+
+		if (t >= b)
+		{
+			return nullptr;
+		}
+
+		auto item = items[t & mask].load(std::memory_order_relaxed);
+		if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		{
+			return nullptr;
+		}
+		return item;
 	}
 
 
 	template<typename TTask>
 	inline ThreadPool<TTask>::ThreadPool(U32 numberOfThreads) :
-		availableTasks(0)
+		jobs(maxJobs),
+		deques(numberOfThreads),
+		externalJobs(maxJobs)
 	{
 		for (auto i = 0u; i < numberOfThreads; ++i)
 		{
-			threads.emplace_back
-			(
-				[&]()
-				{
-					while (keepRunning)
-					{
-						availableTasks.acquire();
-						if (!keepRunning)
-						{
-							break;
-						}
-						queueMutex.lock();
-						auto front = queue.front();
-						queue.pop_front();
-						queueMutex.unlock();
-
-						Invoke<Task>(Move(front));
-					}
-				}
-			);
+			threads.emplace_back([this, i]() { WorkerLoop(i); });
 		}
 	}
 
 
+	template<typename TTask>
+	inline ThreadPool<TTask>::~ThreadPool()
+	{
+		ShutDown();
+		threads.clear();
+	}
+
+
 	template<typename TTask>
 	inline auto ThreadPool<TTask>::GetMaxTasks() -> U32
 	{
@@ -103,7 +359,8 @@ namespace PA
 	inline auto ThreadPool<TTask>::ShutDown() -> V
 	{
 		keepRunning = false;
-		availableTasks.release(threads.size());
+		epoch.fetch_add(1);
+		epoch.notify_all();
 	}
 
 
@@ -112,29 +369,193 @@ namespace PA
 	inline auto ThreadPool<TTask>::AddTask(TFunc f, TArgs... args) -> TaskResult<InvokeResult<TFunc, TArgs...>>
 	{
 		using Result = InvokeResult<TFunc, TArgs...>;
-		
-		TaskResult<Result> result;
+		using StoredResult = Conditional<IsSameType<Result, V>, Byte, Result>;
+		static_assert
+		(
+			sizeof(StoredResult) <= TaskSlot::resultCapacity && alignof(StoredResult) <= 16,
+			"Task result does not fit in the task slot."
+		);
 
-		queueMutex.lock();
-		auto promise = MakeShared<Promise<Result>>();
-		result.future = promise->get_future();
-		queue.emplace_back
+		auto job = AcquireJob();
+		job->task.Emplace
 		(
-			[promiseL = promise, fL = Move(f), ... argsL = Move(args)]()
+			[fL = Move(f), ... argsL = Move(args)](V* resultStorage) mutable
 			{
 				if constexpr (IsSameType<Result, V>)
 				{
 					fL(argsL...);
-					promiseL->set_value();
 				}
 				else
 				{
-					promiseL->set_value(fL(argsL...));
+					new (resultStorage) Result(fL(argsL...));
 				}
 			}
 		);
-		queueMutex.unlock();
-		availableTasks.release();
-		return result;
+		Submit(job);
+
+		return TaskResult<Result>(job, RunPendingTask, this);
+	}
+
+
+	template<typename TTask>
+	inline auto ThreadPool<TTask>::AcquireJob() -> Job*
+	{
+		while (true)
+		{
+			for (auto attempt = 0u; attempt < maxJobs; ++attempt)
+			{
+				auto& job = jobs[nextJob.fetch_add(1, std::memory_order_relaxed) & (maxJobs - 1)];
+				auto expected = ETaskState::Free;
+				if (job.state.compare_exchange_strong(expected, ETaskState::Pending, std::memory_order_acquire, std::memory_order_relaxed))
+				{
+					return &job;
+				}
+			}
+
+			// Every slot is in flight, help with the backlog until one frees up.
+			if (!RunPendingTask(this))
+			{
+				std::this_thread::yield();
+			}
+		}
+	}
+
+
+	template<typename TTask>
+	inline auto ThreadPool<TTask>::Submit(Job* job) -> V
+	{
+		if (currentPool != this || !deques[currentWorker].Push(job))
+		{
+			while (externalLock.exchange(true, std::memory_order_acquire))
+			{
+				while (externalLock.load(std::memory_order_relaxed))
+				{
+					std::this_thread::yield();
+				}
+			}
+			auto count = externalCount.load(std::memory_order_relaxed);
+			externalJobs[(externalHead + count) & (maxJobs - 1)] = job;
+			externalCount.store(count + 1, std::memory_order_relaxed);
+			externalLock.store(false, std::memory_order_release);
+		}
+
+		epoch.fetch_add(1);
+		if (sleepingWorkers.load())
+		{
+			epoch.notify_one();
+		}
+	}
+
+
+	template<typename TTask>
+	inline auto ThreadPool<TTask>::PopExternal() -> Job*
+	{
+		if (!externalCount.load(std::memory_order_relaxed))
+		{
+			return nullptr;
+		}
+
+		while (externalLock.exchange(true, std::memory_order_acquire))
+		{
+			while (externalLock.load(std::memory_order_relaxed))
+			{
+				std::this_thread::yield();
+			}
+		}
+
+		Job* job = nullptr;
+		auto count = externalCount.load(std::memory_order_relaxed);
+		if (count)
+		{
+			job = externalJobs[externalHead];
+			externalHead = (externalHead + 1) & (maxJobs - 1);
+			externalCount.store(count - 1, std::memory_order_relaxed);
+		}
+		externalLock.store(false, std::memory_order_release);
+		return job;
 	}
-}
\ No newline at end of file
+
+
+	template<typename TTask>
+	inline auto ThreadPool<TTask>::FindJob(U32 workerIdx) -> Job*
+	{
+		if (workerIdx != noWorker)
+		{
+			if (auto job = deques[workerIdx].Pop())
+			{
+				return job;
+			}
+		}
+
+		if (auto job = PopExternal())
+		{
+			return job;
+		}
+
+		auto first = workerIdx == noWorker ? 0u : workerIdx + 1;
+		for (auto i = 0u; i < deques.size(); ++i)
+		{
+			if (auto job = deques[(first + i) % deques.size()].Steal())
+			{
+				return job;
+			}
+		}
+
+		return nullptr;
+	}
+
+
+	template<typename TTask>
+	inline auto ThreadPool<TTask>::RunJob(Job* job) -> V
+	{
+		job->task.Run(job->result.data());
+		job->state.store(ETaskState::Done, std::memory_order_release);
+		job->state.notify_all();
+	}
+
+
+	template<typename TTask>
+	inline auto ThreadPool<TTask>::RunPendingTask(V* pool) -> B
+	{
+		auto self = (ThreadPool*)pool;
+		auto job = self->FindJob(currentPool == self ? currentWorker : noWorker);
+		if (!job)
+		{
+			return false;
+		}
+
+		self->RunJob(job);
+		return true;
+	}
+
+
+	template<typename TTask>
+	inline auto ThreadPool<TTask>::WorkerLoop(U32 workerIdx) -> V
+	{
+		currentPool = this;
+		currentWorker = workerIdx;
+
+		auto spins = 0u;
+		while (keepRunning)
+		{
+			auto epochSeen = epoch.load();
+			if (auto job = FindJob(workerIdx))
+			{
+				RunJob(job);
+				spins = 0;
+				continue;
+			}
+
+			if (++spins < spinsBeforeSleep)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+
+			sleepingWorkers.fetch_add(1);
+			epoch.wait(epochSeen);
+			sleepingWorkers.fetch_sub(1);
+			spins = 0;
+		}
+	}
+}
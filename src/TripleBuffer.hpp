@@ -0,0 +1,97 @@
+// Copyright 2024 Mihail Mladenov
+//
+// This file is part of PencilAnnealing.
+//
+// PencilAnnealing is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PencilAnnealing is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PencilAnnealing.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "Types.hpp"
+
+namespace PA
+{
+	// Hands the latest value from one writer thread to one reader thread
+	// without either side ever waiting. The writer fills the back buffer and
+	// publishes it, the reader acquires the most recently published buffer.
+	// Values published while the reader was busy are skipped.
+	template <typename T>
+	class TripleBuffer
+	{
+	public:
+		TripleBuffer() = default;
+		TripleBuffer(const T& init);
+
+		// Writer side.
+		auto GetBack() -> T&;
+		auto Publish() -> V;
+
+		// Reader side. Returns false and keeps the front buffer when nothing
+		// was published since the last call.
+		auto Acquire() -> B;
+		auto GetFront() const -> const T&;
+
+	private:
+		static constexpr U32 indexMask = 3;
+		static constexpr U32 freshBit = 4;
+
+		StaticArray<T, 3> buffers;
+		U32 back = 0;
+		alignas(64) Atomic<U32> middle = 1;
+		alignas(64) U32 front = 2;
+	};
+}
+
+
+namespace PA
+{
+	template<typename T>
+	inline TripleBuffer<T>::TripleBuffer(const T& init) :
+		buffers{ init, init, init }
+	{
+	}
+
+
+	template<typename T>
+	inline auto TripleBuffer<T>::GetBack() -> T&
+	{
+		return buffers[back];
+	}
+
+
+	template<typename T>
+	inline auto TripleBuffer<T>::Publish() -> V
+	{
+		back = middle.exchange(back | freshBit, std::memory_order_acq_rel) & indexMask;
+	}
+
+
+	template<typename T>
+	inline auto TripleBuffer<T>::Acquire() -> B
+	{
+		if (!(middle.load(std::memory_order_relaxed) & freshBit))
+		{
+			return false;
+		}
+
+		front = middle.exchange(front, std::memory_order_acq_rel) & indexMask;
+		return true;
+	}
+
+
+	template<typename T>
+	inline auto TripleBuffer<T>::GetFront() const -> const T&
+	{
+		return buffers[front];
+	}
+}
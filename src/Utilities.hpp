@@ -39,6 +39,9 @@ namespace PA
 
 	template <typename TFrom, typename TTo>
 	inline auto MemCopy(Span<const TFrom> from, TTo* to) -> V;
+	// Like MemCopy, but the ranges may overlap.
+	template <typename TFrom, typename TTo>
+	inline auto MemMove(Span<const TFrom> from, TTo* to) -> V;
 	
 	template <typename T>
 		requires CIsArithmetic<T>
@@ -59,6 +62,32 @@ namespace PA
 	inline auto LebesgueCurve(U16 x, U16 y) -> U32;
 	inline auto LebesgueCurveInverse(U32 n) -> Pair<U16, U16>;
 
+	// Lebesgue ordered images are converted from and to linear buffers in
+	// square blocks, each of which is contiguous on the lebesgue side. The
+	// lebesgue side has to be padded to a multiple of the block side.
+	inline constexpr U32 CLebesgueBlockSide = 8;
+	inline constexpr U32 CLebesgueBlockSize = CLebesgueBlockSide * CLebesgueBlockSide;
+
+	// Writes the rows [rowBegin, rowEnd) of a lebesgue ordered image, width
+	// pixels wide, to a linear buffer with outStride elements per row.
+	// convert(const TIn* in, TOut* out, U32 count) is called on whole blocks.
+	// rowBegin has to be a multiple of CLebesgueBlockSide, so disjoint row
+	// ranges can be converted concurrently.
+	template <typename TIn, typename TOut, typename TConvert>
+	inline auto LebesgueToLinear(const TIn* in, TOut* out, U32 outStride, U32 width, U32 rowBegin, U32 rowEnd, TConvert&& convert) -> V;
+
+	// Writes a width x height linear image with inStride elements per row to a
+	// lebesgue ordered buffer. Pixels outside the image are left untouched.
+	template <typename TIn, typename TOut, typename TConvert>
+	inline auto LinearToLebesgue(const TIn* in, U32 inStride, TOut* out, U32 width, U32 height, TConvert&& convert) -> V;
+
+	// Calls func(U32 begin, U32 end) on the contiguous lebesgue ranges that
+	// cover a width x height image, in increasing order. Tiles made only of
+	// padding are skipped, tiles at the border are covered in whole blocks
+	// of CLebesgueBlockSize, so ranges may include some padding.
+	template <typename TFunc>
+	inline auto ForEachLebesgueRange(U32 width, U32 height, TFunc&& func) -> V;
+
 	template <typename T>
 	inline auto FromLE(T x) -> T;
 	template <typename T>
@@ -67,6 +96,7 @@ namespace PA
 	template <typename TWord = U64>
 	class DynamicBitsetBase
 	{
+		static constexpr U32 bitsPerWord = sizeof(TWord) * 8;
 		Array<TWord> data;
 
 	public:
@@ -119,6 +149,13 @@ namespace PA
 	}
 
 
+	template<typename TFrom, typename TTo>
+	auto MemMove(Span<const TFrom> from, TTo* to) -> V
+	{
+		std::memmove((V*)to, (const V*)from.data(), from.size() * sizeof(TFrom));
+	}
+
+
 	template<typename T>
 		requires CIsArithmetic<T>
 	inline auto ClampedU8(T v) -> U8
@@ -198,6 +235,163 @@ namespace PA
 		return result;
 	}
 
+
+	// Offset inside a lebesgue block of every pixel pair starting on an even
+	// column, row by row. Each pair is contiguous on both sides.
+	inline constexpr auto CLebesgueBlockPairs =
+		[]()
+		{
+			StaticArray<StaticArray<U8, CLebesgueBlockSide / 2>, CLebesgueBlockSide> pairs = {};
+			for (auto y = 0u; y < CLebesgueBlockSide; ++y)
+			{
+				for (auto p = 0u; p < CLebesgueBlockSide / 2; ++p)
+				{
+					auto offset = 0u;
+					for (auto bit = 0u; (1u << bit) < CLebesgueBlockSide; ++bit)
+					{
+						offset |= ((2 * p >> bit) & 1u) << (2 * bit);
+						offset |= ((y >> bit) & 1u) << (2 * bit + 1);
+					}
+					pairs[y][p] = U8(offset);
+				}
+			}
+			return pairs;
+		}();
+
+
+	template<typename TIn, typename TOut, typename TConvert>
+	inline auto LebesgueToLinear(const TIn* in, TOut* out, U32 outStride, U32 width, U32 rowBegin, U32 rowEnd, TConvert&& convert) -> V
+	{
+		static constexpr auto side = CLebesgueBlockSide;
+		StaticArray<TOut, CLebesgueBlockSize> block;
+
+		for (auto by = rowBegin; by < rowEnd; by += side)
+		{
+			auto rows = Min(side, rowEnd - by);
+			for (auto bx = 0u; bx < width; bx += side)
+			{
+				auto columns = Min(side, width - bx);
+				convert(in + LebesgueCurve(bx, by), block.data(), CLebesgueBlockSize);
+
+				for (auto y = 0u; y < rows; ++y)
+				{
+					auto outRow = out + U64(by + y) * outStride + bx;
+					const auto& pairs = CLebesgueBlockPairs[y];
+					if (columns == side)
+					{
+						for (auto p = 0u; p < side / 2; ++p)
+						{
+							outRow[2 * p] = block[pairs[p]];
+							outRow[2 * p + 1] = block[pairs[p] + 1];
+						}
+					}
+					else
+					{
+						for (auto x = 0u; x < columns; ++x)
+						{
+							outRow[x] = block[pairs[x / 2] + x % 2];
+						}
+					}
+				}
+			}
+		}
+	}
+
+
+	template<typename TFunc>
+	inline auto ForEachLebesgueRange(U32 width, U32 height, TFunc&& func) -> V
+	{
+		U32 rangeBegin = 0;
+		U32 rangeEnd = 0;
+
+		// Adjacent tiles are merged into a single call.
+		auto emit =
+			[&](U32 begin, U32 end)
+			{
+				if (begin != rangeEnd)
+				{
+					if (rangeBegin != rangeEnd)
+					{
+						func(rangeBegin, rangeEnd);
+					}
+					rangeBegin = begin;
+				}
+				rangeEnd = end;
+			};
+
+		auto visit =
+			[&](auto& self, U32 x, U32 y, U32 side) -> V
+			{
+				if (x >= width || y >= height)
+				{
+					return;
+				}
+
+				auto begin = LebesgueCurve(U16(x), U16(y));
+				if ((x + side <= width && y + side <= height) || side <= CLebesgueBlockSide)
+				{
+					emit(begin, begin + side * side);
+					return;
+				}
+
+				auto half = side / 2;
+				self(self, x, y, half);
+				self(self, x + half, y, half);
+				self(self, x, y + half, half);
+				self(self, x + half, y + half, half);
+			};
+
+		visit(visit, 0, 0, Max(RoundToPowerOfTwo(Max(width, height)), CLebesgueBlockSide));
+		if (rangeBegin != rangeEnd)
+		{
+			func(rangeBegin, rangeEnd);
+		}
+	}
+
+
+	template<typename TIn, typename TOut, typename TConvert>
+	inline auto LinearToLebesgue(const TIn* in, U32 inStride, TOut* out, U32 width, U32 height, TConvert&& convert) -> V
+	{
+		static constexpr auto side = CLebesgueBlockSide;
+		StaticArray<TIn, CLebesgueBlockSize> block;
+
+		for (auto by = 0u; by < height; by += side)
+		{
+			auto rows = Min(side, height - by);
+			for (auto bx = 0u; bx < width; bx += side)
+			{
+				auto columns = Min(side, width - bx);
+				auto outBlock = out + LebesgueCurve(bx, by);
+
+				if (rows == side && columns == side)
+				{
+					for (auto y = 0u; y < side; ++y)
+					{
+						auto inRow = in + U64(by + y) * inStride + bx;
+						const auto& pairs = CLebesgueBlockPairs[y];
+						for (auto p = 0u; p < side / 2; ++p)
+						{
+							block[pairs[p]] = inRow[2 * p];
+							block[pairs[p] + 1] = inRow[2 * p + 1];
+						}
+					}
+					convert(block.data(), outBlock, CLebesgueBlockSize);
+					continue;
+				}
+
+				for (auto y = 0u; y < rows; ++y)
+				{
+					auto inRow = in + U64(by + y) * inStride + bx;
+					const auto& pairs = CLebesgueBlockPairs[y];
+					for (auto x = 0u; x < columns; ++x)
+					{
+						convert(inRow + x, outBlock + pairs[x / 2] + x % 2, 1);
+					}
+				}
+			}
+		}
+	}
+
 	template <typename T>
 	auto ByteSwap(T x) -> T
 	{
@@ -291,7 +485,7 @@ namespace PA
 	template<typename TWord>
 	inline auto DynamicBitsetBase<TWord>::Expand(U32 size) -> V
 	{
-		auto minSize = (size + sizeof(TWord) - 1) / sizeof(TWord);
+		auto minSize = (size + bitsPerWord - 1) / bitsPerWord;
 
 		if (data.size() < minSize)
 		{
@@ -302,8 +496,8 @@ namespace PA
 	template<typename TWord>
 	inline auto DynamicBitsetBase<TWord>::SetBitUnsafe(U32 idx) -> V
 	{
-		auto wordIdx = idx / sizeof(TWord);
-		auto bitIdx = idx % sizeof(TWord);
+		auto wordIdx = idx / bitsPerWord;
+		auto bitIdx = idx % bitsPerWord;
 
 		data[wordIdx] |= TWord(1) << bitIdx;
 	}
@@ -312,8 +506,8 @@ namespace PA
 	template<typename TWord>
 	inline auto DynamicBitsetBase<TWord>::ClearBitUnsafe(U32 idx) -> V
 	{
-		auto wordIdx = idx / sizeof(TWord);
-		auto bitIdx = idx % sizeof(TWord);
+		auto wordIdx = idx / bitsPerWord;
+		auto bitIdx = idx % bitsPerWord;
 
 		data[wordIdx] &= ~(TWord(1) << bitIdx);
 	}
@@ -322,9 +516,9 @@ namespace PA
 	template<typename TWord>
 	inline auto DynamicBitsetBase<TWord>::GetBitUnsafe(U32 idx) -> B
 	{
-		auto wordIdx = idx / sizeof(TWord);
-		auto bitIdx = idx % sizeof(TWord);
+		auto wordIdx = idx / bitsPerWord;
+		auto bitIdx = idx % bitsPerWord;
 
-		return B(data[wordIdx] & (~(TWord(1) << bitIdx)));
+		return B(data[wordIdx] & (TWord(1) << bitIdx));
 	}
 }
\ No newline at end of file
@@ -24,6 +24,7 @@
 #include "Logging.hpp"
 #include "File.hpp"
 #include "Random.hpp"
+#include "SIMD.hpp"
 
 #include <ogg/ogg.h>
 #include <theora/theoraenc.h>
@@ -47,11 +48,30 @@ namespace PA
 			B logErrors = true;
 		};
 
+		// Padded 4:2:0 planes in the layout the encoder consumes. Frames are
+		// reused across calls so only the planes that change are written.
+		struct Frame
+		{
+			Array<Byte> yData;
+			Array<Byte> cbData;
+			Array<Byte> crData;
+		};
+
 		VideoEncoder(const Config& cfg = Config());
 		~VideoEncoder();
 		auto EncodeRGBA8Linear(const LockedTexture& in, B lastFrame = false) -> V;
+		// Converts only the changed region, the rest is kept from the
+		// previous RGBA8 frame. The region has to start on even coordinates.
+		auto EncodeRGBA8Linear(const LockedTexture& in, const Extent& changed, B lastFrame = false) -> V;
 		auto EncodeA32Float(const RawCPUImage& img, B lastFrame = false) -> V;
-		auto EncodeYCbCr(Array<Byte>& yData, Array<Byte> cbData, Array<Byte> crData, B lastFrame = false) -> V;
+		// Black luma and neutral chroma, so grayscale frames never write chroma.
+		auto AllocateFrame() const -> Frame;
+		// Writes the luma of rows [rowBegin, rowEnd) of a lebesgue ordered
+		// A32Float image. rowBegin has to be a multiple of CLebesgueBlockSide;
+		// such ranges can be converted concurrently.
+		auto ConvertA32Float(const RawCPUImage& img, Frame& frame, U32 rowBegin, U32 rowEnd) const -> V;
+		auto EncodeFrame(Frame& frame, B lastFrame = false) -> V;
+		auto EncodeYCbCr(Array<Byte>& yData, Array<Byte>& cbData, Array<Byte>& crData, B lastFrame = false) -> V;
 		auto FlushCacheToDisk() -> V;
 
 	private:
@@ -64,7 +84,13 @@ namespace PA
 		th_info theoraInfo;
 
 		Array<Byte> cache;
+		Frame grayFrame;
+		Frame colorFrame;
 	};
+
+	// BT.601 studio swing luma of gray values in [0, 1]. Matches
+	// RGBAToYCbCrABT601 applied to the gray quantized to U8.
+	inline auto GrayscaleToLumaBT601(const F32* in, Byte* out, U32 count) -> V;
 }
 
 
@@ -73,6 +99,7 @@ namespace PA
 	inline VideoEncoder::VideoEncoder(const Config& config):
 		cfg(config)
 	{
+		cache.reserve(cfg.cacheBufferMaxSize);
 		ogg_stream_init(&oggStream, (I32)GetUniformU32(0u, ~0u));
 		th_info_init(&theoraInfo);
 		// The output frames need to be divisible by 16;
@@ -154,61 +181,98 @@ namespace PA
 
 	inline auto VideoEncoder::EncodeRGBA8Linear(const LockedTexture& img, B lastFrame) -> V
 	{
+		EncodeRGBA8Linear(img, { 0, 0, 0, img.width, img.height, 1 }, lastFrame);
+	}
+
+
+	inline auto VideoEncoder::EncodeRGBA8Linear(const LockedTexture& img, const Extent& changed, B lastFrame) -> V
+	{
+		PA_ASSERT(changed.x % 2 == 0 && changed.y % 2 == 0);
+
+		if (colorFrame.yData.empty())
+		{
+			colorFrame = AllocateFrame();
+		}
+
 		auto paddedWidth = theoraInfo.frame_width;
-		auto paddedHeight = theoraInfo.frame_height;
-		auto paddedSize = paddedWidth * paddedHeight;
-		Array<Byte> yData(paddedSize);
-		Array<Byte> cbData(paddedSize / 4);
-		Array<Byte> crData(paddedSize / 4);
+		auto xEnd = Min(img.width, changed.x + changed.w);
+		auto yEnd = Min(img.height, changed.y + changed.h);
 
+		// Chroma is the rounded average of each 2x2 block.
 		auto inPtr = (const ColorU32*)img.data;
-		for (auto y = 0; y < img.height; ++y)
+		for (auto y = changed.y; y < yEnd; y += 2)
 		{
-			for (auto x = 0; x < img.width; ++x)
+			for (auto x = changed.x; x < xEnd; x += 2)
 			{
-				auto idx = y * img.stride / 4 + x;
-				auto inColor = RGBAToYCbCrABT601(inPtr[idx]);
-				yData[y * paddedWidth + x] = inColor.y;
-				cbData[y / 2 * paddedWidth / 2 + x / 2] = inColor.cb;
-				crData[y / 2 * paddedWidth / 2 + x / 2] = inColor.cr;
+				U32 cbSum = 0;
+				U32 crSum = 0;
+				U32 count = 0;
+				for (auto dy = 0u; dy < 2 && y + dy < img.height; ++dy)
+				{
+					for (auto dx = 0u; dx < 2 && x + dx < img.width; ++dx)
+					{
+						auto idx = (y + dy) * img.stride / 4 + x + dx;
+						auto inColor = RGBAToYCbCrABT601(inPtr[idx]);
+						colorFrame.yData[(y + dy) * paddedWidth + x + dx] = inColor.y;
+						cbSum += inColor.cb;
+						crSum += inColor.cr;
+						count++;
+					}
+				}
+				colorFrame.cbData[y / 2 * paddedWidth / 2 + x / 2] = Byte((cbSum + count / 2) / count);
+				colorFrame.crData[y / 2 * paddedWidth / 2 + x / 2] = Byte((crSum + count / 2) / count);
 			}
 		}
 
-		EncodeYCbCr(yData, cbData, crData, lastFrame);
+		EncodeFrame(colorFrame, lastFrame);
 	}
 
 
 	inline auto VideoEncoder::EncodeA32Float(const RawCPUImage& img, B lastFrame) -> V
+	{
+		if (grayFrame.yData.empty())
+		{
+			grayFrame = AllocateFrame();
+		}
+
+		ConvertA32Float(img, grayFrame, 0, img.height);
+		EncodeFrame(grayFrame, lastFrame);
+	}
+
+
+	inline auto VideoEncoder::AllocateFrame() const -> Frame
+	{
+		auto paddedSize = theoraInfo.frame_width * theoraInfo.frame_height;
+		return { Array<Byte>(paddedSize, 0), Array<Byte>(paddedSize / 4, 128), Array<Byte>(paddedSize / 4, 128) };
+	}
+
+
+	inline auto VideoEncoder::ConvertA32Float(const RawCPUImage& img, Frame& frame, U32 rowBegin, U32 rowEnd) const -> V
 	{
 		PA_ASSERT(img.lebesgueOrdered);
 		PA_ASSERT(img.format == EFormat::A32Float);
+		PA_ASSERT(rowBegin % CLebesgueBlockSide == 0);
+
+		LebesgueToLinear
+		(
+			(const F32*)img.data.data(),
+			frame.yData.data(),
+			theoraInfo.frame_width,
+			img.width,
+			rowBegin,
+			rowEnd,
+			GrayscaleToLumaBT601
+		);
+	}
 
-		auto paddedWidth = theoraInfo.frame_width;
-		auto paddedHeight = theoraInfo.frame_height;
-		auto paddedSize = paddedWidth * paddedHeight;
-		Array<Byte> yData(paddedSize);
-		Array<Byte> cbData(paddedSize / 4);
-		Array<Byte> crData(paddedSize / 4);
-
-		auto inPtr = (const F32*) img.data.data();
-		for (auto y = 0; y < img.height; ++y)
-		{
-			for (auto x = 0; x < img.width; ++x)
-			{
-				auto i = LebesgueCurve(x, y);
-				auto inGray = ClampedU8(inPtr[i] * 255);
-				auto inColor = RGBAToYCbCrABT601(ColorU32(inGray, inGray, inGray, 255u));
-				yData[y * paddedWidth + x] = inColor.y;
-				cbData[y / 2 * paddedWidth / 2 + x / 2] = inColor.cb;
-				crData[y / 2 * paddedWidth / 2 + x / 2] = inColor.cr;
-			}
-		}
 
-		EncodeYCbCr(yData, cbData, crData, lastFrame);
+	inline auto VideoEncoder::EncodeFrame(Frame& frame, B lastFrame) -> V
+	{
+		EncodeYCbCr(frame.yData, frame.cbData, frame.crData, lastFrame);
 	}
 
 
-	inline auto VideoEncoder::EncodeYCbCr(Array<Byte>& yData, Array<Byte> cbData, Array<Byte> crData, B lastFrame) -> V
+	inline auto VideoEncoder::EncodeYCbCr(Array<Byte>& yData, Array<Byte>& cbData, Array<Byte>& crData, B lastFrame) -> V
 	{
 		auto paddedWidth = theoraInfo.frame_width;
 		auto paddedHeight = theoraInfo.frame_height;
@@ -266,4 +330,26 @@ namespace PA
 		cache.resize(cache.size() + inData.size());
 		MemCopy(inData, cache.data() + oldSize);
 	}
+
+
+	inline auto GrayscaleToLumaBT601(const F32* in, Byte* out, U32 count) -> V
+	{
+		const auto zero = F32xN::Broadcast(0.f);
+		const auto maxGray = F32xN::Broadcast(255.f);
+		const auto minLuma = F32xN::Broadcast(16.f);
+		const auto maxLuma = F32xN::Broadcast(235.f);
+		const auto rWeight = F32xN::Broadcast(0.2567f);
+		const auto gWeight = F32xN::Broadcast(0.5041f);
+		const auto bWeight = F32xN::Broadcast(0.0980f);
+
+		PA_ASSERT(count % F32xN::width == 0);
+
+		for (auto i = 0u; i < count; i += F32xN::width)
+		{
+			auto gray = Truncate(Max(Min(F32xN::Load(in + i) * maxGray, maxGray), zero));
+			// Same association as the scalar conversion so the results match exactly.
+			auto luma = minLuma + rWeight * gray + gWeight * gray + bWeight * gray;
+			Min(Max(luma, minLuma), maxLuma).StoreU8(out + i);
+		}
+	}
 }
\ No newline at end of file
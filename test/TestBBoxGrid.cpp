@@ -0,0 +1,126 @@
+// Copyright 2024 Mihail Mladenov
+//
+// This file is part of PencilAnnealing.
+//
+// PencilAnnealing is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PencilAnnealing is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PencilAnnealing.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Error.hpp"
+#include "Logging.hpp"
+#include "Random.hpp"
+#include "BBoxGrid.hpp"
+
+using namespace PA;
+
+using BBox2 = BBox<F32, 2>;
+using Vec = BBoxGrid<F32>::Vec;
+
+// Boxes reach a little past the unit square to cover the border cells.
+auto GetRandomBBox() -> BBox2
+{
+	auto x = GetUniformFloat(-0.1f, 1.1f);
+	auto y = GetUniformFloat(-0.1f, 1.1f);
+	return BBox2(Vec(x, y), Vec(x + GetUniformFloat(0.f, 0.3f), y + GetUniformFloat(0.f, 0.3f)));
+}
+
+
+// Checks queries against a scan of all the boxes present.
+auto Check(const BBoxGrid<F32>& grid, const Array<BBox2>& bBoxes, const Array<B>& present) -> V
+{
+	Array<U32> keys;
+	for (auto q = 0u; q < 64; ++q)
+	{
+		auto region = GetRandomBBox();
+		keys.clear();
+		grid.Query(region, keys);
+		Sort(keys, [](U32 k0, U32 k1) { return k0 < k1; });
+
+		Array<U32> expected;
+		for (auto key = 0u; key < bBoxes.size(); ++key)
+		{
+			if (present[key] && bBoxes[key].Intersects(region))
+			{
+				expected.push_back(key);
+			}
+		}
+
+		if (keys != expected)
+		{
+			LogError("Query returned ", keys.size(), " boxes instead of ", expected.size(), ".");
+			Terminate();
+		}
+	}
+}
+
+
+I32 main()
+{
+	// Boxes crossing each other overlap without containing a corner.
+	if (!BBox2(Vec(0.4f, 0.f), Vec(0.6f, 1.f)).Intersects(BBox2(Vec(0.f, 0.4f), Vec(1.f, 0.6f))))
+	{
+		LogError("Crossing boxes do not intersect.");
+		Terminate();
+	}
+
+	static constexpr U32 count = 500;
+
+	BBoxGrid<F32> grid(16);
+	Array<BBox2> bBoxes(count, BBox2(Vec(0), Vec(0)));
+	Array<B> present(count, false);
+
+	for (auto key = 0u; key < count; ++key)
+	{
+		bBoxes[key] = GetRandomBBox();
+		grid.Add(key, bBoxes[key]);
+		present[key] = true;
+	}
+	if (grid.Size() != count)
+	{
+		LogError("Grid holds ", grid.Size(), " boxes instead of ", count, ".");
+		Terminate();
+	}
+	Check(grid, bBoxes, present);
+
+	for (auto i = 0u; i < 4 * count; ++i)
+	{
+		auto key = GetUniformU32(0, count - 1);
+		if (present[key] && GetUniformU32(0, 1))
+		{
+			grid.Remove(key);
+			present[key] = false;
+		}
+		else
+		{
+			bBoxes[key] = GetRandomBBox();
+			grid.Update(key, bBoxes[key]);
+			present[key] = true;
+		}
+		if (grid.Contains(key) != present[key])
+		{
+			LogError("Presence of box ", key, " is wrong.");
+			Terminate();
+		}
+	}
+	Check(grid, bBoxes, present);
+
+	grid.Clear();
+	if (grid.Size() != 0)
+	{
+		LogError("Cleared grid still holds ", grid.Size(), " boxes.");
+		Terminate();
+	}
+	Fill(present, false);
+	Check(grid, bBoxes, present);
+
+	return 0;
+}
@@ -0,0 +1,191 @@
+// Copyright 2024 Mihail Mladenov
+//
+// This file is part of PencilAnnealing.
+//
+// PencilAnnealing is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PencilAnnealing is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PencilAnnealing.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "Random.hpp"
+#include "Checkpoint.hpp"
+#include "File.hpp"
+
+using namespace PA;
+
+I32 main()
+{
+	static constexpr StrView checkpointFile = "TestCheckpoint.pa"sv;
+
+	Array<QuadraticBezier<F32, 2>> strokes;
+	Array<F32> widths;
+	Array<F32> pigments;
+	Array<Array<Fragment>> fragmentsMap;
+	for (auto i = 0u; i < 100; ++i)
+	{
+		strokes.push_back(GetRandom2DQuadraticBezierInRange(1.f));
+		widths.push_back(GetUniformFloat(1.f, 3.f));
+		pigments.push_back(GetUniformFloat(0.f, 1.f));
+		fragmentsMap.emplace_back();
+		RasterizeToFragments(strokes.back(), fragmentsMap.back(), 256, 256, pigments.back(), widths.back());
+	}
+
+	Array<U64> fragmentOffsets;
+	Array<Fragment> fragments;
+	for (auto& strokeFragments : fragmentsMap)
+	{
+		fragmentOffsets.push_back(fragments.size());
+		fragments.insert(fragments.end(), strokeFragments.begin(), strokeFragments.end());
+	}
+	fragmentOffsets.push_back(fragments.size());
+
+	CheckpointState<F32> state;
+	state.maxSteps = 1000;
+	state.maxStrokes = 200;
+	state.maxWidth = 3.f;
+	state.step = 123;
+	state.width = 640;
+	state.height = 480;
+	state.maxTemperature = 255.f * 255.f;
+	state.temperature = 17.f;
+	state.optimalEnergy = 0.5f;
+
+	Array<Byte> outBuffer;
+	SerializeCheckpoint
+	(
+		outBuffer,
+		state,
+		Span<const QuadraticBezier<F32, 2>>(strokes),
+		Span<const F32>(widths),
+		Span<const F32>(pigments),
+		Span<const U64>(fragmentOffsets),
+		Span<const Fragment>(fragments)
+	);
+	if (!WriteWholeFile(checkpointFile, outBuffer))
+	{
+		LogError("Failed to write the checkpoint.");
+		Terminate();
+	}
+
+	{
+		MappedFile file;
+		CheckpointView<F32> view;
+		if (!file.Open(checkpointFile) || !OpenCheckpoint(file.GetData(), view))
+		{
+			LogError("Failed to open the checkpoint.");
+			Terminate();
+		}
+
+		if
+		(
+			view.state.step != state.step ||
+			view.state.width != state.width ||
+			view.state.height != state.height ||
+			view.state.temperature != state.temperature
+		)
+		{
+			LogError("State does not round trip.");
+			Terminate();
+		}
+		if (view.strokes.size() != strokes.size())
+		{
+			LogError("Checkpoint holds ", view.strokes.size(), " strokes instead of ", strokes.size(), ".");
+			Terminate();
+		}
+		if (memcmp(view.strokes.data(), strokes.data(), strokes.size() * sizeof(QuadraticBezier<F32, 2>)))
+		{
+			LogError("Strokes do not round trip.");
+			Terminate();
+		}
+		if (memcmp(view.widths.data(), widths.data(), widths.size() * sizeof(F32)))
+		{
+			LogError("Widths do not round trip.");
+			Terminate();
+		}
+		if (memcmp(view.pigments.data(), pigments.data(), pigments.size() * sizeof(F32)))
+		{
+			LogError("Pigments do not round trip.");
+			Terminate();
+		}
+
+		for (auto i = 0u; i < fragmentsMap.size(); ++i)
+		{
+			auto first = view.fragmentOffsets[i];
+			if (view.fragmentOffsets[i + 1] - first != fragmentsMap[i].size())
+			{
+				LogError("Fragment count mismatch for stroke ", i);
+				Terminate();
+			}
+
+			for (auto j = 0u; j < fragmentsMap[i].size(); ++j)
+			{
+				if (view.fragments[first + j].idx != fragmentsMap[i][j].idx || view.fragments[first + j].value != fragmentsMap[i][j].value)
+				{
+					LogError("Fragment mismatch for stroke ", i);
+					Terminate();
+				}
+			}
+		}
+	}
+
+	// A checkpoint from another version must be rejected.
+	outBuffer[4]++;
+	CheckpointView<F32> view;
+	if (OpenCheckpoint(Span<const Byte>(outBuffer), view))
+	{
+		LogError("Accepted a checkpoint with a wrong version.");
+		Terminate();
+	}
+
+	// Truncation must be detected.
+	outBuffer[4]--;
+	if (OpenCheckpoint(Span<const Byte>(outBuffer.data(), outBuffer.size() / 2), view))
+	{
+		LogError("Accepted a truncated checkpoint.");
+		Terminate();
+	}
+
+	// The background writer must leave the newest committed snapshot behind.
+	{
+		CheckpointWriter<F32> writer(checkpointFile);
+		for (auto i = 0u; i < 8; ++i)
+		{
+			auto snapshot = writer.BeginSnapshot();
+			if (!snapshot)
+			{
+				writer.Flush();
+				snapshot = writer.BeginSnapshot();
+			}
+			if (!snapshot)
+			{
+				LogError("No snapshot is free after a flush.");
+				Terminate();
+			}
+			snapshot->state = state;
+			snapshot->state.step = i;
+			snapshot->strokes = strokes;
+			snapshot->widths = widths;
+			snapshot->pigments = pigments;
+			writer.CommitSnapshot(snapshot);
+		}
+		writer.Flush();
+
+		MappedFile file;
+		if (!file.Open(checkpointFile) || !OpenCheckpoint(file.GetData(), view) || view.state.step != 7 || !view.fragmentOffsets.empty())
+		{
+			LogError("Background checkpoint is missing or stale.");
+			Terminate();
+		}
+	}
+
+	RemoveFile(checkpointFile);
+}
@@ -0,0 +1,149 @@
+// Copyright 2024 Mihail Mladenov
+//
+// This file is part of PencilAnnealing.
+//
+// PencilAnnealing is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PencilAnnealing is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PencilAnnealing.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Random.hpp"
+#include "Convolution.hpp"
+
+using namespace PA;
+
+// Integer pixel values keep every sum exact, so the tiled and separable
+// paths have to match the direct convolution bit for bit.
+auto RandomImage(U32 width, U32 height, EFormat format) -> RawCPUImage
+{
+	RawCPUImage image(width, height, format, true);
+	for (auto y = 0u; y < height; ++y)
+	{
+		for (auto x = 0u; x < width; ++x)
+		{
+			auto value = GetUniformU32(0, 255);
+			auto idx = LebesgueCurve(x, y);
+			if (format == EFormat::A8)
+			{
+				image.data[idx] = value;
+			}
+			else
+			{
+				((F32*)image.data.data())[idx] = F32(value);
+			}
+		}
+	}
+	return image;
+}
+
+
+auto GetPixel(const RawCPUImage& image, I32 x, I32 y) -> F32
+{
+	if (x < 0 || y < 0 || x >= I32(image.width) || y >= I32(image.height))
+	{
+		return 0;
+	}
+	auto idx = LebesgueCurve(x, y);
+	return image.format == EFormat::A8 ? F32(image.data[idx]) : ((const F32*)image.data.data())[idx];
+}
+
+
+template <typename TKernel>
+auto Reference(const TKernel& kernel, const RawCPUImage& input, U32 x, U32 y) -> F32
+{
+	I32 offsetX = (kernel.dimension0 - 1) / 2;
+	I32 offsetY = (kernel.dimension1 - 1) / 2;
+	F32 accumulator = 0;
+	for (auto j = 0u; j < kernel.dimension1; ++j)
+	{
+		for (auto k = 0u; k < kernel.dimension0; ++k)
+		{
+			accumulator += GetPixel(input, x - offsetX + k, y - offsetY + j) * kernel.data[j * kernel.dimension0 + k];
+		}
+	}
+	return accumulator;
+}
+
+
+template <typename TKernel>
+auto TestKernel(ThreadPool<>& threadPool, const TKernel& kernel, const RawCPUImage& input) -> V
+{
+	auto result = Convolute(threadPool, kernel, input);
+	for (auto y = 0u; y < input.lebesgueStride; ++y)
+	{
+		for (auto x = 0u; x < input.lebesgueStride; ++x)
+		{
+			auto inside = x < input.width && y < input.height;
+			auto expected = inside ? Reference(kernel, input, x, y) : 0.f;
+			if (((const F32*)result.data.data())[LebesgueCurve(x, y)] != expected)
+			{
+				LogError("Convolution of a ", input.width, "x", input.height, " image differs at ", x, ", ", y, ".");
+				Terminate();
+			}
+		}
+	}
+}
+
+
+auto TestGradientMagnitude(ThreadPool<>& threadPool, const RawCPUImage& input) -> V
+{
+	auto result = GradientMagnitude(threadPool, input);
+	for (auto y = 0u; y < input.height; ++y)
+	{
+		for (auto x = 0u; x < input.width; ++x)
+		{
+			auto gX = Reference(SobelX<F32, 1>, input, x, y);
+			auto gY = Reference(SobelY<F32, 1>, input, x, y);
+			auto magnitude = Sqrt(gX * gX + gY * gY);
+			if (result.data[LebesgueCurve(x, y)] != Byte(magnitude < 150 ? magnitude : 255))
+			{
+				LogError("Gradient magnitude differs at ", x, ", ", y, ".");
+				Terminate();
+			}
+		}
+	}
+}
+
+
+I32 main()
+{
+	static constexpr auto binomial = Kernel<F32, 1, 5, 5>
+	(
+		1.f, 4.f, 6.f, 4.f, 1.f,
+		2.f, 8.f, 12.f, 8.f, 2.f,
+		1.f, 4.f, 6.f, 4.f, 1.f,
+		0.f, 0.f, 0.f, 0.f, 0.f,
+		-1.f, -4.f, -6.f, -4.f, -1.f
+	);
+	static constexpr auto skewed = Kernel<F32, 1, 3, 3>(1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f, 8.f, 10.f);
+	static constexpr auto wide = Kernel<F32, 1, 4, 2>(0.f, 1.f, -2.f, 3.f, 5.f, 0.f, 1.f, 1.f);
+
+	static_assert(SobelX<F32, 1>.separable && SobelY<F32, 1>.separable && binomial.separable);
+	static_assert(!skewed.separable && !wide.separable);
+
+	ThreadPool<> threadPool;
+
+	static constexpr StaticArray<Pair<U32, U32>, 4> sizes = { { { 1, 1 }, { 5, 9 }, { 91, 37 }, { 130, 200 } } };
+	for (auto [width, height] : sizes)
+	{
+		for (auto format : { EFormat::A8, EFormat::A32Float })
+		{
+			auto input = RandomImage(width, height, format);
+			TestKernel(threadPool, SobelX<F32, 1>, input);
+			TestKernel(threadPool, binomial, input);
+			TestKernel(threadPool, skewed, input);
+			TestKernel(threadPool, wide, input);
+			TestGradientMagnitude(threadPool, input);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,108 @@
+// Copyright 2024 Mihail Mladenov
+//
+// This file is part of PencilAnnealing.
+//
+// PencilAnnealing is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PencilAnnealing is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PencilAnnealing.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Error.hpp"
+#include "Logging.hpp"
+#include "Random.hpp"
+#include "Bezier.hpp"
+#include "QuadTree.hpp"
+
+using namespace PA;
+
+using Curve = QuadraticBezier<F32, 2>;
+
+// Every curve whose bounds contain a point has to be among the primitives
+// around it.
+auto Check(const QuadTree<Curve>& tree, const Array<Curve>& curves) -> V
+{
+	for (auto i = 0u; i < 256; ++i)
+	{
+		auto p = Vec2(GetUniformFloat(0.f, 1.f), GetUniformFloat(0.f, 1.f));
+		auto around = tree.GetPrimitivesAround(p);
+		for (auto& curve : curves)
+		{
+			if (curve.GetBBox().Contains(p) && Find(around.begin(), around.end(), curve) == around.end())
+			{
+				LogError("A curve is missing around (", p[0], ", ", p[1], ").");
+				Terminate();
+			}
+		}
+	}
+}
+
+
+I32 main()
+{
+	Array<Curve> curves;
+	for (auto i = 0u; i < 1000; ++i)
+	{
+		curves.push_back(GetRandom2DQuadraticBezierInRange(0.05f, 0.f, 0.9f));
+	}
+
+	QuadTree<Curve> tree;
+	tree.Build(curves);
+	Check(tree, curves);
+	if (!tree.GetPrimitivesAround(Vec2(-1.f, -1.f)).empty())
+	{
+		LogError("Curves were found outside the bounds.");
+		Terminate();
+	}
+
+	auto serialized = tree.GetSerializedPrimitives();
+	if (serialized.size() < curves.size())
+	{
+		LogError("Only ", serialized.size(), " of ", curves.size(), " curves are in the leaves.");
+		Terminate();
+	}
+	if (Find(curves.begin(), curves.end(), tree.GetRandomPrimitive()) == curves.end())
+	{
+		LogError("A random primitive is not one of the curves.");
+		Terminate();
+	}
+
+	// Slabs outgrow their room and move while curves come and go.
+	for (auto i = 0u; i < 2000; ++i)
+	{
+		auto idx = GetUniformU32(0, U32(curves.size()) - 1);
+		tree.Remove(curves[idx]);
+		curves[idx] = curves.back();
+		curves.pop_back();
+
+		for (auto j = 0u; j < 2; ++j)
+		{
+			auto curve = GetRandom2DQuadraticBezierInRange(0.05f, 0.f, 0.9f);
+			if (tree.Bounds(curve))
+			{
+				tree.Add(curve);
+				curves.push_back(curve);
+			}
+		}
+	}
+	Check(tree, curves);
+
+	// Removed curves are gone from every leaf.
+	for (auto& curve : tree.GetSerializedPrimitives())
+	{
+		if (Find(curves.begin(), curves.end(), curve) == curves.end())
+		{
+			LogError("A removed curve is still in the tree.");
+			Terminate();
+		}
+	}
+
+	return 0;
+}
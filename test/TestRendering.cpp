@@ -0,0 +1,100 @@
+// Copyright 2024 Mihail Mladenov
+//
+// This file is part of PencilAnnealing.
+//
+// PencilAnnealing is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PencilAnnealing is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PencilAnnealing.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "Error.hpp"
+#include "Logging.hpp"
+#include "Random.hpp"
+#include "Rendering.hpp"
+
+#include <cstring>
+
+using namespace PA;
+
+auto main() -> I32
+{
+	// Strokes piled on a few pixels until the fixed point sums wrap come off
+	// again in another order and leave the surface exactly as it was.
+	{
+		RawCPUImage surface(8, 8, EFormat::A16Fixed, true);
+		surface.Clear(ToFixed(1.f));
+		auto cleared = surface.data;
+
+		auto extentSize = surface.lebesgueStride * surface.lebesgueStride;
+		Array<Array<Fragment>> strokes(1000);
+		for (auto& fragments : strokes)
+		{
+			fragments.resize(GetUniformU32(1, 32));
+			for (auto& fragment : fragments)
+			{
+				fragment = Fragment(GetUniformU32(0, extentSize - 1), GetUniformFloat(0.f, 1.f));
+			}
+			SubtractFragmentsFromHDRSurface(fragments, surface);
+		}
+
+		auto wrapped = false;
+		for (auto i = 0u; i < extentSize; ++i)
+		{
+			wrapped = wrapped || ((const I16*)surface.data.data())[i] > ToFixed(1.f);
+		}
+		if (!wrapped)
+		{
+			LogError("The strokes did not pile up beyond the fixed point range.");
+			Terminate();
+		}
+
+		for (auto i = U32(strokes.size()); i > 1; --i)
+		{
+			Swap(strokes[i - 1], strokes[GetUniformU32(0, i - 1)]);
+		}
+		for (const auto& fragments : strokes)
+		{
+			AddFragmentsOnHDRSurface(fragments, surface);
+		}
+
+		if (memcmp(surface.data.data(), cleared.data(), cleared.size()))
+		{
+			LogError("Removing every stroke did not restore the fixed point surface.");
+			Terminate();
+		}
+	}
+
+	// Sums are representable exactly within 16 bits.
+	if (!FitsFixed(32767) || FitsFixed(32768) || !FitsFixed(-32768) || FitsFixed(-32769))
+	{
+		LogError("FitsFixed does not match the 16 bit range.");
+		Terminate();
+	}
+
+	// Decoding saturates and is off by at most one from the A8 value.
+	if (FixedToU8(ToFixed(-3.f)) != 0 || FixedToU8(ToFixed(5.f)) != 255)
+	{
+		LogError("FixedToU8 does not saturate.");
+		Terminate();
+	}
+	for (auto i = 0; i < 256; ++i)
+	{
+		auto decoded = I32(FixedToU8(ToFixed(F32(i) / 255.f)));
+		if (decoded < i - 1 || decoded > i)
+		{
+			LogError("Lightness ", i, " decodes to ", decoded, ".");
+			Terminate();
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,268 @@
+// Copyright 2024 Mihail Mladenov
+//
+// This file is part of PencilAnnealing.
+//
+// PencilAnnealing is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PencilAnnealing is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PencilAnnealing.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Random.hpp"
+#include "StrokeStore.hpp"
+
+using namespace PA;
+
+auto TestStore(B compact) -> V
+{
+	StrokeStore<F32> store(compact);
+	Array<Array<Fragment>> expected;
+	Array<StrokeHandle> handles;
+	Array<Fragment> scratch;
+	Array<U32> nearby;
+
+	auto check =
+	[&]()
+	{
+		if (store.Size() != expected.size())
+		{
+			LogError("Store holds ", store.Size(), " strokes instead of ", expected.size(), ".");
+			Terminate();
+		}
+		for (auto i = 0u; i < store.Size(); ++i)
+		{
+			auto fragments = store.GetFragments(i, scratch);
+			if (fragments.size() != expected[i].size())
+			{
+				LogError("Stroke ", i, " has ", fragments.size(), " fragments instead of ", expected[i].size(), ".");
+				Terminate();
+			}
+			for (auto j = 0u; j < fragments.size(); ++j)
+			{
+				if (fragments[j].idx != expected[i][j].idx || fragments[j].value != expected[i][j].value)
+				{
+					LogError("Fragments of stroke ", i, " do not match.");
+					Terminate();
+				}
+			}
+			if (store.GetIndex(handles[i]) != i)
+			{
+				LogError("Handle of stroke ", i, " points elsewhere.");
+				Terminate();
+			}
+
+			nearby.clear();
+			store.QueryRegion(store.GetCurve(i).GetBBox(), nearby);
+			if (Find(nearby.begin(), nearby.end(), i) == nearby.end())
+			{
+				LogError("Stroke ", i, " is missing from the index.");
+				Terminate();
+			}
+		}
+	};
+
+	// Sorted and unique like rasterized fragments, with the occasional gap
+	// too large for a single delta.
+	auto randomFragments =
+	[&](Array<Fragment>& fragments)
+	{
+		fragments.resize(GetUniformU32(0, 300));
+		auto idx = GetUniformU32(0, 1u << 20);
+		for (auto& frag : fragments)
+		{
+			frag = Fragment(idx, GetUniformFloat(0.f, 1.f));
+			idx += GetUniformU32(0, 15) ? GetUniformU32(1, 64) : GetUniformU32(1, 1u << 22);
+		}
+		if (compact)
+		{
+			QuantizeFragments(fragments);
+		}
+	};
+
+	Array<Fragment> fragments;
+	for (auto i = 0u; i < 2000; ++i)
+	{
+		// The index is built from the strokes present, then kept up to date.
+		if (i == 1000)
+		{
+			store.SetIndexed(true);
+		}
+
+		auto operation = store.Empty() ? 0 : GetUniformU32(0, 2);
+		if (operation == 0)
+		{
+			randomFragments(fragments);
+			handles.push_back(store.Add(GetRandom2DQuadraticBezierInRange(1.f), 1.f, 0.5f, fragments));
+			expected.push_back(fragments);
+		}
+		else if (operation == 1)
+		{
+			auto idx = GetUniformU32(0, store.Size() - 1);
+			randomFragments(fragments);
+			store.Update(idx, GetRandom2DQuadraticBezierInRange(1.f), 2.f, 0.25f, fragments);
+			expected[idx] = fragments;
+		}
+		else
+		{
+			auto idx = GetUniformU32(0, store.Size() - 1);
+			auto removed = handles[idx];
+			store.Remove(idx);
+			handles[idx] = handles.back();
+			handles.pop_back();
+			expected[idx] = Move(expected.back());
+			expected.pop_back();
+
+			if (store.IsValid(removed))
+			{
+				LogError("Handle of a removed stroke is still valid.");
+				Terminate();
+			}
+		}
+	}
+	check();
+
+	// Grown slabs keep their contents and take their room from the reserve only.
+	store.ReserveFragments(1000);
+	for (auto i = 0u; i < store.Size(); ++i)
+	{
+		auto grown = expected[i];
+		grown.push_back(Fragment(grown.empty() ? 0 : grown.back().idx + 1, 0.f));
+		if (!store.GrowSlab(i, grown))
+		{
+			break;
+		}
+	}
+	check();
+
+	// The offsets delimit every stroke in order.
+	Array<U64> offsets;
+	Array<Fragment> flattened;
+	store.CopyFragments(offsets, flattened);
+	if (offsets.size() != store.Size() + 1 || offsets.back() != flattened.size())
+	{
+		LogError("Offsets do not delimit the copied fragments.");
+		Terminate();
+	}
+	for (auto i = 0u; i < store.Size(); ++i)
+	{
+		if (offsets[i + 1] - offsets[i] != expected[i].size() || (!expected[i].empty() && flattened[offsets[i]].idx != expected[i].front().idx))
+		{
+			LogError("Copied fragments of stroke ", i, " do not match.");
+			Terminate();
+		}
+	}
+}
+
+
+I32 main()
+{
+	TestStore(false);
+	TestStore(true);
+
+	// With a budget the oldest writes are dropped but keep their range, and
+	// become resident again once their fragments are set.
+	{
+		StrokeStore<F32> store;
+		store.SetFragmentsBudget(16 * sizeof(Fragment));
+		Array<Fragment> strokeFragments;
+		for (auto i = 0u; i < 16; ++i)
+		{
+			strokeFragments = { Fragment(i * 100, 0.5f), Fragment(i * 100 + 1, 0.5f), Fragment(i * 100 + 7, 0.5f) };
+			store.Add(GetRandom2DQuadraticBezierInRange(1.f), 1.f, 0.5f, strokeFragments);
+		}
+		if (store.GetResidentFragmentsCount() > 16 || !store.IsResident(15) || store.IsResident(0))
+		{
+			LogError("The budget did not evict the oldest strokes.");
+			Terminate();
+		}
+		auto [first, last] = store.GetFragmentsRange(0);
+		if (store.GetFragmentsCount(0) != 3 || first != 0 || last != 7)
+		{
+			LogError("An evicted stroke lost its count or range.");
+			Terminate();
+		}
+
+		store.SetFragments(0, strokeFragments);
+		Array<Fragment> scratch;
+		if (!store.IsResident(0) || store.GetFragments(0, scratch).size() != 3)
+		{
+			LogError("Setting the fragments of an evicted stroke did not restore them.");
+			Terminate();
+		}
+	}
+
+	// Strokes in use stay while the others are dropped, and the room left by
+	// dropped and moved slabs is reused instead of growing the pool.
+	{
+		static constexpr U64 budgetBytes = 64 * sizeof(Fragment);
+		StrokeStore<F32> store;
+		store.SetFragmentsBudget(budgetBytes);
+		Array<Fragment> strokeFragments;
+		for (auto i = 0u; i < 2000; ++i)
+		{
+			strokeFragments.resize(GetUniformU32(1, 8));
+			for (auto j = 0u; j < strokeFragments.size(); ++j)
+			{
+				strokeFragments[j] = Fragment(j, 0.5f);
+			}
+
+			if (!store.Empty())
+			{
+				store.Touch(0);
+			}
+			// Like the tiled annealing does every phase.
+			if (i % 100 == 99)
+			{
+				store.ReserveFragments(store.GetResidentFragmentsCount());
+			}
+			if (store.Size() < 16)
+			{
+				store.Add(GetRandom2DQuadraticBezierInRange(1.f), 1.f, 0.5f, strokeFragments);
+				continue;
+			}
+			store.Update(GetUniformU32(1, store.Size() - 1), store.GetCurve(0), 1.f, 0.5f, strokeFragments);
+		}
+
+		if (!store.IsResident(0))
+		{
+			LogError("A stroke in use was dropped.");
+			Terminate();
+		}
+		if (store.GetPoolBytes() > budgetBytes + budgetBytes / 4)
+		{
+			LogError("The fragment pool takes ", store.GetPoolBytes(), " bytes of a budget of ", budgetBytes, ".");
+			Terminate();
+		}
+	}
+
+	// Gaps beyond a single escape round trip and values stay within a step.
+	Array<Fragment> fragments = { Fragment(0, 0.3f), Fragment(0xFFFFFFFFu, 1.f) };
+	for (auto i = 0u; i < 37; ++i)
+	{
+		fragments.insert(fragments.end() - 1, Fragment(70000 + i * i, GetUniformFloat(0.f, 1.f)));
+	}
+
+	Array<CompactFragment> encoded(GetCompactSize(fragments));
+	EncodeFragments(fragments, encoded.data());
+	Array<Fragment> decoded(fragments.size());
+	if (DecodeFragments(fragments.front().idx, encoded, decoded.data()) != fragments.size())
+	{
+		LogError("Compact fragments decode to the wrong count.");
+		Terminate();
+	}
+	for (auto i = 0u; i < fragments.size(); ++i)
+	{
+		if (decoded[i].idx != fragments[i].idx || Abs(decoded[i].value - fragments[i].value) > 1.f / 65535.f)
+		{
+			LogError("Compact fragment ", i, " does not round trip.");
+			Terminate();
+		}
+	}
+}
@@ -0,0 +1,107 @@
+// Copyright 2024 Mihail Mladenov
+//
+// This file is part of PencilAnnealing.
+//
+// PencilAnnealing is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PencilAnnealing is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PencilAnnealing.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Error.hpp"
+#include "Logging.hpp"
+#include "Random.hpp"
+#include "SumTree.hpp"
+
+using namespace PA;
+
+// Checks the tree against a linear scan of the prefix sums. Weights are
+// small integers so every sum is exact.
+auto Check(const SumTree<F32>& tree, const Array<F32>& weights) -> V
+{
+	F32 total = 0;
+	for (auto i = 0u; i < weights.size(); ++i)
+	{
+		if (tree.Get(i) != weights[i])
+		{
+			LogError("Weight ", i, " is ", tree.Get(i), " instead of ", weights[i], ".");
+			Terminate();
+		}
+		total += weights[i];
+	}
+	if (tree.GetTotal() != total)
+	{
+		LogError("Total is ", tree.GetTotal(), " instead of ", total, ".");
+		Terminate();
+	}
+	if (total == 0)
+	{
+		return;
+	}
+
+	F32 prefix = 0;
+	for (auto i = 0u; i < weights.size(); ++i)
+	{
+		if (weights[i] > 0)
+		{
+			auto inside = prefix + weights[i] / 2;
+			if (tree.Find(prefix) != i || tree.Find(inside) != i)
+			{
+				LogError("Prefix sum ", prefix, " was not found in weight ", i, ".");
+				Terminate();
+			}
+		}
+		prefix += weights[i];
+	}
+
+	// Past the total the last index with weight comes back.
+	auto last = U32(weights.size()) - 1;
+	while (weights[last] == 0)
+	{
+		last--;
+	}
+	if (tree.Find(total) != last)
+	{
+		LogError("Total was not found in the last weight ", last, ".");
+		Terminate();
+	}
+}
+
+
+I32 main()
+{
+	for (auto size : { 1u, 2u, 7u, 64u, 1000u })
+	{
+		Array<F32> weights(size);
+		for (auto& weight : weights)
+		{
+			weight = F32(GetUniformU32(0, 3) ? GetUniformU32(0, 100) : 0);
+		}
+
+		SumTree<F32> tree;
+		tree.Build(weights);
+		if (tree.Size() != size)
+		{
+			LogError("Tree holds ", tree.Size(), " weights instead of ", size, ".");
+			Terminate();
+		}
+		Check(tree, weights);
+
+		for (auto i = 0u; i < 4 * size; ++i)
+		{
+			auto idx = GetUniformU32(0, size - 1);
+			weights[idx] = F32(GetUniformU32(0, 1) ? GetUniformU32(0, 100) : 0);
+			tree.Set(idx, weights[idx]);
+		}
+		Check(tree, weights);
+	}
+
+	return 0;
+}
@@ -37,6 +37,96 @@ I32 main(I32 argc, const C** argv)
 		}
 	}
 
+	{
+		static constexpr U32 stride = 32;
+		static constexpr U32 width = 27;
+		static constexpr U32 height = 21;
+		static constexpr U32 linearStride = 30;
+		auto copy = [](const U32* in, U32* out, U32 count) { MemCopy(Span<const U32>(in, count), out); };
+
+		Array<U32> lebesgue(stride * stride);
+		for (auto i = 0u; i < lebesgue.size(); ++i)
+		{
+			lebesgue[i] = i;
+		}
+
+		Array<U32> linear(height * linearStride, ~0u);
+		LebesgueToLinear(lebesgue.data(), linear.data(), linearStride, width, 0, height, copy);
+
+		Array<U32> roundTrip(stride * stride, ~0u);
+		LinearToLebesgue(linear.data(), linearStride, roundTrip.data(), width, height, copy);
+
+		for (auto y = 0u; y < height; ++y)
+		{
+			for (auto x = 0u; x < linearStride; ++x)
+			{
+				auto expected = x < width ? LebesgueCurve(x, y) : ~0u;
+				if (linear[y * linearStride + x] != expected)
+				{
+					LogError("LebesgueToLinear wrote ", linear[y * linearStride + x], " at (", x, ", ", y, ")");
+					Terminate();
+				}
+			}
+		}
+
+		for (auto i = 0u; i < roundTrip.size(); ++i)
+		{
+			auto [x, y] = LebesgueCurveInverse(i);
+			auto expected = x < width && y < height ? i : ~0u;
+			if (roundTrip[i] != expected)
+			{
+				LogError("LinearToLebesgue wrote ", roundTrip[i], " at ", i);
+				Terminate();
+			}
+		}
+	}
+
+	// Ranges come in order, cover the image and leave the padding tiles out.
+	{
+		static constexpr U32 width = 1025;
+		static constexpr U32 height = 1025;
+
+		U32 covered = 0;
+		U32 previousEnd = 0;
+		Array<Byte> visited(2048 * 2048, 0);
+		ForEachLebesgueRange
+		(
+			width,
+			height,
+			[&](U32 begin, U32 end)
+			{
+				if (begin < previousEnd || begin >= end)
+				{
+					LogError("ForEachLebesgueRange gave the range [", begin, ", ", end, ") out of order.");
+					Terminate();
+				}
+				previousEnd = end;
+				covered += end - begin;
+				for (auto i = begin; i < end; ++i)
+				{
+					visited[i] = 1;
+				}
+			}
+		);
+
+		for (auto y = 0u; y < height; ++y)
+		{
+			for (auto x = 0u; x < width; ++x)
+			{
+				if (!visited[LebesgueCurve(x, y)])
+				{
+					LogError("ForEachLebesgueRange missed (", x, ", ", y, ")");
+					Terminate();
+				}
+			}
+		}
+		if (covered >= 2 * width * height)
+		{
+			LogError("ForEachLebesgueRange covered ", covered, " pixels.");
+			Terminate();
+		}
+	}
+
 	static constexpr U32 latticeSize = 300;
 	static constexpr F32 tolerance = 0.01f;
 	U32 rootsFound = 0;